@@ -0,0 +1,21 @@
+#ifndef _AOT_H
+#define _AOT_H
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+namespace registervm {
+// Compiles an rvm file ahead of time into a standalone C++ translation unit,
+// to be built with "c++ -std=c++17 -O3". Every register becomes a local
+// variable and every instruction a labelled statement, with computed GOTOs
+// as a switch over the instructions, and the program behaves as run() does.
+// It prints its result, or with --bench=<runs> <instructions> times runs as
+// "vm bench" does and prints a line of results for file under the engine
+// name "aot". Reports the problem on cerr and returns false if the file
+// does not load.
+bool translateToCpp(const void *program, size_t programSize,
+                    const std::string &file, std::ostream &output);
+} // namespace registervm
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <cstddef>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define HAVE_GUARD_PAGES
+#endif
+
+namespace registervm {
+// One area of an arena: size bytes, followed straight after its last byte by
+// guardSize bytes, rounded up to whole pages, that can never be touched.
+// start is filled in by Arena::reserve.
+struct ArenaArea {
+  size_t size;
+  size_t guardSize;
+  void *start;
+};
+
+// The memory of a Vm, reserved as one range of address space. Pages are only
+// backed once they are touched, and an access that strays off the end of an
+// area faults in its guard rather than reaching whatever the process keeps
+// next to it. Where the platform cannot reserve address space, the areas are
+// allocated outright and have no guards.
+class Arena {
+public:
+  Arena();
+  ~Arena();
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Reserves the areas, zeroed. Throws std::bad_alloc if the address space
+  // cannot be had.
+  void reserve(ArenaArea *areas, size_t count);
+  // Zeroes size bytes from start, inside an area. Long runs of whole pages
+  // are handed back to the system rather than written, so they again cost
+  // nothing until touched.
+  void clear(void *start, size_t size);
+  // Calls body(argument) and returns true, or returns false as soon as it
+  // touches a guard of this arena. The first call installs handlers for
+  // SIGSEGV and SIGBUS that pass every other fault on to the handlers they
+  // replaced. body must not own anything that needs destroying, since a
+  // fault abandons it where it stands.
+  bool guarded(void (*body)(void *), void *argument) const;
+
+private:
+  char *base;
+  size_t length;
+};
+} // namespace registervm
+
+#endif
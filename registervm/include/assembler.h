@@ -1,10 +1,16 @@
 #ifndef _ASSEMBLER_H
 #define _ASSEMBLER_H
 
-#include <iostream>
+#include <ostream>
+#include <string_view>
 
-namespace bytecode {
-void assemble(std::istream &input, std::ostream &output);
+namespace registervm {
+// Assembles source and writes the bytecode file to output, in time linear in
+// the length of source: words are read in place, mnemonics are looked up in
+// a perfect hash table, and labels are filled in with one pass at the end.
+// Returns false, having said why, if source is not a valid program, in which
+// case nothing is written.
+bool assemble(std::string_view source, std::ostream &output);
 }
 
 #endif
\ No newline at end of file
@@ -1,15 +1,30 @@
 #ifndef _BYTECODE_H
 #define _BYTECODE_H
 
+#include <cstddef>
 #include <cstdint>
 
-namespace bytecode {
+namespace registervm {
 #define BYTECODE_MAGIC 0xC76A89B9
+#define CURRENT_BYTECODE_VERSION 2
+// The instructions start at this alignment, counted from the start of the
+// file, so a file mapped into memory can be read where it lies.
+#define INSTRUCTIONS_ALIGNMENT 16
+
+// The instructions follow the header at the offset it gives, with zero
+// padding before them.
 struct Header {
   uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t instructionsOffset;
+  // In words.
+  uint32_t instructionCount;
 };
 
 #define NUM_REGISTERS 8
+// Words of memory, which memory operands index with a register.
+#define MEMORY_SIZE 2048
 struct Instruction {
   uint16_t opcode : 7;
   /*bool*/ uint16_t hasImmediate : 1;
@@ -23,7 +38,107 @@ struct Instruction {
 };
 static_assert(sizeof(Instruction) == 4,
               "Instruction must be packed to four bytes");
-enum class Opcode { MOV, ADD, SUB, MUL, DIV, GOTO, PRINT, EXIT };
-} // namespace bytecode
+// Two-source instructions compute dst = src2 op src1, so "sub 1, r0, r0"
+// decrements r0. src1 may be an immediate; src2 and dst are registers, or
+// memory when dereferenced.
+enum class Opcode {
+  MOV,
+  ADD,
+  SUB,
+  MUL,
+  DIV,
+  GOTO,
+  PRINT,
+  EXIT,
+  AND,
+  OR,
+  XOR,
+  SHL,
+  SHR,
+  // mov of a value too large for the immediate field. The value follows the
+  // instruction as two literal words, low half first.
+  MOVW,
+  // Compare src2 with src1 and jump if src2 is equal, not equal, less than
+  // or greater than src1. The target follows the instruction as a literal
+  // word.
+  BEQ,
+  BNE,
+  BLT,
+  BGT,
+  // Stops the program and reports its single operand as the result.
+  HALT
+};
+
+// Calls X(name) for every opcode, in the order of the enum.
+#define FOR_EACH_OPCODE(X)                                                     \
+  X(MOV)                                                                       \
+  X(ADD)                                                                       \
+  X(SUB)                                                                       \
+  X(MUL)                                                                       \
+  X(DIV)                                                                       \
+  X(GOTO)                                                                      \
+  X(PRINT)                                                                     \
+  X(EXIT)                                                                      \
+  X(AND)                                                                       \
+  X(OR)                                                                        \
+  X(XOR)                                                                       \
+  X(SHL)                                                                       \
+  X(SHR)                                                                       \
+  X(MOVW)                                                                      \
+  X(BEQ)                                                                       \
+  X(BNE)                                                                       \
+  X(BLT)                                                                       \
+  X(BGT)                                                                       \
+  X(HALT)
+
+#define COUNT_OPCODE(opcode) +1
+constexpr size_t OPCODE_COUNT = 0 FOR_EACH_OPCODE(COUNT_OPCODE);
+#undef COUNT_OPCODE
+
+// Range of the 12 bit immediate field.
+#define MIN_IMMEDIATE (-2048)
+#define MAX_IMMEDIATE 2047
+
+constexpr bool isConditionalBranch(Opcode opcode) {
+  return opcode == Opcode::BEQ || opcode == Opcode::BNE ||
+         opcode == Opcode::BLT || opcode == Opcode::BGT;
+}
+
+// How many 32 bit literal words follow an instruction with this opcode.
+// Jump targets count literal words, so they never point at one.
+constexpr size_t literalWordCount(Opcode opcode) {
+  return opcode == Opcode::MOVW ? 2 : isConditionalBranch(opcode) ? 1 : 0;
+}
+
+// Whether an instruction with this opcode reads both src1 and src2.
+constexpr bool hasTwoSources(Opcode opcode) {
+  return (opcode >= Opcode::ADD && opcode <= Opcode::DIV) ||
+         (opcode >= Opcode::AND && opcode <= Opcode::SHR) ||
+         isConditionalBranch(opcode);
+}
+
+// Which register fields an instruction uses, as a value or as the address of
+// a memory operand. The others are ignored, memory flags and all.
+constexpr bool usesSrc1(Opcode opcode, bool hasImmediate) {
+  return !hasImmediate && (opcode == Opcode::MOV || hasTwoSources(opcode));
+}
+constexpr bool usesSrc2(Opcode opcode) { return hasTwoSources(opcode); }
+constexpr bool usesDst(Opcode opcode, bool hasImmediate) {
+  switch (opcode) {
+  case Opcode::GOTO:
+  case Opcode::PRINT:
+  case Opcode::HALT:
+    return !hasImmediate;
+  case Opcode::EXIT:
+  case Opcode::BEQ:
+  case Opcode::BNE:
+  case Opcode::BLT:
+  case Opcode::BGT:
+    return false;
+  default:
+    return (size_t)opcode < OPCODE_COUNT;
+  }
+}
+} // namespace registervm
 
 #endif
\ No newline at end of file
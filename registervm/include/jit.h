@@ -0,0 +1,40 @@
+#ifndef _JIT_H
+#define _JIT_H
+
+#include "bytecode.h"
+#include "registervm.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace registervm {
+enum class JitStatus : uint32_t {
+  EXIT,
+  // HALT, with the result stored through the result pointer.
+  HALT,
+  DIVIDE_BY_ZERO,
+  // A GOTO to something that is not an instruction.
+  BAD_JUMP,
+  END_OF_PROGRAM,
+  MEMORY_OUT_OF_BOUNDS
+};
+
+// Runs the compiled program on the VM's registers and memory. The registers
+// are loaded into host registers on entry and written back on return.
+typedef JitStatus (*JitFunction)(int64_t *registers, int64_t *memory,
+                                 int64_t *result);
+
+// Native x86-64 code for a whole program, in its own executable mapping.
+struct JitCode {
+  void *memory;
+  size_t size;
+  JitFunction entry;
+};
+
+// Compiles instructions to native code. Returns false if the program cannot
+// be compiled.
+bool jitCompile(const Instruction *instructions, size_t instructionCount,
+                JitCode &code);
+void jitRelease(JitCode &code);
+} // namespace registervm
+
+#endif
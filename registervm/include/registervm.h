@@ -0,0 +1,126 @@
+#ifndef _REGISTERVM_H
+#define _REGISTERVM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// The register VM as a library. Load a program into a Module once, then run
+// it on as many Vm instances as needed. A loaded Module is never modified, so
+// instances on different threads can share it.
+namespace registervm {
+// Whether this build can compile programs to native code.
+bool jitAvailable();
+
+struct RunOptions {
+  // Compile the program to native code instead of interpreting it.
+  bool jit;
+  // Charge every GOTO and branch taken against the fuel given to
+  // Vm::setFuel, and stop with OUT_OF_FUEL when it runs out, in a state that
+  // Vm::resume() continues from. Every loop goes through a jump, so this
+  // bounds any program. Compiled code cannot be metered, so this overrides
+  // jit.
+  bool metered;
+};
+
+enum class Status {
+  // The program reached EXIT.
+  EXITED,
+  // The program reached HALT. Vm::result() holds its operand.
+  FINISHED,
+  DIVIDE_BY_ZERO,
+  INVALID_JUMP,
+  END_OF_PROGRAM,
+  UNKNOWN_INSTRUCTION,
+  // A memory operand's address fell outside memory.
+  MEMORY_OUT_OF_BOUNDS,
+  // A metered program used up its fuel. Vm::resume() continues it.
+  OUT_OF_FUEL
+};
+
+// A description of a status other than EXITED and FINISHED, for error
+// messages.
+const char *statusMessage(Status status);
+
+struct ModuleData;
+struct VmState;
+
+class Module {
+public:
+  Module();
+  ~Module();
+  Module(const Module &) = delete;
+  Module &operator=(const Module &) = delete;
+
+  // Checks an rvm file and prepares it to run with the given options. data
+  // must be aligned to 16 bytes, as a mapped file is. The program is copied,
+  // so data may be freed afterwards. Reports the problem on cerr and returns
+  // false if the program cannot be run, leaving the module empty.
+  bool load(const void *data, size_t size, const RunOptions &options);
+  bool loaded() const;
+
+private:
+  friend class Vm;
+  friend bool countInstructions(const void *data, size_t size,
+                                uint64_t &count);
+  std::unique_ptr<ModuleData> data;
+};
+
+// One execution of a module: its own registers and memory. Creating a Vm
+// allocates its state once; run() and reset() never allocate. The first
+// run() installs handlers for SIGSEGV and SIGBUS that catch stray memory
+// operands, and pass every other fault on to the handlers they replaced.
+class Vm {
+public:
+  // module must be loaded and must outlive the Vm.
+  explicit Vm(const Module &module);
+  ~Vm();
+  Vm(const Vm &) = delete;
+  Vm &operator=(const Vm &) = delete;
+
+  // Runs the program from the start, with the registers and memory as they
+  // are.
+  Status run();
+  // Continues the program where it stopped, after run() or resume()
+  // returned OUT_OF_FUEL.
+  Status resume();
+  // How many more GOTOs and branches taken a metered program may make
+  // before it stops with OUT_OF_FUEL. There is no limit until this is
+  // called, and a module that is not metered ignores it.
+  void setFuel(uint64_t fuel);
+  // The operand of HALT, if run() returned FINISHED.
+  int64_t result() const;
+  // The registers and memory, which a caller may set before run() to pass in
+  // inputs and read afterwards.
+  int64_t *registers();
+  size_t registerCount() const;
+  int64_t *memory();
+  size_t memorySize() const;
+  // Zeroes the registers and memory, ready to run again.
+  void reset();
+  // Saves the state that resume() would continue from into image: the ip,
+  // the registers and the memory up to its last nonzero word. Taken after
+  // run() returns OUT_OF_FUEL, it lets a program do its setup once and then
+  // be restored and resumed from there as often as needed, in this process
+  // or another.
+  void snapshot(std::vector<uint8_t> &image) const;
+  // Replaces the state with one saved by snapshot() from a Vm of the same
+  // program, ready for resume(). image need not be aligned, so it can be a
+  // file mapped into memory. Reports the problem on cerr and returns false,
+  // leaving the state as it was, if it is not such a snapshot.
+  bool restore(const void *image, size_t size);
+
+private:
+  const Module &module;
+  std::unique_ptr<VmState> state;
+};
+
+// Interprets the program in an rvm file and counts the instructions it
+// executes, so benchmarks can report the time per instruction whether they
+// time the interpreter or the JIT. Reports the problem on cerr and returns
+// false if the program stops with an error.
+bool countInstructions(const void *data, size_t size, uint64_t &count);
+} // namespace registervm
+
+#endif
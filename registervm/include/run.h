@@ -1,10 +1,19 @@
 #ifndef _RUN_H
 #define _RUN_H
 
+#include "registervm.h"
 #include <cstddef>
+#include <cstdint>
+#include <string>
 
-namespace bytecode {
-void run(void *program, size_t programSize);
+namespace registervm {
+// Loads and runs an rvm file, printing the result or the error. With metered
+// options, the program stops once it has used up fuel, and if saveTo is not
+// empty its state is then saved there as a snapshot. With resumeFrom, the
+// program continues from the snapshot saved there instead of starting.
+void run(const void *program, size_t programSize, const RunOptions &options,
+         uint64_t fuel = UINT64_MAX, const std::string &saveTo = "",
+         const std::string &resumeFrom = "");
 }
 
-#endif
\ No newline at end of file
+#endif
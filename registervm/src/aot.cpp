@@ -0,0 +1,423 @@
+#include "aot.h"
+#include "bytecode.h"
+#include "registervm.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::ostream;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace registervm {
+// What every compiled program starts with. Arithmetic goes through unsigned
+// integers so that it wraps around as the interpreter's does, rather than
+// being undefined behaviour the host compiler may optimize on, and shift
+// counts are taken modulo 64, as x86-64 does in the interpreter.
+static const char *const PRELUDE = R"(#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+// Programs are translated an instruction at a time, so they can compare a
+// register with itself or divide by a zero that a check has already caught.
+#pragma GCC diagnostic ignored "-Wdiv-by-zero"
+#pragma GCC diagnostic ignored "-Wtautological-compare"
+
+enum class Outcome {
+  EXITED,
+  FINISHED,
+  DIVIDE_BY_ZERO,
+  INVALID_JUMP,
+  END_OF_PROGRAM,
+  UNKNOWN_INSTRUCTION,
+  MEMORY_OUT_OF_BOUNDS
+};
+
+static const char *message(Outcome outcome) {
+  switch (outcome) {
+  case Outcome::EXITED:
+    return "Exited";
+  case Outcome::FINISHED:
+    return "Finished";
+  case Outcome::DIVIDE_BY_ZERO:
+    return "Divide by zero";
+  case Outcome::INVALID_JUMP:
+    return "Invalid jump target";
+  case Outcome::END_OF_PROGRAM:
+    return "Ran off the end of the program";
+  case Outcome::MEMORY_OUT_OF_BOUNDS:
+    return "Memory address out of bounds";
+  case Outcome::UNKNOWN_INSTRUCTION:
+    break;
+  }
+  return "Unknown instruction";
+}
+
+static inline int64_t add(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a + (uint64_t)b);
+}
+static inline int64_t sub(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a - (uint64_t)b);
+}
+static inline int64_t mul(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a * (uint64_t)b);
+}
+static inline int64_t shl(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a << (b & 63));
+}
+static inline int64_t shr(int64_t a, int64_t b) { return a >> (b & 63); }
+
+static int64_t memory[MEMORY_SIZE];
+// The operand of HALT.
+static int64_t result;
+)";
+
+// Runs the program once from clean registers and memory, then prints its
+// result, or with --bench times it as "vm bench" does. SOURCE_FILE is
+// defined before it.
+static const char *const MAIN = R"(
+static Outcome run() {
+  memset(memory, 0, sizeof(memory));
+  result = 0;
+  return runProgram();
+}
+
+int main(int argc, char **argv) {
+  using std::chrono::steady_clock;
+  if (argc == 1) {
+    Outcome outcome = run();
+    if (outcome == Outcome::FINISHED) {
+      std::cout << "Finished with " << result << std::endl;
+    } else if (outcome != Outcome::EXITED) {
+      std::cerr << message(outcome) << std::endl;
+      return -1;
+    }
+    return 0;
+  }
+  if (argc != 3 || strncmp(argv[1], "--bench=", 8) != 0) {
+    std::cout << "Usage: " << argv[0] << " [--bench=<runs> <instructions>]"
+              << std::endl;
+    return -1;
+  }
+  size_t runCount = strtoul(argv[1] + 8, nullptr, 10);
+  double instructions = strtod(argv[2], nullptr);
+  if (runCount == 0) {
+    std::cerr << "Nothing to time" << std::endl;
+    return -1;
+  }
+  std::vector<double> times;
+  for (size_t i = 0; i <= runCount; i++) {
+    auto startTime = steady_clock::now();
+    Outcome outcome = run();
+    auto timeTaken = steady_clock::now() - startTime;
+    if (outcome != Outcome::EXITED && outcome != Outcome::FINISHED) {
+      std::cerr << message(outcome) << std::endl;
+      return -1;
+    }
+    if (i > 0) {
+      times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          timeTaken)
+                          .count());
+    }
+  }
+  double mean = 0;
+  for (double time : times) {
+    mean += time;
+  }
+  mean /= times.size();
+  double variance = 0;
+  for (double time : times) {
+    variance += (time - mean) * (time - mean);
+  }
+  if (times.size() > 1) {
+    variance /= times.size() - 1;
+  }
+  double fastest = *std::min_element(times.begin(), times.end());
+  std::cout << std::fixed << std::setprecision(0) << SOURCE_FILE << "\taot\t"
+            << runCount << '\t' << instructions << '\t' << mean << '\t'
+            << std::sqrt(variance) << '\t' << fastest << '\t'
+            << std::setprecision(3) << mean / instructions << '\t'
+            << std::setprecision(0) << instructions / (mean / 1e9)
+            << std::endl;
+  return 0;
+}
+)";
+
+static string literal(int64_t value) {
+  // -9223372036854775808 would be the negation of a literal too large for
+  // int64_t.
+  if (value == INT64_MIN) {
+    return "INT64_MIN";
+  }
+  if (value > INT32_MAX || value < INT32_MIN) {
+    return to_string(value) + "LL";
+  }
+  return to_string(value);
+}
+
+// The contents of a C++ string literal for text.
+static string quoted(const string &text) {
+  string result = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+    }
+    result += c;
+  }
+  return result + "\"";
+}
+
+static string labelName(size_t index) { return "L" + to_string(index); }
+
+static string registerOperand(unsigned reg, bool usesMemory) {
+  string name = "r" + to_string(reg);
+  return usesMemory ? "memory[" + name + "]" : name;
+}
+// The check that stops the program, as the interpreter does, before an
+// instruction that addresses memory outside MEMORY_SIZE, or nothing if it has
+// no memory operands.
+static string memoryCheck(const Instruction &instruction) {
+  Opcode opcode = (Opcode)instruction.opcode;
+  vector<unsigned> addresses;
+  if (instruction.src1UsesMemory &&
+      usesSrc1(opcode, instruction.hasImmediate)) {
+    addresses.push_back(instruction.src1);
+  }
+  if (instruction.src2UsesMemory && usesSrc2(opcode)) {
+    addresses.push_back(instruction.src2);
+  }
+  if (instruction.dstUsesMemory && usesDst(opcode, instruction.hasImmediate)) {
+    addresses.push_back(instruction.dst);
+  }
+  if (addresses.empty()) {
+    return "";
+  }
+  string condition;
+  for (unsigned reg : addresses) {
+    if (!condition.empty()) {
+      condition += " || ";
+    }
+    condition += "(uint64_t)r" + to_string(reg) + " >= MEMORY_SIZE";
+  }
+  return "  if (" + condition + ") {\n" +
+         "    return Outcome::MEMORY_OUT_OF_BOUNDS;\n" + "  }\n";
+}
+static string src1(const Instruction &instruction) {
+  if (instruction.hasImmediate) {
+    return literal(instruction.immediate);
+  }
+  return registerOperand(instruction.src1, instruction.src1UsesMemory);
+}
+static string src2(const Instruction &instruction) {
+  return registerOperand(instruction.src2, instruction.src2UsesMemory);
+}
+static string dst(const Instruction &instruction) {
+  return registerOperand(instruction.dst, instruction.dstUsesMemory);
+}
+// The operand of GOTO, PRINT and HALT.
+static string singleOperand(const Instruction &instruction) {
+  if (instruction.hasImmediate) {
+    return literal(instruction.immediate);
+  }
+  return dst(instruction);
+}
+
+// The statement that continues at target, which is checked as the
+// interpreter checks it.
+static string jumpTo(int64_t target, const vector<bool> &isLiteral) {
+  if (target == (int64_t)isLiteral.size()) {
+    return "return Outcome::END_OF_PROGRAM;";
+  }
+  if (target < 0 || target > (int64_t)isLiteral.size() || isLiteral[target]) {
+    return "return Outcome::INVALID_JUMP;";
+  }
+  return "goto " + labelName(target) + ";";
+}
+
+bool translateToCpp(const void *program, size_t programSize,
+                    const string &file, ostream &output) {
+  // Loading checks the header, the literal words and the branch targets.
+  Module module;
+  RunOptions options;
+  options.jit = false;
+  options.metered = false;
+  if (!module.load(program, programSize, options)) {
+    return false;
+  }
+  const Header *header = (const Header *)program;
+  const Instruction *instructions =
+      (const Instruction *)((const uint8_t *)program +
+                            header->instructionsOffset);
+  size_t instructionCount = header->instructionCount;
+
+  // Find the literal words, the literal each instruction has, and where
+  // labels are needed. A GOTO through a register or memory can reach any
+  // instruction, so then every instruction gets one.
+  vector<bool> isLiteral(instructionCount, false);
+  vector<int64_t> literals(instructionCount, 0);
+  vector<bool> isTarget(instructionCount + 1, false);
+  bool computedGoto = false;
+  for (size_t i = 0; i < instructionCount; i++) {
+    const Instruction &instruction = instructions[i];
+    if (instruction.opcode >= OPCODE_COUNT) {
+      continue;
+    }
+    Opcode opcode = (Opcode)instruction.opcode;
+    size_t literalWords = literalWordCount(opcode);
+    uint64_t literal = 0;
+    for (size_t j = 0; j < literalWords; j++) {
+      uint32_t word;
+      memcpy(&word, &instructions[i + 1 + j], sizeof(word));
+      literal |= (uint64_t)word << (32 * j);
+      isLiteral[i + 1 + j] = true;
+    }
+    literals[i] = (int64_t)literal;
+    if (isConditionalBranch(opcode)) {
+      isTarget[literal] = true;
+    } else if (opcode == Opcode::GOTO) {
+      if (instruction.hasImmediate) {
+        int64_t target = instruction.immediate;
+        if (target >= 0 && (size_t)target < instructionCount) {
+          isTarget[target] = true;
+        }
+      } else {
+        computedGoto = true;
+      }
+    }
+    i += literalWords;
+  }
+
+  output << "// Compiled ahead of time from " << file
+         << " by the register VM.\n"
+         << "// Build it with: c++ -std=c++17 -O3\n";
+  output << "\n#define MEMORY_SIZE " << MEMORY_SIZE << "\n";
+  output << PRELUDE;
+  output << "\n#define SOURCE_FILE " << quoted(file) << "\n\n";
+  output << "static Outcome runProgram() {\n";
+  for (size_t i = 0; i < NUM_REGISTERS; i++) {
+    output << "  [[maybe_unused]] int64_t r" << i << " = 0;\n";
+  }
+  for (size_t i = 0; i < instructionCount; i++) {
+    if (isLiteral[i]) {
+      continue;
+    }
+    if (isTarget[i] || computedGoto) {
+      output << labelName(i) << ":\n";
+    }
+    const Instruction &instruction = instructions[i];
+    if (instruction.opcode >= OPCODE_COUNT) {
+      output << "  return Outcome::UNKNOWN_INSTRUCTION;\n";
+      continue;
+    }
+    output << memoryCheck(instruction);
+    switch ((Opcode)instruction.opcode) {
+    case Opcode::MOV:
+      output << "  " << dst(instruction) << " = " << src1(instruction)
+             << ";\n";
+      break;
+    case Opcode::ADD:
+      output << "  " << dst(instruction) << " = add(" << src1(instruction)
+             << ", " << src2(instruction) << ");\n";
+      break;
+    case Opcode::SUB:
+      output << "  " << dst(instruction) << " = sub(" << src2(instruction)
+             << ", " << src1(instruction) << ");\n";
+      break;
+    case Opcode::MUL:
+      output << "  " << dst(instruction) << " = mul(" << src1(instruction)
+             << ", " << src2(instruction) << ");\n";
+      break;
+    case Opcode::DIV:
+      output << "  if (" << src1(instruction) << " == 0) {\n"
+             << "    return Outcome::DIVIDE_BY_ZERO;\n"
+             << "  }\n"
+             << "  " << dst(instruction) << " = " << src2(instruction)
+             << " / " << src1(instruction) << ";\n";
+      break;
+    case Opcode::GOTO:
+      if (instruction.hasImmediate) {
+        output << "  " << jumpTo(instruction.immediate, isLiteral) << "\n";
+        break;
+      }
+      output << "  switch (" << singleOperand(instruction) << ") {\n";
+      for (size_t target = 0; target < instructionCount; target++) {
+        if (!isLiteral[target]) {
+          output << "  case " << target << ":\n"
+                 << "    goto " << labelName(target) << ";\n";
+        }
+      }
+      output << "  case " << instructionCount << ":\n"
+             << "    return Outcome::END_OF_PROGRAM;\n"
+             << "  default:\n"
+             << "    return Outcome::INVALID_JUMP;\n"
+             << "  }\n";
+      break;
+    case Opcode::PRINT:
+      output << "  std::cout << " << singleOperand(instruction)
+             << " << std::endl;\n";
+      break;
+    case Opcode::EXIT:
+      output << "  return Outcome::EXITED;\n";
+      break;
+    case Opcode::AND:
+      output << "  " << dst(instruction) << " = " << src1(instruction)
+             << " & " << src2(instruction) << ";\n";
+      break;
+    case Opcode::OR:
+      output << "  " << dst(instruction) << " = " << src1(instruction)
+             << " | " << src2(instruction) << ";\n";
+      break;
+    case Opcode::XOR:
+      output << "  " << dst(instruction) << " = " << src1(instruction)
+             << " ^ " << src2(instruction) << ";\n";
+      break;
+    case Opcode::SHL:
+      output << "  " << dst(instruction) << " = shl(" << src2(instruction)
+             << ", " << src1(instruction) << ");\n";
+      break;
+    case Opcode::SHR:
+      output << "  " << dst(instruction) << " = shr(" << src2(instruction)
+             << ", " << src1(instruction) << ");\n";
+      break;
+    case Opcode::MOVW:
+      output << "  " << dst(instruction) << " = " << literal(literals[i])
+             << ";\n";
+      break;
+    case Opcode::BEQ:
+    case Opcode::BNE:
+    case Opcode::BLT:
+    case Opcode::BGT: {
+      Opcode opcode = (Opcode)instruction.opcode;
+      const char *comparison = opcode == Opcode::BEQ   ? " == "
+                               : opcode == Opcode::BNE ? " != "
+                               : opcode == Opcode::BLT ? " < "
+                                                       : " > ";
+      output << "  if (" << src2(instruction) << comparison
+             << src1(instruction) << ") {\n"
+             << "    " << jumpTo(literals[i], isLiteral) << "\n"
+             << "  }\n";
+      break;
+    }
+    case Opcode::HALT:
+      output << "  result = " << singleOperand(instruction) << ";\n"
+             << "  return Outcome::FINISHED;\n";
+      break;
+    }
+  }
+  output << "  return Outcome::END_OF_PROGRAM;\n"
+         << "}\n";
+  output << MAIN;
+  return true;
+}
+} // namespace registervm
@@ -1,215 +1,460 @@
 #include "assembler.h"
 #include "bytecode.h"
 #include <cctype>
+#include <charconv>
 #include <cstdint>
 #include <cstring>
 #include <exception>
-#include <fstream>
-#include <functional>
 #include <iostream>
-#include <map>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 using std::cerr;
 using std::endl;
 using std::exception;
-using std::function;
 using std::invalid_argument;
-using std::istream;
-using std::map;
 using std::ostream;
+using std::pair;
 using std::range_error;
 using std::runtime_error;
-using std::stoi;
 using std::string;
+using std::string_view;
+using std::unordered_map;
 using std::vector;
 
-#define MAXLINE 256
-
-namespace bytecode {
-static inline char *skipIndent(char *str) {
-  while (isspace(*str)) {
-    str++;
+namespace registervm {
+// Removes the next whitespace-separated word from the front of line and
+// returns it, or an empty word at the end of the line.
+static string_view nextWord(string_view &line) {
+  size_t start = 0;
+  while (start < line.size() && isspace((unsigned char)line[start])) {
+    start++;
+  }
+  size_t end = start;
+  while (end < line.size() && !isspace((unsigned char)line[end])) {
+    end++;
   }
-  return str;
+  string_view word = line.substr(start, end - start);
+  line.remove_prefix(end);
+  return word;
 }
 
-string nextWord(char *&str) {
-  while (isspace(*str)) {
-    str++;
+// Parses the whole of word as a number, or throws.
+template <typename T> static T parseNumber(string_view word) {
+  T value;
+  const char *last = word.data() + word.size();
+  auto result = std::from_chars(word.data(), last, value);
+  if (result.ec == std::errc::result_out_of_range) {
+    throw range_error(string(word) + " is out of range");
   }
-  string word;
-  while (!isspace(*str) && *str != 0) {
-    word += *str;
-    str++;
+  if (word.empty() || result.ec != std::errc() || result.ptr != last) {
+    throw invalid_argument("Expected a number, not " + string(word));
   }
-  return word;
+  return value;
 }
 
-enum class OperandType { REGISTER, IMMEDIATE };
+enum class OperandType { REGISTER, IMMEDIATE, LABEL };
 
 struct Operand {
   OperandType type;
   bool memoryOperand;
   union {
     uint8_t registerNumber;
-    int16_t immediateValue;
+    int64_t immediateValue;
   } value;
+  // The label named by a "&label" operand, a view into the source.
+  string_view label;
 };
 
-vector<Operand>
-getOperands(char *&line,
-            const function<void(const string &)> &labelReferenceCallback) {
-  vector<Operand> result;
-  string word = nextWord(line);
-  if (word.length() > 0) {
-    bool moreOperands = true;
-    while (moreOperands) {
-      moreOperands = word.at(word.length() - 1) == ',';
-      if (moreOperands) {
-        word = word.substr(0, word.length() - 1);
-      }
-      Operand operand;
-      if (word.at(0) == '*') {
-        operand.memoryOperand = true;
-        word = word.substr(1);
-      } else {
-        operand.memoryOperand = false;
+#define MAX_OPERANDS 3
+
+// Parses the comma-separated operands on the rest of line into operands,
+// and returns how many there are.
+static size_t getOperands(string_view line, Operand (&operands)[MAX_OPERANDS]) {
+  size_t count = 0;
+  string_view word = nextWord(line);
+  bool moreOperands = !word.empty();
+  while (moreOperands) {
+    if (word.empty()) {
+      throw invalid_argument("Missing operand");
+    }
+    if (count == MAX_OPERANDS) {
+      throw invalid_argument("More than three operands");
+    }
+    moreOperands = word.back() == ',';
+    if (moreOperands) {
+      word.remove_suffix(1);
+    }
+    Operand &operand = operands[count++];
+    operand.memoryOperand = !word.empty() && word[0] == '*';
+    if (operand.memoryOperand) {
+      word.remove_prefix(1);
+    }
+    if (!word.empty() && word[0] == 'r') {
+      operand.type = OperandType::REGISTER;
+      uint8_t number = parseNumber<uint8_t>(word.substr(1));
+      if (number >= NUM_REGISTERS) {
+        throw invalid_argument("No register " + string(word));
       }
-      if (word.at(0) == 'r') {
-        operand.type = OperandType::REGISTER;
-        operand.value.registerNumber = stoi(word.substr(1));
+      operand.value.registerNumber = number;
+    } else {
+      if (operand.memoryOperand) {
+        throw invalid_argument("Dereferenced immediate");
+      }
+      if (!word.empty() && word[0] == '&') {
+        operand.type = OperandType::LABEL;
+        operand.label = word.substr(1);
+        operand.value.immediateValue = 0;
       } else {
-        if (operand.memoryOperand) {
-          throw invalid_argument("Dereferenced immediate");
-        }
         operand.type = OperandType::IMMEDIATE;
-        if (word.at(0) == '&') {
-          labelReferenceCallback(word.substr(1));
-        }else {
-        operand.value.immediateValue = stoi(word);
+        operand.value.immediateValue = parseNumber<int64_t>(word);
+      }
+    }
+    if (moreOperands) {
+      word = nextWord(line);
+    }
+  }
+  if (!nextWord(line).empty()) {
+    throw runtime_error("Characters at end of line");
+  }
+  return count;
+}
+
+// The mnemonics, in a table with a slot for each that is picked by a hash of
+// its name, so looking a word up takes one hash and one comparison. The hash
+// is seeded, and the seed is searched for when the table is built, until no
+// two mnemonics share a slot.
+class MnemonicTable {
+public:
+  MnemonicTable() {
+    static const pair<string_view, Opcode> mnemonics[] = {
+        {"print", Opcode::PRINT}, {"exit", Opcode::EXIT}, {"mov", Opcode::MOV},
+        {"add", Opcode::ADD},     {"goto", Opcode::GOTO}, {"sub", Opcode::SUB},
+        {"mul", Opcode::MUL},     {"halt", Opcode::HALT}, {"div", Opcode::DIV},
+        {"and", Opcode::AND},     {"or", Opcode::OR},     {"xor", Opcode::XOR},
+        {"shl", Opcode::SHL},     {"shr", Opcode::SHR},   {"beq", Opcode::BEQ},
+        {"bne", Opcode::BNE},     {"blt", Opcode::BLT},   {"bgt", Opcode::BGT}};
+    for (seed = 0;; seed++) {
+      bool collided = false;
+      for (string_view &name : names) {
+        name = string_view();
+      }
+      for (const auto &mnemonic : mnemonics) {
+        size_t slot = hash(mnemonic.first);
+        if (!names[slot].empty()) {
+          collided = true;
+          break;
         }
+        names[slot] = mnemonic.first;
+        opcodes[slot] = mnemonic.second;
       }
-      result.push_back(operand);
-      if (moreOperands) {
-        word = nextWord(line);
+      if (!collided) {
+        return;
       }
     }
   }
-  if (nextWord(line).length() != 0) {
-    throw runtime_error("Characters at end of line");
+
+  Opcode find(string_view word) const {
+    size_t slot = hash(word);
+    if (word.empty() || names[slot] != word) {
+      throw invalid_argument("Unknown instruction " + string(word));
+    }
+    return opcodes[slot];
   }
-  return result;
+
+private:
+  static constexpr size_t SLOT_BITS = 7;
+
+  // FNV-1a, with the high bits of a multiplicative hash of it for the slot.
+  size_t hash(string_view word) const {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : word) {
+      hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return (hash * 2654435769u) >> (32 - SLOT_BITS);
+  }
+
+  uint32_t seed;
+  string_view names[1 << SLOT_BITS];
+  Opcode opcodes[1 << SLOT_BITS];
+};
+
+static int16_t checkImmediate(int64_t value) {
+  if (value < MIN_IMMEDIATE || value > MAX_IMMEDIATE) {
+    throw range_error("Immediate out of range");
+  }
+  return value;
 }
 
-static map<string, Opcode> mnemonics = {
-    {"mov", Opcode::MOV},   {"add", Opcode::ADD},  {"sub", Opcode::SUB},
-    {"mul", Opcode::MUL},   {"div", Opcode::DIV},  {"print", Opcode::PRINT},
-    {"exit", Opcode::EXIT}, {"goto", Opcode::GOTO}};
+static Instruction literalWord(uint32_t value) {
+  Instruction instruction;
+  memcpy(&instruction, &value, sizeof(instruction));
+  return instruction;
+}
 
-void assemble(istream &input, ostream &output) {
+// A use of a label, by the index of the word that holds it.
+struct LabelReference {
+  string_view label;
+  size_t index;
+  // Whether the label is stored as a whole literal word rather than in the
+  // immediate field.
+  bool literal;
+};
+
+// A label reference with the label resolved to the index of its word.
+struct Fixup {
+  size_t index;
+  size_t target;
+  bool literal;
+  // How many words are added after the instruction because the label is out
+  // of reach of the immediate field.
+  size_t extraWords;
+};
+
+// How many literal words turn the instruction at fixup.index into one that
+// reaches any label: a goto becomes "beq r0, r0, label", which always
+// branches and keeps its target in a literal word, and a mov becomes a movw.
+static size_t widenedWords(const vector<Instruction> &instructions,
+                           const Fixup &fixup) {
+  switch ((Opcode)instructions[fixup.index].opcode) {
+  case Opcode::GOTO:
+    return literalWordCount(Opcode::BEQ);
+  case Opcode::MOV:
+    return literalWordCount(Opcode::MOVW);
+  default:
+    throw range_error("Label out of range of the immediate field");
+  }
+}
+
+// Lays instructions out with the fixups filled in, widening the ones whose
+// label ends up past MAX_IMMEDIATE. The added words move everything after
+// them, which can push more labels out of reach, so the layout is repeated
+// until nothing more is widened. Each round takes time linear in the
+// program, and labels only move later, so the rounds end.
+static vector<Instruction> layOut(const vector<Instruction> &instructions,
+                                  vector<Fixup> &fixups) {
+  // The offset of each word once laid out, then of the end.
+  vector<size_t> offsets(instructions.size() + 1);
+  bool widened = true;
+  while (widened) {
+    widened = false;
+    size_t fixup = 0;
+    size_t offset = 0;
+    for (size_t i = 0; i <= instructions.size(); i++) {
+      offsets[i] = offset++;
+      for (; fixup < fixups.size() && fixups[fixup].index == i; fixup++) {
+        offset += fixups[fixup].extraWords;
+      }
+    }
+    for (Fixup &fixup : fixups) {
+      if (!fixup.literal && fixup.extraWords == 0 &&
+          offsets[fixup.target] > MAX_IMMEDIATE) {
+        fixup.extraWords = widenedWords(instructions, fixup);
+        widened = true;
+      }
+    }
+  }
+  vector<Instruction> laidOut;
+  laidOut.reserve(offsets.back());
+  size_t next = 0;
+  for (size_t i = 0; i < instructions.size(); i++) {
+    laidOut.push_back(instructions[i]);
+    for (; next < fixups.size() && fixups[next].index == i; next++) {
+      const Fixup &fixup = fixups[next];
+      uint32_t target = offsets[fixup.target];
+      Instruction &instruction = laidOut.back();
+      if (fixup.literal) {
+        instruction = literalWord(target);
+      } else if (fixup.extraWords == 0) {
+        instruction.immediate = target;
+      } else if ((Opcode)instruction.opcode == Opcode::GOTO) {
+        Instruction branch = {};
+        branch.opcode = (uint8_t)Opcode::BEQ;
+        instruction = branch;
+        laidOut.push_back(literalWord(target));
+      } else {
+        instruction.opcode = (uint8_t)Opcode::MOVW;
+        instruction.hasImmediate = true;
+        instruction.immediate = 0;
+        laidOut.push_back(literalWord(target));
+        laidOut.push_back(literalWord(0));
+      }
+    }
+  }
+  return laidOut;
+}
+
+bool assemble(string_view source, ostream &output) {
+  static const MnemonicTable mnemonics;
   try {
-    map<string, size_t> labelOffsets;
-    map<string, vector<size_t>> labelReferences;
+    unordered_map<string_view, size_t> labelOffsets;
+    vector<LabelReference> labelReferences;
     vector<Instruction> instructions;
-    char inputLine[MAXLINE];
-    input.getline(inputLine, MAXLINE);
-    while (!input.eof()) {
-      char *line = skipIndent(inputLine);
-      int lineLength = strlen(line);
-      if (lineLength != 0 && *line != '#') {
-        string mnemonic = nextWord(line);
-        if (mnemonic.at(mnemonic.length() - 1) == ':') {
-          string labelName = mnemonic.substr(0, mnemonic.length() - 1);
-          labelOffsets[labelName] = instructions.size();
+    size_t lineNumber = 0;
+    while (!source.empty()) {
+      lineNumber++;
+      size_t lineLength = source.find('\n');
+      string_view line = source.substr(0, lineLength);
+      source.remove_prefix(lineLength == string_view::npos ? source.size()
+                                                           : lineLength + 1);
+      string_view mnemonic = nextWord(line);
+      if (mnemonic.empty() || mnemonic[0] == '#') {
+        continue;
+      }
+      if (mnemonic.back() == ':') {
+        mnemonic.remove_suffix(1);
+        if (!labelOffsets.emplace(mnemonic, instructions.size()).second) {
+          throw invalid_argument("Duplicate label " + string(mnemonic) +
+                                 " on line " + std::to_string(lineNumber));
+        }
+        continue;
+      }
+      Opcode opcode = mnemonics.find(mnemonic);
+      Operand operands[MAX_OPERANDS];
+      size_t operandCount = getOperands(line, operands);
+      for (size_t i = 0; i < operandCount; i++) {
+        if (operands[i].type != OperandType::LABEL) {
+          continue;
+        }
+        if (isConditionalBranch(opcode) && i == 2) {
+          labelReferences.push_back(
+              {operands[i].label, instructions.size() + 1, true});
         } else {
-          Opcode opcode = mnemonics[mnemonic];
-          vector<Operand> operands = getOperands(line, [&](string labelName) {
-            labelReferences[labelName].push_back(instructions.size());
-          });
-          Instruction instruction = {};
+          labelReferences.push_back(
+              {operands[i].label, instructions.size(), false});
+        }
+        operands[i].type = OperandType::IMMEDIATE;
+      }
+      Instruction instruction = {};
+      instruction.opcode = (uint8_t)opcode;
+      uint32_t literals[2];
+      size_t literalCount = 0;
+      if (isConditionalBranch(opcode)) {
+        if (operandCount != 3 ||
+            operands[2].type != OperandType::IMMEDIATE) {
+          throw invalid_argument("Branches need two sources and a target");
+        }
+        // Only src1 can be an immediate, so "blt r0, 10, &loop" is written
+        // as "bgt 10, r0, &loop", with the sources swapped and the
+        // comparison mirrored.
+        if (operands[0].type == OperandType::REGISTER &&
+            operands[1].type == OperandType::IMMEDIATE) {
+          std::swap(operands[0], operands[1]);
+          opcode = opcode == Opcode::BLT   ? Opcode::BGT
+                   : opcode == Opcode::BGT ? Opcode::BLT
+                                           : opcode;
           instruction.opcode = (uint8_t)opcode;
-          switch (operands.size()) {
-          case 0: {
-            break;
-          }
-          case 1: {
-            Operand operand = operands.at(0);
-            if (operand.type == OperandType::IMMEDIATE) {
-              instruction.hasImmediate = true;
-              instruction.immediate = operand.value.immediateValue;
-            } else {
-              instruction.hasImmediate = false;
-              instruction.dst = operand.value.registerNumber;
-              instruction.dstUsesMemory = operand.memoryOperand;
-            }
-            break;
-          }
-          case 2: {
-            Operand srcOperand = operands.at(0);
-            Operand dstOperand = operands.at(1);
-            if (dstOperand.type != OperandType::REGISTER) {
-              throw invalid_argument("Destination operand is immediate");
-            }
-            if (srcOperand.type == OperandType::IMMEDIATE) {
-              instruction.hasImmediate = true;
-              instruction.immediate = srcOperand.value.immediateValue;
-            } else {
-              instruction.hasImmediate = false;
-              instruction.src1 = srcOperand.value.registerNumber;
-              instruction.src1UsesMemory = srcOperand.memoryOperand;
-            }
-            instruction.dst = dstOperand.value.registerNumber;
-            instruction.dstUsesMemory = dstOperand.memoryOperand;
-            break;
-          }
-          case 3: {
-            Operand src1Operand = operands.at(0);
-            Operand src2Operand = operands.at(1);
-            Operand dstOperand = operands.at(2);
-            if (src2Operand.type != OperandType::REGISTER) {
-              throw invalid_argument("Source operand two is immediate");
-            }
-            if (dstOperand.type != OperandType::REGISTER) {
-              throw invalid_argument("Destination operand is immediate");
-            }
-            if (src1Operand.type == OperandType::IMMEDIATE) {
-              instruction.hasImmediate = true;
-              instruction.immediate = src1Operand.value.immediateValue;
-            } else {
-              instruction.hasImmediate = false;
-              instruction.src1 = src1Operand.value.registerNumber;
-              instruction.src1UsesMemory = src1Operand.memoryOperand;
-            }
-            instruction.src2 = src2Operand.value.registerNumber;
-            instruction.src2UsesMemory = src2Operand.memoryOperand;
-            instruction.dst = dstOperand.value.registerNumber;
-            instruction.dstUsesMemory = dstOperand.memoryOperand;
-            break;
-          }
-          default:
-            throw invalid_argument("More than three operands");
-          }
-          instructions.push_back(instruction);
         }
+        literals[literalCount++] = operands[2].value.immediateValue;
+        operands[2] = Operand{OperandType::REGISTER, false, {0}, {}};
+      } else if (opcode == Opcode::MOV && operandCount == 2 &&
+                 operands[0].type == OperandType::IMMEDIATE) {
+        int64_t value = operands[0].value.immediateValue;
+        if (value < MIN_IMMEDIATE || value > MAX_IMMEDIATE) {
+          instruction.opcode = (uint8_t)Opcode::MOVW;
+          literals[literalCount++] = (uint64_t)value;
+          literals[literalCount++] = (uint64_t)value >> 32;
+          operands[0].value.immediateValue = 0;
+        }
+      }
+      switch (operandCount) {
+      case 0: {
+        break;
+      }
+      case 1: {
+        const Operand &operand = operands[0];
+        if (operand.type == OperandType::IMMEDIATE) {
+          instruction.hasImmediate = true;
+          instruction.immediate =
+              checkImmediate(operand.value.immediateValue);
+        } else {
+          instruction.hasImmediate = false;
+          instruction.dst = operand.value.registerNumber;
+          instruction.dstUsesMemory = operand.memoryOperand;
+        }
+        break;
+      }
+      case 2: {
+        const Operand &srcOperand = operands[0];
+        const Operand &dstOperand = operands[1];
+        if (dstOperand.type != OperandType::REGISTER) {
+          throw invalid_argument("Destination operand is immediate");
+        }
+        if (srcOperand.type == OperandType::IMMEDIATE) {
+          instruction.hasImmediate = true;
+          instruction.immediate =
+              checkImmediate(srcOperand.value.immediateValue);
+        } else {
+          instruction.hasImmediate = false;
+          instruction.src1 = srcOperand.value.registerNumber;
+          instruction.src1UsesMemory = srcOperand.memoryOperand;
+        }
+        instruction.dst = dstOperand.value.registerNumber;
+        instruction.dstUsesMemory = dstOperand.memoryOperand;
+        break;
+      }
+      default: {
+        const Operand &src1Operand = operands[0];
+        const Operand &src2Operand = operands[1];
+        const Operand &dstOperand = operands[2];
+        if (src2Operand.type != OperandType::REGISTER) {
+          throw invalid_argument("Source operand two is immediate");
+        }
+        if (dstOperand.type != OperandType::REGISTER) {
+          throw invalid_argument("Destination operand is immediate");
+        }
+        if (src1Operand.type == OperandType::IMMEDIATE) {
+          instruction.hasImmediate = true;
+          instruction.immediate =
+              checkImmediate(src1Operand.value.immediateValue);
+        } else {
+          instruction.hasImmediate = false;
+          instruction.src1 = src1Operand.value.registerNumber;
+          instruction.src1UsesMemory = src1Operand.memoryOperand;
+        }
+        instruction.src2 = src2Operand.value.registerNumber;
+        instruction.src2UsesMemory = src2Operand.memoryOperand;
+        instruction.dst = dstOperand.value.registerNumber;
+        instruction.dstUsesMemory = dstOperand.memoryOperand;
+        break;
+      }
+      }
+      instructions.push_back(instruction);
+      for (size_t i = 0; i < literalCount; i++) {
+        instructions.push_back(literalWord(literals[i]));
       }
-      input.getline(inputLine, MAXLINE);
     }
-    for (auto &references : labelReferences) {
-      size_t labelOffset = labelOffsets[references.first];
-      for (auto &offset : references.second) {
-        instructions.at(offset).immediate = labelOffset;
+    // Labels are resolved in one pass, in the order they are used, which is
+    // also the order of the words that hold them.
+    vector<Fixup> fixups;
+    fixups.reserve(labelReferences.size());
+    for (const LabelReference &reference : labelReferences) {
+      auto label = labelOffsets.find(reference.label);
+      if (label == labelOffsets.end()) {
+        throw invalid_argument("Unknown label " + string(reference.label));
       }
+      fixups.push_back({reference.index, label->second, reference.literal, 0});
     }
+    vector<Instruction> laidOut = layOut(instructions, fixups);
     Header header;
     header.magic = BYTECODE_MAGIC;
+    header.version = CURRENT_BYTECODE_VERSION;
+    header.reserved = 0;
+    header.instructionsOffset = sizeof(Header);
+    header.instructionCount = laidOut.size();
+    static_assert(sizeof(Header) % INSTRUCTIONS_ALIGNMENT == 0,
+                  "The instructions must follow the header directly");
     output.write((char *)&header, sizeof(Header));
-    for (Instruction &instruction : instructions) {
-      output.write((char *)&instruction, sizeof(Instruction));
-    }
+    output.write((char *)laidOut.data(), laidOut.size() * sizeof(Instruction));
+    return true;
   } catch (exception &e) {
     cerr << "Error: " << e.what() << endl;
+    return false;
   }
 }
-} // namespace bytecode
+} // namespace registervm
@@ -0,0 +1,415 @@
+#include "jit.h"
+#include "bytecode.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define HAVE_JIT
+#include <sys/mman.h>
+#endif
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::initializer_list;
+using std::vector;
+
+namespace registervm {
+#ifdef HAVE_JIT
+typedef int64_t Word;
+
+// Register use in compiled code:
+//   r8-r15   - VM registers r0-r7
+//   rbx      - Vm::memory
+//   rax, rcx - scratch
+enum Reg : uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+static uint8_t hostRegister(uint8_t vmRegister) { return 8 + vmRegister; }
+
+static void print(Word value) { cout << value << endl; }
+
+struct CodeBuffer {
+  vector<uint8_t> code;
+
+  void bytes(initializer_list<uint8_t> values) {
+    code.insert(code.end(), values);
+  }
+  void imm32(int32_t value) {
+    const uint8_t *valueBytes = (const uint8_t *)&value;
+    code.insert(code.end(), valueBytes, valueBytes + sizeof(value));
+  }
+  void imm64(int64_t value) {
+    const uint8_t *valueBytes = (const uint8_t *)&value;
+    code.insert(code.end(), valueBytes, valueBytes + sizeof(value));
+  }
+  // mov destination, source
+  void move(uint8_t destination, uint8_t source) {
+    bytes({(uint8_t)(0x48 | (source >> 3) << 2 | destination >> 3), 0x89,
+           (uint8_t)(0xc0 | (source & 7) << 3 | (destination & 7))});
+  }
+  // mov destination, [rbx + index * 8]
+  void loadMemory(uint8_t destination, uint8_t index) {
+    bytes({(uint8_t)(0x48 | (destination >> 3) << 2 | (index >> 3) << 1),
+           0x8b, (uint8_t)(0x04 | (destination & 7) << 3),
+           (uint8_t)(0xc0 | (index & 7) << 3 | RBX)});
+  }
+  // mov [rbx + index * 8], source
+  void storeMemory(uint8_t index, uint8_t source) {
+    bytes({(uint8_t)(0x48 | (source >> 3) << 2 | (index >> 3) << 1), 0x89,
+           (uint8_t)(0x04 | (source & 7) << 3),
+           (uint8_t)(0xc0 | (index & 7) << 3 | RBX)});
+  }
+  // cmp reg, sign-extended imm32
+  void compareImmediate(uint8_t reg, int32_t value) {
+    bytes({(uint8_t)(0x48 | reg >> 3), 0x81, (uint8_t)(0xf8 | (reg & 7))});
+    imm32(value);
+  }
+  // mov destination, sign-extended imm32
+  void moveImmediate(uint8_t destination, int32_t value) {
+    bytes({(uint8_t)(0x48 | destination >> 3), 0xc7,
+           (uint8_t)(0xc0 | (destination & 7))});
+    imm32(value);
+  }
+  size_t jump() {
+    bytes({0xe9});
+    imm32(0);
+    return code.size() - 4;
+  }
+  // Jcc rel32 with the given condition code.
+  size_t jumpIf(uint8_t condition) {
+    bytes({0x0f, (uint8_t)(0x80 | condition)});
+    imm32(0);
+    return code.size() - 4;
+  }
+  void patch(size_t position, size_t target) {
+    int32_t displacement = (int32_t)(target - (position + 4));
+    memcpy(code.data() + position, &displacement, sizeof(displacement));
+  }
+
+  // Loads a register or memory operand into a scratch register.
+  void loadOperand(Reg scratch, uint8_t vmRegister, bool usesMemory) {
+    if (usesMemory) {
+      loadMemory(scratch, hostRegister(vmRegister));
+    } else {
+      move(scratch, hostRegister(vmRegister));
+    }
+  }
+  void loadSource1(Reg scratch, const Instruction &instruction) {
+    if (instruction.hasImmediate) {
+      moveImmediate(scratch, instruction.immediate);
+    } else {
+      loadOperand(scratch, instruction.src1, instruction.src1UsesMemory);
+    }
+  }
+  void loadSingleOperand(Reg scratch, const Instruction &instruction) {
+    if (instruction.hasImmediate) {
+      moveImmediate(scratch, instruction.immediate);
+    } else {
+      loadOperand(scratch, instruction.dst, instruction.dstUsesMemory);
+    }
+  }
+  void storeDestination(const Instruction &instruction, Reg scratch) {
+    if (instruction.dstUsesMemory) {
+      storeMemory(hostRegister(instruction.dst), scratch);
+    } else {
+      move(hostRegister(instruction.dst), scratch);
+    }
+  }
+};
+
+static const uint8_t CONDITION_EQUAL = 0x4;
+static const uint8_t CONDITION_NOT_EQUAL = 0x5;
+static const uint8_t CONDITION_LESS = 0xc;
+static const uint8_t CONDITION_GREATER = 0xf;
+static const uint8_t CONDITION_ABOVE_OR_EQUAL = 0x3;
+
+// Marks the instruction start of a literal word, which nothing may jump to.
+static const size_t NOT_AN_INSTRUCTION = SIZE_MAX;
+
+static uint32_t literalWord(const Instruction *instructions, size_t index) {
+  uint32_t word;
+  memcpy(&word, &instructions[index], sizeof(word));
+  return word;
+}
+
+bool jitAvailable() { return true; }
+
+bool jitCompile(const Instruction *instructions, size_t instructionCount,
+                JitCode &jitCode) {
+  CodeBuffer code;
+  // Code offset of each instruction, and of the end of the program, or
+  // NOT_AN_INSTRUCTION for literal words.
+  vector<size_t> instructionStart(instructionCount + 1);
+  struct Fixup {
+    size_t position;
+    size_t target;
+  };
+  vector<Fixup> fixups;
+  vector<size_t> divideByZeroJumps;
+  vector<size_t> badJumps;
+  vector<size_t> outOfBoundsJumps;
+  // Positions of the rip-relative displacements that refer to the table of
+  // instruction offsets used by computed GOTOs.
+  vector<size_t> jumpTableReferences;
+  vector<size_t> epilogueJumps;
+  auto returnStatus = [&](JitStatus status) {
+    code.bytes({0xb8}); // mov eax, status
+    code.imm32((int32_t)status);
+    return code.jump();
+  };
+
+  // Prologue. Five pushes and the saved registers and result pointers leave
+  // rsp 16 byte aligned for calls.
+  code.bytes({0x53});             // push rbx
+  code.bytes({0x41, 0x54});       // push r12
+  code.bytes({0x41, 0x55});       // push r13
+  code.bytes({0x41, 0x56});       // push r14
+  code.bytes({0x41, 0x57});       // push r15
+  code.bytes({0x57});             // push rdi
+  code.bytes({0x52});             // push rdx
+  code.move(RBX, RSI);
+  for (uint8_t i = 0; i < NUM_REGISTERS; i++) {
+    // mov r(8 + i), [rdi + 8 * i]
+    code.bytes({0x4c, 0x8b, (uint8_t)(0x47 | i << 3), (uint8_t)(8 * i)});
+  }
+
+  for (size_t i = 0; i < instructionCount; i++) {
+    const Instruction &instruction = instructions[i];
+    instructionStart[i] = code.code.size();
+    Opcode opcode = (Opcode)instruction.opcode;
+    size_t literalWords = literalWordCount(opcode);
+    if (literalWords > 0 && i + literalWords >= instructionCount) {
+      cerr << "Truncated instruction at " << i << endl;
+      return false;
+    }
+    // Memory operands are checked before the instruction does anything, as
+    // the interpreter checks them. Unsigned, a negative address is too large.
+    auto checkAddress = [&](uint8_t vmRegister) {
+      code.compareImmediate(hostRegister(vmRegister), MEMORY_SIZE);
+      outOfBoundsJumps.push_back(code.jumpIf(CONDITION_ABOVE_OR_EQUAL));
+    };
+    if (instruction.src1UsesMemory &&
+        usesSrc1(opcode, instruction.hasImmediate)) {
+      checkAddress(instruction.src1);
+    }
+    if (instruction.src2UsesMemory && usesSrc2(opcode)) {
+      checkAddress(instruction.src2);
+    }
+    if (instruction.dstUsesMemory &&
+        usesDst(opcode, instruction.hasImmediate)) {
+      checkAddress(instruction.dst);
+    }
+    switch (opcode) {
+    case Opcode::MOV:
+      if (!instruction.hasImmediate && !instruction.src1UsesMemory &&
+          !instruction.dstUsesMemory) {
+        code.move(hostRegister(instruction.dst),
+                  hostRegister(instruction.src1));
+      } else {
+        code.loadSource1(RAX, instruction);
+        code.storeDestination(instruction, RAX);
+      }
+      break;
+    case Opcode::ADD:
+      code.loadSource1(RAX, instruction);
+      code.loadOperand(RCX, instruction.src2, instruction.src2UsesMemory);
+      code.bytes({0x48, 0x01, 0xc8}); // add rax, rcx
+      code.storeDestination(instruction, RAX);
+      break;
+    case Opcode::SUB:
+      code.loadSource1(RCX, instruction);
+      code.loadOperand(RAX, instruction.src2, instruction.src2UsesMemory);
+      code.bytes({0x48, 0x29, 0xc8}); // sub rax, rcx
+      code.storeDestination(instruction, RAX);
+      break;
+    case Opcode::MUL:
+      code.loadSource1(RAX, instruction);
+      code.loadOperand(RCX, instruction.src2, instruction.src2UsesMemory);
+      code.bytes({0x48, 0x0f, 0xaf, 0xc1}); // imul rax, rcx
+      code.storeDestination(instruction, RAX);
+      break;
+    case Opcode::DIV:
+      code.loadSource1(RCX, instruction);
+      code.loadOperand(RAX, instruction.src2, instruction.src2UsesMemory);
+      code.bytes({0x48, 0x85, 0xc9}); // test rcx, rcx
+      divideByZeroJumps.push_back(code.jumpIf(CONDITION_EQUAL));
+      code.bytes({0x48, 0x99, 0x48, 0xf7, 0xf9}); // cqo; idiv rcx
+      code.storeDestination(instruction, RAX);
+      break;
+    case Opcode::GOTO:
+      if (instruction.hasImmediate) {
+        int64_t target = instruction.immediate;
+        if (target < 0 || (size_t)target > instructionCount) {
+          badJumps.push_back(code.jump());
+        } else {
+          fixups.push_back({code.jump(), (size_t)target});
+        }
+      } else {
+        code.loadSingleOperand(RAX, instruction);
+        code.bytes({0x48, 0x3d}); // cmp rax, instructionCount + 1
+        code.imm32(instructionCount + 1);
+        badJumps.push_back(code.jumpIf(CONDITION_ABOVE_OR_EQUAL));
+        code.bytes({0x48, 0x8d, 0x0d}); // lea rcx, [rip + jumpTable]
+        code.imm32(0);
+        jumpTableReferences.push_back(code.code.size() - 4);
+        code.bytes({0x48, 0x63, 0x04, 0x81}); // movsxd rax, [rcx + rax * 4]
+        code.bytes({0x48, 0x01, 0xc8});       // add rax, rcx
+        code.bytes({0xff, 0xe0});             // jmp rax
+      }
+      break;
+    case Opcode::PRINT:
+      code.loadSingleOperand(RDI, instruction);
+      // r8-r11 belong to the caller. Four pushes keep rsp aligned.
+      code.bytes({0x41, 0x50, 0x41, 0x51, 0x41, 0x52, 0x41, 0x53});
+      code.bytes({0x48, 0xb8}); // mov rax, print
+      code.imm64((int64_t)&print);
+      code.bytes({0xff, 0xd0}); // call rax
+      code.bytes({0x41, 0x5b, 0x41, 0x5a, 0x41, 0x59, 0x41, 0x58});
+      break;
+    case Opcode::EXIT:
+      epilogueJumps.push_back(returnStatus(JitStatus::EXIT));
+      break;
+    case Opcode::AND:
+    case Opcode::OR:
+    case Opcode::XOR: {
+      code.loadSource1(RAX, instruction);
+      code.loadOperand(RCX, instruction.src2, instruction.src2UsesMemory);
+      uint8_t operation =
+          opcode == Opcode::AND ? 0x21 : opcode == Opcode::OR ? 0x09 : 0x31;
+      code.bytes({0x48, operation, 0xc8}); // and|or|xor rax, rcx
+      code.storeDestination(instruction, RAX);
+      break;
+    }
+    case Opcode::SHL:
+    case Opcode::SHR:
+      code.loadSource1(RCX, instruction);
+      code.loadOperand(RAX, instruction.src2, instruction.src2UsesMemory);
+      // shl|sar rax, cl
+      code.bytes({0x48, 0xd3, (uint8_t)(opcode == Opcode::SHL ? 0xe0 : 0xf8)});
+      code.storeDestination(instruction, RAX);
+      break;
+    case Opcode::MOVW:
+      code.bytes({0x48, 0xb8}); // mov rax, literal
+      code.imm32(literalWord(instructions, i + 1));
+      code.imm32(literalWord(instructions, i + 2));
+      code.storeDestination(instruction, RAX);
+      break;
+    case Opcode::BEQ:
+    case Opcode::BNE:
+    case Opcode::BLT:
+    case Opcode::BGT: {
+      code.loadSource1(RCX, instruction);
+      code.loadOperand(RAX, instruction.src2, instruction.src2UsesMemory);
+      code.bytes({0x48, 0x39, 0xc8}); // cmp rax, rcx
+      uint8_t condition = opcode == Opcode::BEQ   ? CONDITION_EQUAL
+                          : opcode == Opcode::BNE ? CONDITION_NOT_EQUAL
+                          : opcode == Opcode::BLT ? CONDITION_LESS
+                                                  : CONDITION_GREATER;
+      size_t target = literalWord(instructions, i + 1);
+      if (target > instructionCount) {
+        badJumps.push_back(code.jumpIf(condition));
+      } else {
+        fixups.push_back({code.jumpIf(condition), target});
+      }
+      break;
+    }
+    case Opcode::HALT:
+      code.loadSingleOperand(RAX, instruction);
+      code.bytes({0x48, 0x8b, 0x14, 0x24}); // mov rdx, [rsp]
+      code.bytes({0x48, 0x89, 0x02});       // mov [rdx], rax
+      epilogueJumps.push_back(returnStatus(JitStatus::HALT));
+      break;
+    default:
+      cerr << "Cannot compile opcode " << instruction.opcode
+           << " at instruction " << i << endl;
+      return false;
+    }
+    for (size_t j = 0; j < literalWords; j++) {
+      instructionStart[++i] = NOT_AN_INSTRUCTION;
+    }
+  }
+  instructionStart[instructionCount] = code.code.size();
+  epilogueJumps.push_back(returnStatus(JitStatus::END_OF_PROGRAM));
+  size_t divideByZero = code.code.size();
+  epilogueJumps.push_back(returnStatus(JitStatus::DIVIDE_BY_ZERO));
+  size_t badJump = code.code.size();
+  epilogueJumps.push_back(returnStatus(JitStatus::BAD_JUMP));
+  size_t outOfBounds = code.code.size();
+  epilogueJumps.push_back(returnStatus(JitStatus::MEMORY_OUT_OF_BOUNDS));
+
+  // Epilogue, with the status in eax
+  size_t epilogue = code.code.size();
+  code.bytes({0x5a}); // pop rdx
+  code.bytes({0x5f}); // pop rdi
+  for (uint8_t i = 0; i < NUM_REGISTERS; i++) {
+    // mov [rdi + 8 * i], r(8 + i)
+    code.bytes({0x4c, 0x89, (uint8_t)(0x47 | i << 3), (uint8_t)(8 * i)});
+  }
+  code.bytes({0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3});
+
+  for (size_t &start : instructionStart) {
+    if (start == NOT_AN_INSTRUCTION) {
+      start = badJump;
+    }
+  }
+
+  // Offsets of every instruction and of the end from the start of the table,
+  // for computed GOTOs.
+  size_t jumpTable = code.code.size();
+  for (size_t i = 0; i <= instructionCount; i++) {
+    code.imm32((int32_t)(instructionStart[i] - jumpTable));
+  }
+
+  for (const Fixup &fixup : fixups) {
+    code.patch(fixup.position, instructionStart[fixup.target]);
+  }
+  for (size_t position : divideByZeroJumps) {
+    code.patch(position, divideByZero);
+  }
+  for (size_t position : badJumps) {
+    code.patch(position, badJump);
+  }
+  for (size_t position : outOfBoundsJumps) {
+    code.patch(position, outOfBounds);
+  }
+  for (size_t position : epilogueJumps) {
+    code.patch(position, epilogue);
+  }
+  for (size_t position : jumpTableReferences) {
+    code.patch(position, jumpTable);
+  }
+
+  size_t size = code.code.size();
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    cerr << "Could not allocate memory for compiled code" << endl;
+    return false;
+  }
+  memcpy(memory, code.code.data(), size);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    cerr << "Could not make compiled code executable" << endl;
+    munmap(memory, size);
+    return false;
+  }
+  jitCode.memory = memory;
+  jitCode.size = size;
+  jitCode.entry = (JitFunction)memory;
+  return true;
+}
+
+void jitRelease(JitCode &code) {
+  munmap(code.memory, code.size);
+  code.memory = nullptr;
+}
+#else
+bool jitAvailable() { return false; }
+
+bool jitCompile(const Instruction *, size_t, JitCode &) { return false; }
+
+void jitRelease(JitCode &) {}
+#endif
+} // namespace registervm
@@ -1,23 +1,139 @@
+#include "aot.h"
 #include "assembler.h"
 #include "bytecode.h"
+#include "jit.h"
+#include "mappedfile.h"
 #include "run.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
 
-
+using std::cerr;
 using std::cout;
 using std::endl;
-using std::ifstream;
 using std::ios;
 using std::ofstream;
 using std::string;
+using std::string_view;
+using std::vector;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
 
 static void usage(char *programName) {
-  cout << "Usage: " << programName << " asm|run file" << endl;
+  cout << "Usage: " << programName
+       << " asm|run|bench|aot [--jit] [--runs=n] [--fuel=n] [--save=image] "
+          "[--resume=image] file" << endl;
   cout << endl;
   cout << "asm Assemble the file." << endl;
   cout << "run Run the file." << endl;
+  cout << "bench Time runs of the file, after one to warm up, and print a "
+          "tab-separated line of results."
+       << endl;
+  cout << "aot Write the file as a standalone C++ program to file.cpp, to be "
+          "compiled with \"c++ -std=c++17 -O3\"."
+       << endl;
+  cout << endl;
+  cout << "--jit Compile the program to native code before running it."
+       << endl;
+  cout << "--runs=n How many runs bench times. Defaults to 5." << endl;
+  cout << "--fuel=n Stop run after n GOTOs and branches taken, which "
+          "interprets the program."
+       << endl;
+  cout << "--save=image When run runs out of fuel, save the program's state "
+          "to image."
+       << endl;
+  cout << "--resume=image Continue run from the state saved in image rather "
+          "than from the start."
+       << endl;
+}
+
+// Times runCount runs of the program on one Vm and prints the file, the
+// engine, the number of runs, the instructions each run executes, the mean,
+// standard deviation and minimum time of a run in nanoseconds, the mean time
+// per instruction in nanoseconds and the instructions per second, separated
+// by tabs.
+static bool benchmark(const string &file, const void *bytes, size_t size,
+                      const registervm::RunOptions &options,
+                      size_t runCount) {
+  uint64_t instructions;
+  if (!registervm::countInstructions(bytes, size, instructions)) {
+    return false;
+  }
+  registervm::Module module;
+  if (!module.load(bytes, size, options)) {
+    return false;
+  }
+  registervm::Vm vm(module);
+  vector<double> times;
+  // The first run warms up the caches and branch predictors, and is not
+  // counted.
+  for (size_t run = 0; run <= runCount; run++) {
+    vm.reset();
+    auto startTime = steady_clock::now();
+    registervm::Status status = vm.run();
+    auto timeTaken = steady_clock::now() - startTime;
+    if (status != registervm::Status::EXITED &&
+        status != registervm::Status::FINISHED) {
+      cerr << registervm::statusMessage(status) << endl;
+      return false;
+    }
+    if (run > 0) {
+      times.push_back(duration_cast<nanoseconds>(timeTaken).count());
+    }
+  }
+  double mean = 0;
+  for (double time : times) {
+    mean += time;
+  }
+  mean /= times.size();
+  double variance = 0;
+  for (double time : times) {
+    variance += (time - mean) * (time - mean);
+  }
+  if (times.size() > 1) {
+    variance /= times.size() - 1;
+  }
+  double fastest = *std::min_element(times.begin(), times.end());
+  cout << std::fixed << std::setprecision(0) << file << '\t'
+       << (options.metered ? "interpreter+metered"
+           : options.jit   ? "jit"
+                           : "interpreter")
+       << '\t' << runCount << '\t'
+       << instructions << '\t' << mean << '\t' << std::sqrt(variance) << '\t'
+       << fastest << '\t' << std::setprecision(3) << mean / instructions
+       << '\t' << std::setprecision(0) << instructions / (mean / 1e9)
+       << endl;
+  return true;
+}
+
+// Reads the whole number after the = of option into count. Says why and
+// returns false if there is none, or if it is less than min.
+static bool parseCount(const string &option, uint64_t min, uint64_t &count) {
+  const char *first = option.c_str() + option.find('=') + 1;
+  const char *last = option.c_str() + option.length();
+  auto result = std::from_chars(first, last, count);
+  if (result.ec == std::errc::result_out_of_range) {
+    cerr << option << " is out of range" << endl;
+    return false;
+  }
+  if (first == last || result.ec != std::errc() || result.ptr != last ||
+      count < min) {
+    cerr << "Expected a whole number of at least " << min << " in " << option
+         << endl;
+    return false;
+  }
+  return true;
 }
 
 int main(int argc, char **argv) {
@@ -28,18 +144,87 @@ int main(int argc, char **argv) {
   string action = argv[1];
   if (action == "asm") {
     string inputFile = argv[2];
-    ifstream input(inputFile);
-    ofstream output(inputFile + ".rvm", ios::binary);
-    bytecode::assemble(input, output);
-  } else if (action == "run") {
+    registervm::MappedFile input;
+    if (!input.open(inputFile)) {
+      return -1;
+    }
+    // Assembled in memory, so a program with errors leaves the file it
+    // would have replaced as it was.
+    std::ostringstream output;
+    if (!registervm::assemble(
+            string_view((const char *)input.data(), input.size()), output)) {
+      return -1;
+    }
+    ofstream(inputFile + ".rvm", ios::binary) << output.str();
+  } else if (action == "aot") {
     string file = argv[2];
-    ifstream input(file, ios::binary);
-    input.seekg(0, ios::end);
-    size_t fileSize = input.tellg();
-    input.seekg(0, ios::beg);
-    char *program = new char[fileSize];
-    input.read(program, fileSize);
-    bytecode::run(program, fileSize);
+    registervm::MappedFile input;
+    if (!input.open(file)) {
+      return -1;
+    }
+    std::ostringstream output;
+    if (!registervm::translateToCpp(input.data(), input.size(), file,
+                                    output)) {
+      return -1;
+    }
+    ofstream(file + ".cpp") << output.str();
+  } else if (action == "run" || action == "bench") {
+    registervm::RunOptions options;
+    options.jit = false;
+    options.metered = false;
+    size_t runCount = 5;
+    uint64_t fuel = UINT64_MAX;
+    string saveTo;
+    string resumeFrom;
+    int fileIndex = 2;
+    for (; fileIndex < argc && string(argv[fileIndex]).rfind("--", 0) == 0;
+         fileIndex++) {
+      string option = argv[fileIndex];
+      if (option == "--jit") {
+        if (!registervm::jitAvailable()) {
+          cout << "This build cannot compile to native code." << endl;
+          return -1;
+        }
+        options.jit = true;
+      } else if (option.rfind("--runs=", 0) == 0) {
+        uint64_t count;
+        if (!parseCount(option, 1, count)) {
+          return -1;
+        }
+        runCount = count;
+      } else if (option.rfind("--fuel=", 0) == 0) {
+        if (!parseCount(option, 0, fuel)) {
+          return -1;
+        }
+        options.metered = true;
+      } else if (option.rfind("--save=", 0) == 0) {
+        saveTo = option.substr(7);
+      } else if (option.rfind("--resume=", 0) == 0) {
+        resumeFrom = option.substr(9);
+      } else {
+        usage(argv[0]);
+        return -1;
+      }
+    }
+    if (fileIndex >= argc) {
+      usage(argv[0]);
+      return -1;
+    }
+    string file = argv[fileIndex];
+    registervm::MappedFile input;
+    if (!input.open(file)) {
+      return -1;
+    }
+    if (action == "bench") {
+      return benchmark(file, input.data(), input.size(), options, runCount)
+                 ? 0
+                 : -1;
+    }
+    registervm::run(input.data(), input.size(), options, fuel, saveTo,
+                    resumeFrom);
+  } else {
+    usage(argv[0]);
+    return -1;
   }
   return 0;
 }
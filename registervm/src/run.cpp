@@ -1,144 +1,740 @@
 #include "run.h"
+#include "arena.h"
 #include "bytecode.h"
+#include "jit.h"
+#include "mappedfile.h"
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
 
 using std::cerr;
 using std::cout;
 using std::endl;
+using std::vector;
 
-namespace bytecode {
+namespace registervm {
 typedef int64_t Word;
-#define MEMORY_SIZE 2048
-struct Vm {
-  Instruction *instructions;
+
+// Every instruction is specialized at load time on its opcode and on the four
+// bits that say where its operands live, so the handler that runs it knows
+// statically whether each operand is an immediate, a register or memory.
+static constexpr unsigned IMMEDIATE = 1;
+static constexpr unsigned SRC1_MEMORY = 2;
+static constexpr unsigned SRC2_MEMORY = 4;
+static constexpr unsigned DST_MEMORY = 8;
+#define OPERAND_MODES 16
+// Handler indices past the specialized handlers.
+#define UNKNOWN_HANDLER (OPCODE_COUNT * OPERAND_MODES)
+#define END_OF_PROGRAM_HANDLER (UNKNOWN_HANDLER + 1)
+// The records of literal words, which only a computed GOTO can reach, and
+// the one that jumps to immediate targets outside the program lead to.
+#define LITERAL_HANDLER (UNKNOWN_HANDLER + 2)
+
+struct SpecializedInstruction {
+  union {
+    // The value of the literal words that follow the instruction, if it has
+    // any.
+    Word literal;
+    // For branches, and gotos with an immediate target, the record of the
+    // target, found at load time so that jumping does not index the program.
+    const SpecializedInstruction *target;
+  };
+  Instruction instruction;
+  uint16_t handler;
+};
+
+static constexpr uint16_t handlerIndex(Opcode opcode, unsigned modes) {
+  return (uint16_t)((unsigned)opcode * OPERAND_MODES + modes);
+}
+
+static uint16_t specialize(Instruction instruction) {
+  if (instruction.opcode >= OPCODE_COUNT) {
+    return UNKNOWN_HANDLER;
+  }
+  unsigned modes = (instruction.hasImmediate ? IMMEDIATE : 0) |
+                   (instruction.src1UsesMemory ? SRC1_MEMORY : 0) |
+                   (instruction.src2UsesMemory ? SRC2_MEMORY : 0) |
+                   (instruction.dstUsesMemory ? DST_MEMORY : 0);
+  return handlerIndex((Opcode)instruction.opcode, modes);
+}
+
+struct ModuleData {
+  RunOptions options;
+  size_t instructionCount;
+  // A record for every word of the program, plus one that stops a program
+  // that runs off the end and one that stops a jump outside it.
+  vector<SpecializedInstruction> specialized;
+  JitCode jitCode;
+  bool hasJitCode;
+
+  ~ModuleData() {
+    if (hasJitCode) {
+      jitRelease(jitCode);
+    }
+  }
+};
+
+// Memory operands are checked against MEMORY_SIZE before the instruction
+// that has them runs, by the interpreter and the compiled code alike. The
+// guards this many words long either side of memory only back the checks
+// up. They are only address space, so they cost nothing else.
+#define MEMORY_GUARD_WORDS (1 << 20)
+
+struct VmState {
+  // The records of the program being run, and how many words it has, which
+  // bounds a computed GOTO.
+  const SpecializedInstruction *code;
+  size_t instructionCount;
   size_t ip;
   Word registers[NUM_REGISTERS];
-  Word memory[MEMORY_SIZE];
+  // MEMORY_SIZE words, in arena.
+  Word *memory;
+  Word result;
+  // Why the program stopped, once execute() returns false.
+  Status status;
+  // Instructions run so far, kept only when interpret() counts them.
+  uint64_t executed;
+  // GOTOs and branches taken that a metered program may still make.
+  uint64_t fuel;
+  Arena arena;
+
+  VmState();
 };
-static Vm vm;
 
-static inline Word readImmediate(Instruction &instruction) {
-  int16_t immediate = instruction.immediate;
-  return immediate;
+VmState::VmState()
+    : code(nullptr), instructionCount(0), ip(0), registers(),
+      memory(nullptr), result(0), status(Status::EXITED), executed(0),
+      fuel(UINT64_MAX) {
+  // An empty area first puts a guard before memory as well as after it.
+  ArenaArea areas[] = {
+      {0, MEMORY_GUARD_WORDS * sizeof(Word), nullptr},
+      {MEMORY_SIZE * sizeof(Word), MEMORY_GUARD_WORDS * sizeof(Word),
+       nullptr}};
+  arena.reserve(areas, 2);
+  memory = (Word *)areas[1].start;
 }
-static inline Word readSrc1(Instruction &instruction) {
-  if (instruction.src1UsesMemory) {
-    return vm.memory[vm.registers[instruction.src1]];
+
+template <bool UsesMemory> static inline Word readOperand(const VmState &vm,
+                                                       unsigned reg) {
+  if (UsesMemory) {
+    return vm.memory[vm.registers[reg]];
   } else {
-    return vm.registers[instruction.src1];
+    return vm.registers[reg];
   }
 }
-static inline Word readSrc2(Instruction &instruction) {
-  if (instruction.src2UsesMemory) {
-    return vm.memory[vm.registers[instruction.src2]];
+template <unsigned Modes>
+static inline Word readSrc1(const VmState &vm,
+                            const Instruction &instruction) {
+  if (Modes & IMMEDIATE) {
+    int16_t immediate = instruction.immediate;
+    return immediate;
   } else {
-    return vm.registers[instruction.src2];
+    return readOperand<(Modes & SRC1_MEMORY) != 0>(vm, instruction.src1);
   }
 }
-static inline Word readDst(Instruction &instruction) {
-    if (instruction.dstUsesMemory) {
-      return vm.memory[vm.registers[instruction.dst]];
-    }else {
-      return vm.registers[instruction.dst];
-    }
-}
-
-static inline Word readSingleOperand(Instruction &instruction) {
-    if (instruction.hasImmediate) {
-      return readImmediate(instruction);
-    }else {
-      return readDst(instruction);
-    }
+template <unsigned Modes>
+static inline Word readSrc2(const VmState &vm,
+                            const Instruction &instruction) {
+  return readOperand<(Modes & SRC2_MEMORY) != 0>(vm, instruction.src2);
 }
-static inline void read1Source(Instruction &instruction, Word *src) {
-  if (instruction.hasImmediate) {
-    *src = readImmediate(instruction);
+template <unsigned Modes>
+static inline Word readSingleOperand(const VmState &vm,
+                                     const Instruction &instruction) {
+  if (Modes & IMMEDIATE) {
+    int16_t immediate = instruction.immediate;
+    return immediate;
   } else {
-    *src = readSrc1(instruction);
+    return readOperand<(Modes & DST_MEMORY) != 0>(vm, instruction.dst);
   }
 }
-static inline void read2Sources(Instruction &instruction, Word *src1,
-                                Word *src2) {
-  if (instruction.hasImmediate) {
-    *src1 = readImmediate(instruction);
+// Whether every memory operand of instruction addresses a word of memory.
+// Addresses are compared unsigned, so negative ones fail too.
+template <Opcode Op, unsigned Modes>
+static inline bool memoryOperandsInBounds(const VmState &vm,
+                                          const Instruction &instruction) {
+  constexpr bool immediate = (Modes & IMMEDIATE) != 0;
+  return (!(Modes & SRC1_MEMORY) || !usesSrc1(Op, immediate) ||
+          (uint64_t)vm.registers[instruction.src1] < MEMORY_SIZE) &&
+         (!(Modes & SRC2_MEMORY) || !usesSrc2(Op) ||
+          (uint64_t)vm.registers[instruction.src2] < MEMORY_SIZE) &&
+         (!(Modes & DST_MEMORY) || !usesDst(Op, immediate) ||
+          (uint64_t)vm.registers[instruction.dst] < MEMORY_SIZE);
+}
+template <unsigned Modes>
+static inline void writeDestination(VmState &vm,
+                                    const Instruction &instruction,
+                                    Word value) {
+  if (Modes & DST_MEMORY) {
+    vm.memory[vm.registers[instruction.dst]] = value;
   } else {
-    *src1 = readSrc1(instruction);
+    vm.registers[instruction.dst] = value;
   }
-  *src2 = readSrc2(instruction);
 }
-static inline void writeDestination(Instruction &instruction, Word value) {
-    if (instruction.dstUsesMemory) {
-      vm.memory[vm.registers[instruction.dst]] = value;
-    }else {
-      vm.registers[instruction.dst] = value;
-    }
+
+// Charges a jump against the fuel, if metered. Returns false when the fuel
+// runs out, with vm.status set.
+template <bool Metered> static inline bool burnFuel(VmState &vm,
+                                                    uint64_t &fuel) {
+  if (Metered && --fuel == 0) {
+    vm.status = Status::OUT_OF_FUEL;
+    return false;
+  }
+  return true;
 }
 
-void run(void *program, size_t programSize) {
-  (void)programSize;
-  Header *header = (Header *)program;
-  if (header->magic != BYTECODE_MAGIC) {
-    cerr << "Not an rvm file" << endl;
-    return;
+// Runs one instruction, with ip already pointing at the next one. Returns
+// false when the program stops, with vm.status set. Metered, a jump is taken
+// before it burns the last of the fuel, so the program resumes at its target.
+template <Opcode Op, unsigned Modes, bool Metered>
+static inline bool execute(VmState &vm,
+                           const SpecializedInstruction &specialized,
+                           const SpecializedInstruction *&ip, uint64_t &fuel) {
+  const Instruction &instruction = specialized.instruction;
+  if (!memoryOperandsInBounds<Op, Modes>(vm, instruction)) {
+    vm.status = Status::MEMORY_OUT_OF_BOUNDS;
+    return false;
   }
-  vm.instructions = (Instruction *)(header + 1);
+  switch (Op) {
+  case Opcode::MOV:
+    writeDestination<Modes>(vm, instruction, readSrc1<Modes>(vm, instruction));
+    return true;
+  case Opcode::ADD:
+    writeDestination<Modes>(vm, instruction, readSrc1<Modes>(vm, instruction) +
+                                             readSrc2<Modes>(vm, instruction));
+    return true;
+  case Opcode::SUB:
+    writeDestination<Modes>(vm, instruction, readSrc2<Modes>(vm, instruction) -
+                                             readSrc1<Modes>(vm, instruction));
+    return true;
+  case Opcode::MUL:
+    writeDestination<Modes>(vm, instruction, readSrc1<Modes>(vm, instruction) *
+                                             readSrc2<Modes>(vm, instruction));
+    return true;
+  case Opcode::DIV: {
+    Word src1 = readSrc1<Modes>(vm, instruction);
+    Word src2 = readSrc2<Modes>(vm, instruction);
+    if (src1 == 0) {
+      vm.status = Status::DIVIDE_BY_ZERO;
+      return false;
+    }
+    writeDestination<Modes>(vm, instruction, src2 / src1);
+    return true;
+  }
+  case Opcode::GOTO: {
+    if (Modes & IMMEDIATE) {
+      ip = specialized.target;
+    } else {
+      Word target = readSingleOperand<Modes>(vm, instruction);
+      if (target < 0 || (size_t)target > vm.instructionCount) {
+        vm.status = Status::INVALID_JUMP;
+        return false;
+      }
+      ip = vm.code + target;
+    }
+    return burnFuel<Metered>(vm, fuel);
+  }
+  case Opcode::PRINT:
+    cout << readSingleOperand<Modes>(vm, instruction) << endl;
+    return true;
+  case Opcode::EXIT:
+    vm.status = Status::EXITED;
+    return false;
+  case Opcode::AND:
+    writeDestination<Modes>(vm, instruction, readSrc1<Modes>(vm, instruction) &
+                                             readSrc2<Modes>(vm, instruction));
+    return true;
+  case Opcode::OR:
+    writeDestination<Modes>(vm, instruction, readSrc1<Modes>(vm, instruction) |
+                                             readSrc2<Modes>(vm, instruction));
+    return true;
+  case Opcode::XOR:
+    writeDestination<Modes>(vm, instruction, readSrc1<Modes>(vm, instruction) ^
+                                             readSrc2<Modes>(vm, instruction));
+    return true;
+  case Opcode::SHL:
+    writeDestination<Modes>(vm, instruction, readSrc2<Modes>(vm, instruction) <<
+                                             readSrc1<Modes>(vm, instruction));
+    return true;
+  case Opcode::SHR:
+    writeDestination<Modes>(vm, instruction, readSrc2<Modes>(vm, instruction) >>
+                                             readSrc1<Modes>(vm, instruction));
+    return true;
+  case Opcode::MOVW:
+    writeDestination<Modes>(vm, instruction, specialized.literal);
+    ip += literalWordCount(Op);
+    return true;
+  case Opcode::BEQ:
+  case Opcode::BNE:
+  case Opcode::BLT:
+  case Opcode::BGT: {
+    Word src1 = readSrc1<Modes>(vm, instruction);
+    Word src2 = readSrc2<Modes>(vm, instruction);
+    bool taken = Op == Opcode::BEQ   ? src2 == src1
+                 : Op == Opcode::BNE ? src2 != src1
+                 : Op == Opcode::BLT ? src2 < src1
+                                     : src2 > src1;
+    if (taken) {
+      ip = specialized.target;
+      return burnFuel<Metered>(vm, fuel);
+    }
+    ip += literalWordCount(Op);
+    return true;
+  }
+  case Opcode::HALT:
+    vm.result = readSingleOperand<Modes>(vm, instruction);
+    vm.status = Status::FINISHED;
+    return false;
+  }
+  return false;
+}
+
+// The instruction pointer is kept in a local while the program runs, so it
+// can live in a register, and written back to vm.ip when it stops, as is the
+// fuel. With Count, every instruction is also counted into vm.executed.
+template <bool Count = false, bool Metered = false>
+static Status interpret(VmState &vm, const SpecializedInstruction *program) {
+  vm.code = program;
+  const SpecializedInstruction *ip = program + vm.ip;
+  uint64_t fuel = vm.fuel;
   while (true) {
-    Instruction instruction = vm.instructions[vm.ip++];
-    switch ((Opcode)instruction.opcode) {
-    case Opcode::MOV: {
-      Word src;
-      read1Source(instruction, &src);
-      writeDestination(instruction, src);
-      break;
+    if (Count) {
+      vm.executed++;
     }
-    case Opcode::ADD: {
-      Word src1;
-      Word src2;
-      read2Sources(instruction, &src1, &src2);
-      writeDestination(instruction, src1 + src2);
-      break;
+    const SpecializedInstruction &specialized = *ip++;
+    switch (specialized.handler) {
+#define MODE_CASE(opcode, modes)                                               \
+  case handlerIndex(Opcode::opcode, modes):                                    \
+    if (!execute<Opcode::opcode, modes, Metered>(vm, specialized, ip,         \
+                                                 fuel)) {                      \
+      vm.ip = ip - program;                                                    \
+      vm.fuel = fuel;                                                          \
+      return vm.status;                                                        \
+    }                                                                          \
+    break;
+#define OPCODE_CASES(opcode)                                                   \
+  MODE_CASE(opcode, 0)                                                         \
+  MODE_CASE(opcode, 1)                                                         \
+  MODE_CASE(opcode, 2)                                                         \
+  MODE_CASE(opcode, 3)                                                         \
+  MODE_CASE(opcode, 4)                                                         \
+  MODE_CASE(opcode, 5)                                                         \
+  MODE_CASE(opcode, 6)                                                         \
+  MODE_CASE(opcode, 7)                                                         \
+  MODE_CASE(opcode, 8)                                                         \
+  MODE_CASE(opcode, 9)                                                         \
+  MODE_CASE(opcode, 10)                                                        \
+  MODE_CASE(opcode, 11)                                                        \
+  MODE_CASE(opcode, 12)                                                        \
+  MODE_CASE(opcode, 13)                                                        \
+  MODE_CASE(opcode, 14)                                                        \
+  MODE_CASE(opcode, 15)
+      FOR_EACH_OPCODE(OPCODE_CASES)
+#undef OPCODE_CASES
+#undef MODE_CASE
+    case END_OF_PROGRAM_HANDLER:
+      vm.ip = ip - program;
+      return Status::END_OF_PROGRAM;
+    case LITERAL_HANDLER:
+      vm.ip = ip - program;
+      return Status::INVALID_JUMP;
+    default: // UNKNOWN_HANDLER
+      vm.ip = ip - program;
+      return Status::UNKNOWN_INSTRUCTION;
     }
-    case Opcode::SUB: {
-      Word src1;
-      Word src2;
-      read2Sources(instruction, &src1, &src2);
-      writeDestination(instruction, src2 - src1);
-      break;
+  }
+}
+
+// Fills in a record for every word of the program, plus the two after it,
+// and points branches and immediate gotos at the records of their targets.
+// Reports the problem on cerr and returns false if an instruction is missing
+// its literal words or a branch does not target an instruction.
+static bool specializeProgram(const Instruction *instructions,
+                              size_t instructionCount,
+                              vector<SpecializedInstruction> &specialized) {
+  vector<bool> isLiteral(instructionCount + 1, false);
+  for (size_t i = 0; i < instructionCount; i++) {
+    Instruction instruction = instructions[i];
+    SpecializedInstruction &record = specialized[i];
+    record.instruction = instruction;
+    record.handler = specialize(instruction);
+    record.literal = 0;
+    if (record.handler == UNKNOWN_HANDLER) {
+      continue;
     }
-    case Opcode::MUL: {
-      Word src1;
-      Word src2;
-      read2Sources(instruction, &src1, &src2);
-      writeDestination(instruction, src1 * src2);
-      break;
+    size_t literalWords = literalWordCount((Opcode)instruction.opcode);
+    if (i + literalWords >= instructionCount && literalWords > 0) {
+      cerr << "Truncated instruction at " << i << endl;
+      return false;
     }
-    case Opcode::DIV: {
-      Word src1;
-      Word src2;
-      read2Sources(instruction, &src1, &src2);
-      if (src1 == 0) {
-        cerr << "Divide by zero" << endl;
-        return;
-      }
-      writeDestination(instruction, src2 / src1);
-      break;
+    uint64_t literal = 0;
+    for (size_t j = 0; j < literalWords; j++) {
+      uint32_t word;
+      memcpy(&word, &instructions[i + 1 + j], sizeof(word));
+      literal |= (uint64_t)word << (32 * j);
+      specialized[i + 1 + j].instruction = instructions[i + 1 + j];
+      specialized[i + 1 + j].handler = LITERAL_HANDLER;
+      isLiteral[i + 1 + j] = true;
     }
-    case Opcode::GOTO: {
-      Word offset = readSingleOperand(instruction);
-      vm.ip = offset;
-      break;
+    record.literal = literal;
+    i += literalWords;
+  }
+  specialized[instructionCount].handler = END_OF_PROGRAM_HANDLER;
+  SpecializedInstruction &outside = specialized[instructionCount + 1];
+  outside.literal = 0;
+  outside.handler = LITERAL_HANDLER;
+  for (size_t i = 0; i < instructionCount; i++) {
+    SpecializedInstruction &record = specialized[i];
+    if (record.handler != UNKNOWN_HANDLER &&
+        record.handler != LITERAL_HANDLER &&
+        (Opcode)record.instruction.opcode == Opcode::GOTO &&
+        record.instruction.hasImmediate) {
+      // Jumps outside the program fail when they are taken, as a computed
+      // GOTO does.
+      int16_t target = record.instruction.immediate;
+      record.target = target < 0 || (size_t)target > instructionCount
+                          ? &outside
+                          : &specialized[target];
+      continue;
     }
-    case Opcode::PRINT: {
-      Word value = readSingleOperand(instruction);
-      cout << value << endl;
-      break;
+    if (record.handler == UNKNOWN_HANDLER ||
+        record.handler == LITERAL_HANDLER ||
+        !isConditionalBranch((Opcode)record.instruction.opcode)) {
+      continue;
     }
-    case Opcode::EXIT: {
-      return;
+    uint64_t target = record.literal;
+    if (target > instructionCount || isLiteral[target]) {
+      cerr << "Invalid branch target at " << i << endl;
+      return false;
+    }
+    record.target = &specialized[target];
+  }
+  return true;
+}
+
+static Status runJit(VmState &vm, const JitCode &code) {
+  switch (code.entry(vm.registers, vm.memory, &vm.result)) {
+  case JitStatus::EXIT:
+    return Status::EXITED;
+  case JitStatus::HALT:
+    return Status::FINISHED;
+  case JitStatus::DIVIDE_BY_ZERO:
+    return Status::DIVIDE_BY_ZERO;
+  case JitStatus::BAD_JUMP:
+    return Status::INVALID_JUMP;
+  case JitStatus::END_OF_PROGRAM:
+    return Status::END_OF_PROGRAM;
+  case JitStatus::MEMORY_OUT_OF_BOUNDS:
+    return Status::MEMORY_OUT_OF_BOUNDS;
+  }
+  return Status::UNKNOWN_INSTRUCTION;
+}
+
+const char *statusMessage(Status status) {
+  switch (status) {
+  case Status::EXITED:
+    return "Exited";
+  case Status::FINISHED:
+    return "Finished";
+  case Status::DIVIDE_BY_ZERO:
+    return "Divide by zero";
+  case Status::INVALID_JUMP:
+    return "Invalid jump target";
+  case Status::END_OF_PROGRAM:
+    return "Ran off the end of the program";
+  case Status::UNKNOWN_INSTRUCTION:
+    return "Unknown instruction";
+  case Status::MEMORY_OUT_OF_BOUNDS:
+    return "Memory address out of bounds";
+  case Status::OUT_OF_FUEL:
+    return "Ran out of fuel";
+  }
+  return "Unknown status";
+}
+
+Module::Module() = default;
+Module::~Module() = default;
+
+bool Module::load(const void *program, size_t programSize,
+                  const RunOptions &options) {
+  data.reset();
+  const Header *header = (const Header *)program;
+  if (programSize < sizeof(Header) || header->magic != BYTECODE_MAGIC) {
+    cerr << "Not an rvm file" << endl;
+    return false;
+  }
+  if (header->version != CURRENT_BYTECODE_VERSION) {
+    cerr << "Unsupported rvm version " << header->version << endl;
+    return false;
+  }
+  if (header->instructionsOffset % INSTRUCTIONS_ALIGNMENT != 0 ||
+      (uintptr_t)program % INSTRUCTIONS_ALIGNMENT != 0) {
+    cerr << "Misaligned instructions" << endl;
+    return false;
+  }
+  size_t instructionCount = header->instructionCount;
+  if (header->instructionsOffset < sizeof(Header) ||
+      header->instructionsOffset + (uint64_t)instructionCount *
+                                       sizeof(Instruction) >
+          programSize) {
+    cerr << "Truncated rvm file" << endl;
+    return false;
+  }
+  const Instruction *instructions =
+      (const Instruction *)((const uint8_t *)program +
+                            header->instructionsOffset);
+  std::unique_ptr<ModuleData> loaded(new ModuleData());
+  loaded->options = options;
+  loaded->instructionCount = instructionCount;
+  loaded->hasJitCode = false;
+  // Two extra records stop a program that runs off the end and a jump
+  // outside it.
+  loaded->specialized.resize(instructionCount + 2);
+  if (!specializeProgram(instructions, instructionCount,
+                         loaded->specialized)) {
+    return false;
+  }
+  if (options.jit && options.metered) {
+    cerr << "Compiled code cannot be metered, so the program is interpreted"
+         << endl;
+  } else if (options.jit) {
+    if (jitCompile(instructions, instructionCount, loaded->jitCode)) {
+      loaded->hasJitCode = true;
+    } else {
+      cerr << "Falling back to the interpreter" << endl;
+    }
+  }
+  data = std::move(loaded);
+  return true;
+}
+
+bool Module::loaded() const { return data != nullptr; }
+
+Vm::Vm(const Module &module) : module(module), state(new VmState()) {}
+Vm::~Vm() = default;
+
+Status Vm::run() {
+  state->instructionCount = module.data->instructionCount;
+  state->ip = 0;
+  return resume();
+}
+
+// A turn of a Vm, run inside the guards of its memory.
+struct Turn {
+  VmState &state;
+  const ModuleData &data;
+  Status status;
+};
+
+static void takeTurn(void *argument) {
+  Turn &turn = *(Turn *)argument;
+  VmState &state = turn.state;
+  const ModuleData &data = turn.data;
+  if (data.hasJitCode) {
+    turn.status = runJit(state, data.jitCode);
+  } else if (data.options.metered) {
+    turn.status = state.fuel == 0
+                      ? Status::OUT_OF_FUEL
+                      : interpret<false, true>(state, data.specialized.data());
+  } else {
+    turn.status = interpret(state, data.specialized.data());
+  }
+}
+
+Status Vm::resume() {
+  Turn turn = {*state, *module.data, Status::EXITED};
+  if (!state->arena.guarded(takeTurn, &turn)) {
+    return Status::MEMORY_OUT_OF_BOUNDS;
+  }
+  return turn.status;
+}
+
+void Vm::setFuel(uint64_t fuel) { state->fuel = fuel; }
+
+int64_t Vm::result() const { return state->result; }
+int64_t *Vm::registers() { return state->registers; }
+size_t Vm::registerCount() const { return NUM_REGISTERS; }
+int64_t *Vm::memory() { return state->memory; }
+size_t Vm::memorySize() const { return MEMORY_SIZE; }
+
+void Vm::reset() {
+  memset(state->registers, 0, sizeof(state->registers));
+  state->arena.clear(state->memory, MEMORY_SIZE * sizeof(Word));
+  state->result = 0;
+}
+
+// A snapshot image is this header, then the registers and memoryWords words
+// of memory, all in host byte order.
+#define SNAPSHOT_MAGIC 0x5A7E0C4C
+#define CURRENT_SNAPSHOT_VERSION 1
+struct SnapshotHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  // Identifies the program, so that an image is only restored into the
+  // program it was taken from.
+  uint64_t fingerprint;
+  uint64_t ip;
+  // Memory is saved up to its last nonzero word.
+  uint64_t memoryWords;
+};
+
+// FNV-1a over the words of the program.
+static uint64_t fingerprint(const ModuleData &module) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < module.instructionCount; i++) {
+    const uint8_t *bytes =
+        (const uint8_t *)&module.specialized[i].instruction;
+    for (size_t j = 0; j < sizeof(Instruction); j++) {
+      hash = (hash ^ bytes[j]) * 1099511628211ull;
     }
+  }
+  return hash;
+}
+
+void Vm::snapshot(vector<uint8_t> &image) const {
+  SnapshotHeader header;
+  header.magic = SNAPSHOT_MAGIC;
+  header.version = CURRENT_SNAPSHOT_VERSION;
+  header.reserved = 0;
+  header.fingerprint = fingerprint(*module.data);
+  header.ip = state->ip;
+  header.memoryWords = MEMORY_SIZE;
+  while (header.memoryWords > 0 &&
+         state->memory[header.memoryWords - 1] == 0) {
+    header.memoryWords--;
+  }
+  image.resize(sizeof(header) + sizeof(state->registers) +
+               header.memoryWords * sizeof(Word));
+  uint8_t *write = image.data();
+  memcpy(write, &header, sizeof(header));
+  write += sizeof(header);
+  memcpy(write, state->registers, sizeof(state->registers));
+  write += sizeof(state->registers);
+  memcpy(write, state->memory, header.memoryWords * sizeof(Word));
+}
+
+bool Vm::restore(const void *image, size_t size) {
+  const ModuleData &data = *module.data;
+  SnapshotHeader header;
+  if (size < sizeof(header)) {
+    cerr << "Not a snapshot" << endl;
+    return false;
+  }
+  memcpy(&header, image, sizeof(header));
+  if (header.magic != SNAPSHOT_MAGIC) {
+    cerr << "Not a snapshot" << endl;
+    return false;
+  }
+  if (header.version != CURRENT_SNAPSHOT_VERSION) {
+    cerr << "Unsupported snapshot version " << header.version << endl;
+    return false;
+  }
+  if (header.fingerprint != fingerprint(data)) {
+    cerr << "The snapshot is of another program" << endl;
+    return false;
+  }
+  if (data.hasJitCode && header.ip != 0) {
+    cerr << "Compiled code always starts at the beginning, so it cannot "
+            "resume this snapshot"
+         << endl;
+    return false;
+  }
+  // A program stopped by a jump outside it resumes at the record past the
+  // end.
+  if (header.ip > data.instructionCount + 1 ||
+      header.memoryWords > MEMORY_SIZE) {
+    cerr << "Corrupt snapshot" << endl;
+    return false;
+  }
+  if (size != sizeof(header) + sizeof(state->registers) +
+                  header.memoryWords * sizeof(Word)) {
+    cerr << "Truncated snapshot" << endl;
+    return false;
+  }
+  const uint8_t *read = (const uint8_t *)image + sizeof(header);
+  state->instructionCount = data.instructionCount;
+  state->ip = header.ip;
+  memcpy(state->registers, read, sizeof(state->registers));
+  read += sizeof(state->registers);
+  memcpy(state->memory, read, header.memoryWords * sizeof(Word));
+  memset(state->memory + header.memoryWords, 0,
+         (MEMORY_SIZE - header.memoryWords) * sizeof(Word));
+  return true;
+}
+
+bool countInstructions(const void *program, size_t programSize,
+                       uint64_t &count) {
+  RunOptions options;
+  options.jit = false;
+  options.metered = false;
+  Module module;
+  if (!module.load(program, programSize, options)) {
+    return false;
+  }
+  std::unique_ptr<VmState> state(new VmState());
+  state->instructionCount = module.data->instructionCount;
+  state->ip = 0;
+  state->executed = 0;
+  Status status = Status::MEMORY_OUT_OF_BOUNDS;
+  struct Counting {
+    VmState &state;
+    const SpecializedInstruction *code;
+    Status &status;
+  } counting = {*state, module.data->specialized.data(), status};
+  state->arena.guarded(
+      [](void *argument) {
+        Counting &counting = *(Counting *)argument;
+        counting.status = interpret<true>(counting.state, counting.code);
+      },
+      &counting);
+  if (status != Status::EXITED && status != Status::FINISHED) {
+    cerr << statusMessage(status) << endl;
+    return false;
+  }
+  count = state->executed;
+  return true;
+}
+
+void run(const void *program, size_t programSize, const RunOptions &options,
+         uint64_t fuel, const std::string &saveTo,
+         const std::string &resumeFrom) {
+  Module module;
+  if (!module.load(program, programSize, options)) {
+    return;
+  }
+  Vm vm(module);
+  vm.setFuel(fuel);
+  Status status;
+  if (resumeFrom.empty()) {
+    status = vm.run();
+  } else {
+    MappedFile image;
+    if (!image.open(resumeFrom) || !vm.restore(image.data(), image.size())) {
+      return;
     }
+    status = vm.resume();
+  }
+  switch (status) {
+  case Status::EXITED:
+    break;
+  case Status::FINISHED:
+    cout << "Finished with " << vm.result() << endl;
+    break;
+  default:
+    cerr << statusMessage(status) << endl;
+    break;
+  }
+  if (status == Status::OUT_OF_FUEL && !saveTo.empty()) {
+    vector<uint8_t> image;
+    vm.snapshot(image);
+    std::ofstream output(saveTo, std::ios::binary);
+    output.write((const char *)image.data(), image.size());
+    cout << "Saved the state to " << saveTo << endl;
   }
 }
-} // namespace bytecode
+} // namespace registervm
@@ -34,16 +34,166 @@ enum class Opcode : uint8_t {
   CGOTO_NEQ,
   CGOTO_GT,
   CGOTO_LT,
-  EXIT
+  EXIT,
+  // Calls a function from the function table. Its arguments are popped into
+  // its first locals, the last argument from the top of the stack, and the
+  // rest of its locals start at zero.
+  CALL,
+  // Returns from a function with the single value left on its operand stack,
+  // which the caller finds pushed in place of the arguments.
+  RET,
+  // The heap: as many words as the header asks for, zeroed before the first
+  // run, which every Vm has to itself. Addresses and lengths in words come
+  // off the operand stack, pushed in the order given, and an access outside
+  // the heap stops the program.
+  // address -> heap[address]
+  HLOAD,
+  // address, value -> (heap[address] = value)
+  HSTORE,
+  // destination, left, right, count -> (for each i below count,
+  // heap[destination + i] = heap[left + i] op heap[right + i])
+  VADD,
+  VMUL,
+  VAND,
+  VXOR,
+  // address, count -> the sum, minimum or maximum of the count words from
+  // address. The minimum of no words is INT64_MAX and the maximum INT64_MIN.
+  VSUM,
+  VMIN,
+  VMAX,
+  // destination, value, count -> (count words from destination = value)
+  VFILL,
+  // destination, source, count -> (count words from source copied to
+  // destination, as if through a temporary copy)
+  VCOPY,
+  // address, value, count -> how many of the count words from address equal
+  // value
+  VCOUNT_EQ,
+  // Superinstructions, produced by fusing common instruction sequences at
+  // load time.
+  // locals[index] += immediate
+  LINC,
+  // locals[destination] = locals[left] + locals[right]
+  LADD,
+  // Compare the top of the stack with an immediate and branch.
+  CGOTO_EQ_IMM,
+  CGOTO_NEQ_IMM,
+  CGOTO_GT_IMM,
+  CGOTO_LT_IMM,
+  // Compare a local with an immediate and branch.
+  LCGOTO_EQ_IMM,
+  LCGOTO_NEQ_IMM,
+  LCGOTO_GT_IMM,
+  LCGOTO_LT_IMM,
+  // Compare a local with a constant and branch.
+  LCGOTO_EQ_CONST,
+  LCGOTO_NEQ_CONST,
+  LCGOTO_GT_CONST,
+  LCGOTO_LT_CONST,
+  // Not an instruction but a prefix: the instruction after it has 32 bit
+  // operands (int32_t immediates, uint32_t indices and offsets) in place of
+  // 16 bit ones. Only instructions whose operands do not fit are widened.
+  WIDE
 };
 
+// Applies X to the name of every opcode, in the same order as Opcode. The
+// WIDE prefix is left out.
+#define FOR_EACH_OPCODE(X)                                                     \
+  X(IPUSH_CONST)                                                               \
+  X(IPUSH_IMM)                                                                 \
+  X(DUP)                                                                       \
+  X(DROP)                                                                      \
+  X(ADD)                                                                       \
+  X(IADD)                                                                      \
+  X(SUB)                                                                       \
+  X(ISUB)                                                                      \
+  X(MUL)                                                                       \
+  X(IMUL)                                                                      \
+  X(DIV)                                                                       \
+  X(IDIV)                                                                      \
+  X(LSHIFT)                                                                    \
+  X(ILSHIFT)                                                                   \
+  X(RSHIFT)                                                                    \
+  X(IRSHIFT)                                                                   \
+  X(AND)                                                                       \
+  X(IAND)                                                                      \
+  X(OR)                                                                        \
+  X(IOR)                                                                       \
+  X(XOR)                                                                       \
+  X(IXOR)                                                                      \
+  X(LLOAD)                                                                     \
+  X(LSTORE)                                                                    \
+  X(GOTO)                                                                      \
+  X(CGOTO_EQ)                                                                  \
+  X(CGOTO_NEQ)                                                                 \
+  X(CGOTO_GT)                                                                  \
+  X(CGOTO_LT)                                                                  \
+  X(EXIT)                                                                      \
+  X(CALL)                                                                      \
+  X(RET)                                                                       \
+  X(HLOAD)                                                                     \
+  X(HSTORE)                                                                    \
+  X(VADD)                                                                      \
+  X(VMUL)                                                                      \
+  X(VAND)                                                                      \
+  X(VXOR)                                                                      \
+  X(VSUM)                                                                      \
+  X(VMIN)                                                                      \
+  X(VMAX)                                                                      \
+  X(VFILL)                                                                     \
+  X(VCOPY)                                                                     \
+  X(VCOUNT_EQ)                                                                 \
+  X(LINC)                                                                      \
+  X(LADD)                                                                      \
+  X(CGOTO_EQ_IMM)                                                              \
+  X(CGOTO_NEQ_IMM)                                                             \
+  X(CGOTO_GT_IMM)                                                              \
+  X(CGOTO_LT_IMM)                                                              \
+  X(LCGOTO_EQ_IMM)                                                             \
+  X(LCGOTO_NEQ_IMM)                                                            \
+  X(LCGOTO_GT_IMM)                                                             \
+  X(LCGOTO_LT_IMM)                                                             \
+  X(LCGOTO_EQ_CONST)                                                           \
+  X(LCGOTO_NEQ_CONST)                                                          \
+  X(LCGOTO_GT_CONST)                                                           \
+  X(LCGOTO_LT_CONST)
+
 #define BYTECODE_MAGIC 0xD74EF7F3
-#define CURRENT_BYTECODE_VERSION 1
+#define CURRENT_BYTECODE_VERSION 5
+
+// Sections start at these alignments, counted from the start of the file, so
+// a file mapped into memory can be run where it lies.
+#define CONSTANTS_ALIGNMENT 8
+#define FUNCTIONS_ALIGNMENT 4
+#define INSTRUCTIONS_ALIGNMENT 16
 
+// The constant pool, the function table and the instruction stream follow
+// the header, each at the offset the header gives, with zero padding before
+// them.
 struct Header {
   uint32_t magic;
   uint16_t version;
-  uint16_t constantCount;
+  uint16_t reserved;
+  uint32_t constantsOffset;
+  uint32_t constantCount;
+  uint32_t functionsOffset;
+  uint32_t functionCount;
+  uint32_t instructionsOffset;
+  uint32_t instructionsSize;
+  // Words of heap the program uses.
+  uint32_t heapSize;
+};
+
+// An entry in the function table. The function's code is the instructions
+// at offsets [start, start + size), which can only be entered by calling it.
+// Code outside every function is the main program, which starts at offset 0
+// and has MAX_LOCALS locals.
+struct Function {
+  uint32_t start;
+  uint32_t size;
+  uint16_t argumentCount;
+  // Including the arguments.
+  uint16_t localCount;
 };
 typedef int64_t Constant;
 } // namespace bytecode
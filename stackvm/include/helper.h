@@ -1,8 +1,6 @@
 #ifndef _HELPER_H
 #define _HELPER_H
 
-#include <cstddef>
-#include <fstream>
 #include <string>
 
 static inline bool startsWith(const std::string &s, const std::string &prefix) {
@@ -16,11 +14,5 @@ static inline bool endsWith(const std::string &s, const std::string &suffix) {
     return false;
   }
 }
-static size_t getFileSize(std::istream &input) {
-  input.seekg(0, std::ios::end);
-  size_t length = input.tellg();
-  input.seekg(0, std::ios::beg);
-  return length;
-}
 
 #endif
\ No newline at end of file
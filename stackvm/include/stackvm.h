@@ -0,0 +1,204 @@
+#ifndef _STACKVM_H
+#define _STACKVM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// The stack VM as a library. Load a program into a Module once, then run it
+// on as many Vm instances as needed. A loaded Module is never modified, bar
+// the one-time translation of a tiered module's program, which is made
+// under a lock, so instances on different threads can share it.
+namespace bytecode {
+enum class Dispatch {
+  // One switch over the opcode in a loop. Works with any compiler.
+  SWITCH,
+  // Every handler jumps straight to the next one through a table of label
+  // addresses (GCC and Clang only).
+  THREADED
+};
+
+// Whether this build has the threaded dispatch engine.
+bool threadedDispatchAvailable();
+// Whether this build can compile programs to native code.
+bool jitAvailable();
+
+struct RunOptions {
+  Dispatch dispatch;
+  // Translate the program into records with its operands and branch targets
+  // already resolved before running it, rather than running the bytecode
+  // directly.
+  bool predecode;
+  // With predecode, start by running the bytecode as it is stored, and only
+  // fuse and translate the program once it has taken a number of branches,
+  // calls and returns proportional to its size, carrying on from where it is
+  // with the same stacks and locals. Short runs never pay for the
+  // translation, and long ones soon run as fast as if it had been made up
+  // front. The translation is made once per module, so later runs start in
+  // it. Unless jit is set, fusion waits for the translation too.
+  bool tiered;
+  // Rewrite common instruction sequences into superinstructions before
+  // running.
+  bool fuse;
+  // Keep the top of the operand stack in a local variable rather than in
+  // memory.
+  bool cacheTop;
+  // Compile the program to native code and run that instead of
+  // interpreting it.
+  bool jit;
+  // Charge every branch taken, call and return against the fuel given to
+  // Vm::setFuel, and stop with OUT_OF_FUEL when it runs out, in a state
+  // that Vm::resume() continues from. Counting only jumps leaves the
+  // straight-line code as fast as ever, and still bounds every loop and
+  // recursion. Compiled code cannot be metered, so this overrides jit.
+  bool metered;
+};
+
+// The fastest options this build supports without compiling to native code.
+RunOptions defaultRunOptions();
+
+enum class Status {
+  // The program reached EXIT. Vm::result() holds the value it popped.
+  FINISHED,
+  DIVIDE_BY_ZERO,
+  END_OF_PROGRAM,
+  UNKNOWN_INSTRUCTION,
+  // Calls nested deeper than the call stack, the locals or the operand stack
+  // have room for, or the program ran into the guard past one of them.
+  STACK_OVERFLOW,
+  // A heap instruction addressed words outside the heap.
+  HEAP_OUT_OF_BOUNDS,
+  // A metered program used up its fuel. Vm::resume() continues it.
+  OUT_OF_FUEL
+};
+
+// A description of a status other than FINISHED, for error messages.
+const char *statusMessage(Status status);
+
+struct ModuleData;
+struct VmContext;
+
+class Module {
+public:
+  Module();
+  ~Module();
+  Module(const Module &) = delete;
+  Module &operator=(const Module &) = delete;
+
+  // Checks and verifies a bytecode file and prepares it to run with the
+  // given options. data is used in place and must outlive the module.
+  // Reports the problem on cerr and returns false if the program cannot be
+  // run, leaving the module empty.
+  bool load(const void *data, size_t size, const RunOptions &options);
+  bool loaded() const;
+  // Whether the program runs as native code. A module loaded with jit is
+  // interpreted instead if the compiler refuses the program.
+  bool compiled() const;
+
+private:
+  friend class Vm;
+  std::unique_ptr<ModuleData> data;
+};
+
+// One execution of a module: its own operand stack, locals and heap. Creating
+// a Vm allocates its state once; run() and reset() never allocate.
+class Vm {
+public:
+  // module must be loaded and must outlive the Vm.
+  explicit Vm(const Module &module);
+  ~Vm();
+  Vm(const Vm &) = delete;
+  Vm &operator=(const Vm &) = delete;
+
+  // Runs the program from the start, with the locals as they are.
+  Status run();
+  // Continues the program where it stopped, after run() or resume()
+  // returned OUT_OF_FUEL.
+  Status resume();
+  // How many more branches taken, calls and returns a metered program may
+  // make before it stops with OUT_OF_FUEL. There is no limit until this is
+  // called, and a module that is not metered ignores it.
+  void setFuel(uint64_t fuel);
+  // The value the program passed to EXIT, if run() returned FINISHED.
+  int64_t result() const;
+  // The locals, which a caller may set before run() to pass in inputs.
+  int64_t *locals();
+  size_t localCount() const;
+  // The heap, as large as the program asks for, which a caller may likewise
+  // fill before run() and read after it.
+  int64_t *heap();
+  size_t heapSize() const;
+  // Clears the operand stack and zeroes the locals and the heap, ready to
+  // run again.
+  void reset();
+  // Saves the state that resume() would continue from into image: the
+  // operand stack, the active calls, the locals and the heap up to its last
+  // nonzero word. Taken after run() returns OUT_OF_FUEL, it lets a program
+  // do its setup once and then be restored and resumed from there as often
+  // as needed, in this process or another.
+  void snapshot(std::vector<uint8_t> &image) const;
+  // Replaces the state with one saved by snapshot() from a Vm of the same
+  // program, loaded with the same options, ready for resume(). image need
+  // not be aligned, so it can be a file mapped into memory. Reports the
+  // problem on cerr and returns false, leaving the state as it was, if it is
+  // not such a snapshot.
+  bool restore(const void *image, size_t size);
+
+private:
+  const Module &module;
+  std::unique_ptr<VmContext> context;
+};
+
+// Runs the program in a bytecode file as it is stored, without fusion, and
+// counts the instructions it executes, so benchmarks can report the time per
+// instruction whatever engine they time. Reports the problem on cerr and
+// returns false if the program does not finish.
+bool countInstructions(const void *data, size_t size, uint64_t &count);
+
+struct BatchResult {
+  Status status;
+  // The value the program passed to EXIT, if status is FINISHED.
+  int64_t result;
+};
+
+// Runs module once per input, spread over threadCount threads (0 for one per
+// core). Each run starts with its input in the first locals and the other
+// locals zeroed. Every thread has its own Vm; the module is shared. Results
+// are returned in the order of inputs.
+std::vector<BatchResult>
+runBatch(const Module &module, const std::vector<std::vector<int64_t>> &inputs,
+         unsigned threadCount);
+
+struct SchedulerData;
+
+// Shares a fixed pool of threads between any number of metered Vms, which
+// take turns: each runs until it has used up a slice of fuel, then goes to
+// the back of the queue to be resumed later. A program that loops forever
+// then delays the others by at most a slice per turn, however many there
+// are.
+class Scheduler {
+public:
+  // Starts threadCount threads (0 for one per core), which give each Vm
+  // sliceFuel fuel a turn.
+  Scheduler(unsigned threadCount, uint64_t sliceFuel);
+  // Waits for every Vm submitted, then stops the threads.
+  ~Scheduler();
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  // Queues vm to run from the start, with fuel for all of its turns
+  // together. When it stops, by finishing, failing or using up its fuel,
+  // done is called with the status on one of the scheduler's threads. vm's
+  // module must be metered, and vm must be left alone until done is called.
+  void submit(Vm &vm, uint64_t fuel, std::function<void(Status)> done);
+  // Waits until every Vm submitted so far has stopped.
+  void wait();
+
+private:
+  std::unique_ptr<SchedulerData> data;
+};
+} // namespace bytecode
+
+#endif
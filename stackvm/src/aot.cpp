@@ -0,0 +1,634 @@
+#include "aot.h"
+#include "bytecode.h"
+#include "program.h"
+#include "verify.h"
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::ostream;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace bytecode {
+// What every compiled program starts with. Arithmetic goes through unsigned
+// integers so that it wraps around as the VM's does, rather than being
+// undefined behaviour the host compiler may optimize on, and shift counts
+// are taken modulo 64, as x86-64 does in the VM.
+static const char *const PRELUDE = R"(#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+enum class Outcome {
+  RETURNED,
+  FINISHED,
+  DIVIDE_BY_ZERO,
+  STACK_OVERFLOW,
+  HEAP_OUT_OF_BOUNDS
+};
+
+static const char *message(Outcome outcome) {
+  switch (outcome) {
+  case Outcome::RETURNED:
+  case Outcome::FINISHED:
+    break;
+  case Outcome::DIVIDE_BY_ZERO:
+    return "Divide by zero";
+  case Outcome::STACK_OVERFLOW:
+    return "Calls nested too deeply";
+  case Outcome::HEAP_OUT_OF_BOUNDS:
+    return "Heap access out of bounds";
+  }
+  return "Finished";
+}
+
+static inline int64_t add(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a + (uint64_t)b);
+}
+static inline int64_t sub(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a - (uint64_t)b);
+}
+static inline int64_t mul(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a * (uint64_t)b);
+}
+static inline int64_t shl(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a << (b & 63));
+}
+static inline int64_t shr(int64_t a, int64_t b) { return a >> (b & 63); }
+
+// The value the program passed to EXIT.
+static int64_t exitValue;
+)";
+
+// The heap and the loops behind the heap instructions, written plainly for
+// the host compiler to vectorize. Element-wise loops run in order, so an
+// overlapping destination sees the words already written, as in the VM.
+static const char *const HEAP_HELPERS = R"(
+static int64_t heap[HEAP_SIZE > 0 ? HEAP_SIZE : 1];
+
+static inline bool inHeap(int64_t address, int64_t count) {
+  return (uint64_t)address <= HEAP_SIZE &&
+         (uint64_t)count <= HEAP_SIZE - (uint64_t)address;
+}
+#define ELEMENT_WISE(name, operation)                                          \
+  static inline void name(int64_t *d, const int64_t *l, const int64_t *r,      \
+                          int64_t count) {                                     \
+    for (int64_t i = 0; i < count; i++) {                                      \
+      d[i] = operation(l[i], r[i]);                                            \
+    }                                                                          \
+  }
+#define AND(a, b) ((a) & (b))
+#define XOR(a, b) ((a) ^ (b))
+ELEMENT_WISE(vadd, add)
+ELEMENT_WISE(vmul, mul)
+ELEMENT_WISE(vand, AND)
+ELEMENT_WISE(vxor, XOR)
+static inline int64_t vsum(const int64_t *words, int64_t count) {
+  uint64_t sum = 0;
+  for (int64_t i = 0; i < count; i++) {
+    sum += words[i];
+  }
+  return (int64_t)sum;
+}
+static inline int64_t vmin(const int64_t *words, int64_t count) {
+  int64_t minimum = INT64_MAX;
+  for (int64_t i = 0; i < count; i++) {
+    minimum = words[i] < minimum ? words[i] : minimum;
+  }
+  return minimum;
+}
+static inline int64_t vmax(const int64_t *words, int64_t count) {
+  int64_t maximum = INT64_MIN;
+  for (int64_t i = 0; i < count; i++) {
+    maximum = words[i] > maximum ? words[i] : maximum;
+  }
+  return maximum;
+}
+static inline void vfill(int64_t *d, int64_t value, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    d[i] = value;
+  }
+}
+static inline int64_t vcountEq(const int64_t *words, int64_t value,
+                               int64_t count) {
+  int64_t equal = 0;
+  for (int64_t i = 0; i < count; i++) {
+    equal += words[i] == value;
+  }
+  return equal;
+}
+)";
+
+// Runs the program once from a clean heap, then prints its result, or with
+// --bench times it as "vm --bench" does. SOURCE_FILE is defined before it.
+static const char *const MAIN = R"(
+static Outcome run() {
+  memset(heap, 0, sizeof(heap));
+  exitValue = 0;
+  return runMain();
+}
+
+int main(int argc, char **argv) {
+  using std::chrono::steady_clock;
+  if (argc == 1) {
+    auto startTime = steady_clock::now();
+    Outcome outcome = run();
+    auto timeTaken = steady_clock::now() - startTime;
+    if (outcome == Outcome::FINISHED) {
+      std::cout << "Finished with " << exitValue << std::endl;
+    } else {
+      std::cerr << message(outcome) << std::endl;
+    }
+    std::cout << "It took "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     timeTaken)
+                         .count() /
+                     1000.0
+              << " seconds" << std::endl;
+    return outcome == Outcome::FINISHED ? 0 : -1;
+  }
+  if (argc != 3 || strncmp(argv[1], "--bench=", 8) != 0) {
+    std::cout << "Usage: " << argv[0] << " [--bench=<runs> <instructions>]"
+              << std::endl;
+    return -1;
+  }
+  size_t runCount = strtoul(argv[1] + 8, nullptr, 10);
+  double instructions = strtod(argv[2], nullptr);
+  if (runCount == 0) {
+    std::cerr << "Nothing to time" << std::endl;
+    return -1;
+  }
+  std::vector<double> times;
+  for (size_t i = 0; i <= runCount; i++) {
+    auto startTime = steady_clock::now();
+    Outcome outcome = run();
+    auto timeTaken = steady_clock::now() - startTime;
+    if (outcome != Outcome::FINISHED) {
+      std::cerr << message(outcome) << std::endl;
+      return -1;
+    }
+    if (i > 0) {
+      times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          timeTaken)
+                          .count());
+    }
+  }
+  double mean = 0;
+  for (double time : times) {
+    mean += time;
+  }
+  mean /= times.size();
+  double variance = 0;
+  for (double time : times) {
+    variance += (time - mean) * (time - mean);
+  }
+  if (times.size() > 1) {
+    variance /= times.size() - 1;
+  }
+  double fastest = *std::min_element(times.begin(), times.end());
+  std::cout << std::fixed << std::setprecision(0) << SOURCE_FILE << "\taot\t"
+            << runCount << '\t' << instructions << '\t' << mean << '\t'
+            << std::sqrt(variance) << '\t' << fastest << '\t'
+            << std::setprecision(3) << mean / instructions << '\t'
+            << std::setprecision(0) << instructions / (mean / 1e9)
+            << std::endl;
+  return 0;
+}
+)";
+
+static string literal(int64_t value) {
+  // -9223372036854775808 would be the negation of a literal too large for
+  // int64_t.
+  if (value == INT64_MIN) {
+    return "INT64_MIN";
+  }
+  if (value > INT32_MAX || value < INT32_MIN) {
+    return to_string(value) + "LL";
+  }
+  return to_string(value);
+}
+
+// The contents of a C++ string literal for text.
+static string quoted(const string &text) {
+  string result = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+    }
+    result += c;
+  }
+  return result + "\"";
+}
+
+static string slot(int64_t index) { return "s" + to_string(index); }
+static string local(int64_t index) { return "l" + to_string(index); }
+static string labelName(size_t offset) { return "L" + to_string(offset); }
+static string functionName(size_t index) {
+  return "function" + to_string(index);
+}
+
+// The C++ for left op right, for a binary opcode or its immediate form.
+static string binary(Opcode opcode, const string &left, const string &right) {
+  switch (opcode) {
+  case Opcode::ADD:
+  case Opcode::IADD:
+    return "add(" + left + ", " + right + ")";
+  case Opcode::SUB:
+  case Opcode::ISUB:
+    return "sub(" + left + ", " + right + ")";
+  case Opcode::MUL:
+  case Opcode::IMUL:
+    return "mul(" + left + ", " + right + ")";
+  case Opcode::DIV:
+  case Opcode::IDIV:
+    return left + " / " + right;
+  case Opcode::LSHIFT:
+  case Opcode::ILSHIFT:
+    return "shl(" + left + ", " + right + ")";
+  case Opcode::RSHIFT:
+  case Opcode::IRSHIFT:
+    return "shr(" + left + ", " + right + ")";
+  case Opcode::AND:
+  case Opcode::IAND:
+    return left + " & " + right;
+  case Opcode::OR:
+  case Opcode::IOR:
+    return left + " | " + right;
+  default:
+    break;
+  }
+  return left + " ^ " + right;
+}
+
+// The C++ comparison a conditional branch of any form makes.
+static const char *comparison(Opcode opcode) {
+  switch (opcode) {
+  case Opcode::CGOTO_EQ:
+  case Opcode::CGOTO_EQ_IMM:
+  case Opcode::LCGOTO_EQ_IMM:
+  case Opcode::LCGOTO_EQ_CONST:
+    return " == ";
+  case Opcode::CGOTO_NEQ:
+  case Opcode::CGOTO_NEQ_IMM:
+  case Opcode::LCGOTO_NEQ_IMM:
+  case Opcode::LCGOTO_NEQ_CONST:
+    return " != ";
+  case Opcode::CGOTO_GT:
+  case Opcode::CGOTO_GT_IMM:
+  case Opcode::LCGOTO_GT_IMM:
+  case Opcode::LCGOTO_GT_CONST:
+    return " > ";
+  default:
+    break;
+  }
+  return " < ";
+}
+
+// The body of the main program or of one function.
+struct Body {
+  // The function's index, or -1 for the main program.
+  int64_t function;
+  size_t localCount;
+  size_t stackDepth;
+  vector<const Instruction *> instructions;
+};
+
+// Writes the statements for instruction, with depth values on the operand
+// stack before it.
+static void writeInstruction(const Program &program, const ProgramInfo &info,
+                             const Instruction &ins, size_t depth,
+                             ostream &output) {
+  const int64_t *operands = ins.operands;
+  string top = depth > 0 ? slot(depth - 1) : "";
+  string second = depth > 1 ? slot(depth - 2) : "";
+  switch (ins.opcode) {
+  case Opcode::IPUSH_CONST:
+    output << "  " << slot(depth)
+           << " = " << literal(program.constants[operands[0]]) << ";\n";
+    break;
+  case Opcode::IPUSH_IMM:
+    output << "  " << slot(depth) << " = " << literal(operands[0]) << ";\n";
+    break;
+  case Opcode::DUP:
+    output << "  " << slot(depth) << " = " << top << ";\n";
+    break;
+  case Opcode::DROP:
+    break;
+  case Opcode::DIV:
+    output << "  if (" << top << " == 0) {\n"
+           << "    return Outcome::DIVIDE_BY_ZERO;\n"
+           << "  }\n";
+    output << "  " << second << " = " << binary(ins.opcode, second, top)
+           << ";\n";
+    break;
+  case Opcode::ADD:
+  case Opcode::SUB:
+  case Opcode::MUL:
+  case Opcode::LSHIFT:
+  case Opcode::RSHIFT:
+  case Opcode::AND:
+  case Opcode::OR:
+  case Opcode::XOR:
+    output << "  " << second << " = " << binary(ins.opcode, second, top)
+           << ";\n";
+    break;
+  case Opcode::IDIV:
+    if (operands[0] == 0) {
+      output << "  return Outcome::DIVIDE_BY_ZERO;\n";
+    } else {
+      output << "  " << top << " = "
+             << binary(ins.opcode, top, literal(operands[0])) << ";\n";
+    }
+    break;
+  case Opcode::IADD:
+  case Opcode::ISUB:
+  case Opcode::IMUL:
+  case Opcode::ILSHIFT:
+  case Opcode::IRSHIFT:
+  case Opcode::IAND:
+  case Opcode::IOR:
+  case Opcode::IXOR:
+    output << "  " << top << " = "
+           << binary(ins.opcode, top, literal(operands[0])) << ";\n";
+    break;
+  case Opcode::LLOAD:
+    output << "  " << slot(depth) << " = " << local(operands[0]) << ";\n";
+    break;
+  case Opcode::LSTORE:
+    output << "  " << local(operands[0]) << " = " << top << ";\n";
+    break;
+  case Opcode::GOTO:
+    output << "  goto " << labelName(operands[0]) << ";\n";
+    break;
+  case Opcode::CGOTO_EQ:
+  case Opcode::CGOTO_NEQ:
+  case Opcode::CGOTO_GT:
+  case Opcode::CGOTO_LT:
+    output << "  if (" << second << comparison(ins.opcode) << top
+           << ") {\n"
+           << "    goto " << labelName(operands[0]) << ";\n"
+           << "  }\n";
+    break;
+  case Opcode::EXIT:
+    output << "  exitValue = " << top << ";\n"
+           << "  return Outcome::FINISHED;\n";
+    break;
+  case Opcode::CALL: {
+    const Function &callee = program.functions[operands[0]];
+    size_t argumentsStart = depth - callee.argumentCount;
+    // The checks CALL makes in run.cpp, against the frames, locals and
+    // operand stack the call would take in the VM.
+    output << "  if (frames == " << MAX_CALL_DEPTH << " || "
+           << callee.localCount << " > " << FRAME_LOCALS_SIZE
+           << " - localsUsed ||\n"
+           << "      " << info.functionStackDepth[operands[0]] << " > "
+           << OPERAND_STACK_SIZE << " - (base + " << depth << ")) {\n"
+           << "    return Outcome::STACK_OVERFLOW;\n"
+           << "  }\n";
+    output << "  if (Outcome outcome = " << functionName(operands[0]) << "(";
+    for (size_t i = argumentsStart; i < depth; i++) {
+      output << slot(i) << ", ";
+    }
+    output << slot(argumentsStart) << ", base + " << argumentsStart
+           << ", frames + 1, localsUsed + " << callee.localCount << ");\n"
+           << "      outcome != Outcome::RETURNED) {\n"
+           << "    return outcome;\n"
+           << "  }\n";
+    break;
+  }
+  case Opcode::RET:
+    output << "  value = " << top << ";\n"
+           << "  return Outcome::RETURNED;\n";
+    break;
+  case Opcode::HLOAD:
+    output << "  if (!inHeap(" << top << ", 1)) {\n"
+           << "    return Outcome::HEAP_OUT_OF_BOUNDS;\n"
+           << "  }\n"
+           << "  " << top << " = heap[" << top << "];\n";
+    break;
+  case Opcode::HSTORE:
+    output << "  if (!inHeap(" << second << ", 1)) {\n"
+           << "    return Outcome::HEAP_OUT_OF_BOUNDS;\n"
+           << "  }\n"
+           << "  heap[" << second << "] = " << top << ";\n";
+    break;
+  case Opcode::VADD:
+  case Opcode::VMUL:
+  case Opcode::VAND:
+  case Opcode::VXOR: {
+    string destination = slot(depth - 4), left = slot(depth - 3),
+           right = slot(depth - 2), count = top;
+    const char *name = ins.opcode == Opcode::VADD   ? "vadd"
+                       : ins.opcode == Opcode::VMUL ? "vmul"
+                       : ins.opcode == Opcode::VAND ? "vand"
+                                                    : "vxor";
+    output << "  if (!inHeap(" << destination << ", " << count
+           << ") || !inHeap(" << left << ", " << count << ") ||\n"
+           << "      !inHeap(" << right << ", " << count << ")) {\n"
+           << "    return Outcome::HEAP_OUT_OF_BOUNDS;\n"
+           << "  }\n"
+           << "  " << name << "(heap + " << destination << ", heap + " << left
+           << ", heap + " << right << ", " << count << ");\n";
+    break;
+  }
+  case Opcode::VSUM:
+  case Opcode::VMIN:
+  case Opcode::VMAX: {
+    const char *name = ins.opcode == Opcode::VSUM   ? "vsum"
+                       : ins.opcode == Opcode::VMIN ? "vmin"
+                                                    : "vmax";
+    output << "  if (!inHeap(" << second << ", " << top << ")) {\n"
+           << "    return Outcome::HEAP_OUT_OF_BOUNDS;\n"
+           << "  }\n"
+           << "  " << second << " = " << name << "(heap + " << second << ", "
+           << top << ");\n";
+    break;
+  }
+  case Opcode::VFILL:
+  case Opcode::VCOPY: {
+    string destination = slot(depth - 3);
+    output << "  if (!inHeap(" << destination << ", " << top << ")";
+    if (ins.opcode == Opcode::VCOPY) {
+      output << " || !inHeap(" << second << ", " << top << ")";
+    }
+    output << ") {\n"
+           << "    return Outcome::HEAP_OUT_OF_BOUNDS;\n"
+           << "  }\n";
+    if (ins.opcode == Opcode::VFILL) {
+      output << "  vfill(heap + " << destination << ", " << second << ", "
+             << top << ");\n";
+    } else {
+      output << "  memmove(heap + " << destination << ", heap + " << second
+             << ", " << top << " * sizeof(int64_t));\n";
+    }
+    break;
+  }
+  case Opcode::VCOUNT_EQ: {
+    string address = slot(depth - 3);
+    output << "  if (!inHeap(" << address << ", " << top << ")) {\n"
+           << "    return Outcome::HEAP_OUT_OF_BOUNDS;\n"
+           << "  }\n"
+           << "  " << address << " = vcountEq(heap + " << address << ", "
+           << second << ", " << top << ");\n";
+    break;
+  }
+  // The assembler never writes superinstructions, but a file may hold them.
+  case Opcode::LINC:
+    output << "  " << local(operands[0]) << " = add(" << local(operands[0])
+           << ", " << literal(operands[1]) << ");\n";
+    break;
+  case Opcode::LADD:
+    output << "  " << local(operands[2]) << " = add(" << local(operands[0])
+           << ", " << local(operands[1]) << ");\n";
+    break;
+  case Opcode::CGOTO_EQ_IMM:
+  case Opcode::CGOTO_NEQ_IMM:
+  case Opcode::CGOTO_GT_IMM:
+  case Opcode::CGOTO_LT_IMM:
+    output << "  if (" << top << comparison(ins.opcode)
+           << literal(operands[0]) << ") {\n"
+           << "    goto " << labelName(operands[1]) << ";\n"
+           << "  }\n";
+    break;
+  case Opcode::LCGOTO_EQ_IMM:
+  case Opcode::LCGOTO_NEQ_IMM:
+  case Opcode::LCGOTO_GT_IMM:
+  case Opcode::LCGOTO_LT_IMM:
+  case Opcode::LCGOTO_EQ_CONST:
+  case Opcode::LCGOTO_NEQ_CONST:
+  case Opcode::LCGOTO_GT_CONST:
+  case Opcode::LCGOTO_LT_CONST: {
+    bool constant = ins.opcode >= Opcode::LCGOTO_EQ_CONST;
+    output << "  if (" << local(operands[0]) << comparison(ins.opcode)
+           << literal(constant ? program.constants[operands[1]] : operands[1])
+           << ") {\n"
+           << "    goto " << labelName(operands[2]) << ";\n"
+           << "  }\n";
+    break;
+  }
+  case Opcode::WIDE:
+    // Decoding leaves the prefix out.
+    break;
+  }
+}
+
+// Writes the signature of a body's C++ function, without a terminator.
+static void writeSignature(const Program &program, const Body &body,
+                           ostream &output) {
+  if (body.function < 0) {
+    output << "static Outcome runMain()";
+    return;
+  }
+  const Function &function = program.functions[body.function];
+  // Where the function's operand stack starts in the VM's, and the frames
+  // and function locals in use, for the checks on calls it makes.
+  output << "static Outcome " << functionName(body.function) << "(";
+  for (size_t i = 0; i < function.argumentCount; i++) {
+    output << "int64_t a" << i << ", ";
+  }
+  output << "int64_t &value, [[maybe_unused]] size_t base,\n"
+         << "    [[maybe_unused]] size_t frames, [[maybe_unused]] size_t "
+            "localsUsed)";
+}
+
+static void writeBody(const Program &program, const ProgramInfo &info,
+                      const Body &body, const vector<bool> &isTarget,
+                      ostream &output) {
+  writeSignature(program, body, output);
+  output << " {\n";
+  if (body.function < 0) {
+    output << "  [[maybe_unused]] const size_t base = 0, frames = 0, "
+              "localsUsed = 0;\n";
+  }
+  size_t argumentCount =
+      body.function < 0 ? 0 : program.functions[body.function].argumentCount;
+  for (size_t i = 0; i < body.localCount; i++) {
+    output << "  [[maybe_unused]] int64_t " << local(i) << " = "
+           << (i < argumentCount ? "a" + to_string(i) : "0") << ";\n";
+  }
+  for (size_t i = 0; i < body.stackDepth; i++) {
+    output << "  [[maybe_unused]] int64_t " << slot(i) << " = 0;\n";
+  }
+  for (const Instruction *instruction : body.instructions) {
+    int32_t depth = info.stackDepth[instruction->offset];
+    if (depth < 0) {
+      continue;
+    }
+    if (isTarget[instruction->offset]) {
+      output << labelName(instruction->offset) << ":\n";
+    }
+    writeInstruction(program, info, *instruction, depth, output);
+  }
+  output << "}\n";
+}
+
+bool translateToCpp(const Program &program, const string &file,
+                    ostream &output) {
+  ProgramInfo info;
+  if (!verifyProgram(program, info)) {
+    return false;
+  }
+  vector<Instruction> instructions;
+  vector<bool> isTarget(program.instructionsSize + 1, false);
+  for (size_t offset = 0; offset < program.instructionsSize;) {
+    Instruction instruction;
+    decodeInstruction(program, offset, instruction);
+    const OpcodeInfo &opcode = opcodeInfo(instruction.opcode);
+    for (size_t i = 0; i < MAX_OPERANDS; i++) {
+      if (opcode.operands[i] == OperandKind::TARGET) {
+        isTarget[instruction.operands[i]] = true;
+      }
+    }
+    instructions.push_back(instruction);
+    offset += instruction.length;
+  }
+
+  // Split the code into the main program and each function.
+  vector<Body> bodies(program.functionCount + 1);
+  bodies[0] = {-1, info.localCount, info.maxStackDepth, {}};
+  for (size_t i = 0; i < program.functionCount; i++) {
+    bodies[i + 1] = {(int64_t)i, program.functions[i].localCount,
+                     info.functionStackDepth[i], {}};
+  }
+  vector<size_t> owner(program.instructionsSize, 0);
+  for (size_t i = 0; i < program.functionCount; i++) {
+    const Function &function = program.functions[i];
+    for (size_t offset = function.start;
+         offset < function.start + function.size; offset++) {
+      owner[offset] = i + 1;
+    }
+  }
+  for (const Instruction &instruction : instructions) {
+    bodies[owner[instruction.offset]].instructions.push_back(&instruction);
+  }
+
+  output << "// Compiled ahead of time from " << file << " by the stack VM.\n"
+         << "// Build it with: c++ -std=c++17 -O3\n";
+  output << PRELUDE;
+  output << "\n#define SOURCE_FILE " << quoted(file) << "\n"
+         << "#define HEAP_SIZE " << program.header->heapSize << "ULL\n";
+  output << HEAP_HELPERS << "\n";
+  for (size_t i = 1; i < bodies.size(); i++) {
+    writeSignature(program, bodies[i], output);
+    output << ";\n";
+  }
+  for (const Body &body : bodies) {
+    output << "\n";
+    writeBody(program, info, body, isTarget, output);
+  }
+  output << MAIN;
+  return true;
+}
+} // namespace bytecode
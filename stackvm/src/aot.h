@@ -0,0 +1,24 @@
+#ifndef _AOT_H
+#define _AOT_H
+
+#include "program.h"
+#include <ostream>
+#include <string>
+
+namespace bytecode {
+// Compiles program ahead of time into a standalone C++ translation unit, to
+// be built with the host compiler (c++ -std=c++17 -O3). Every function,
+// and the main program, becomes a C++ function with a local variable for
+// each local and each operand stack slot and a label for each branch
+// target, so the host compiler's register allocator and vectorizer do the
+// work. The result behaves as run() does: the same wrapping arithmetic,
+// divide by zero, call depth and heap bounds checks, and output. The
+// program prints its result, or with --bench=<runs> <instructions> times
+// runs as "vm --bench" does and prints a line of results for file under the
+// engine name "aot". Reports the problem on cerr and returns false if the
+// program does not verify.
+bool translateToCpp(const Program &program, const std::string &file,
+                    std::ostream &output);
+} // namespace bytecode
+
+#endif
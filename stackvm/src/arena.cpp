@@ -0,0 +1,182 @@
+#include "arena.h"
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef HAVE_GUARD_PAGES
+#include <csetjmp>
+#include <csignal>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace bytecode {
+#ifdef HAVE_GUARD_PAGES
+static size_t pageSize() {
+  static const size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+#else
+static size_t pageSize() { return alignof(std::max_align_t); }
+#endif
+
+static size_t roundUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// Clearing fewer whole pages than this writes zeroes rather than asking the
+// system for fresh pages.
+#define REMAP_THRESHOLD (64 * 1024)
+
+Arena::Arena() : base(nullptr), length(0) {}
+
+Arena::~Arena() {
+#ifdef HAVE_GUARD_PAGES
+  if (base != nullptr) {
+    munmap(base, length);
+  }
+#else
+  std::free(base);
+#endif
+}
+
+void Arena::reserve(ArenaArea *requested, size_t count) {
+  size_t page = pageSize();
+  // Each area ends on a page boundary, so the first byte past it is in its
+  // guard, and the guard is whole pages.
+  length = 0;
+  for (size_t i = 0; i < count; i++) {
+    length += roundUp(requested[i].size, page);
+#ifdef HAVE_GUARD_PAGES
+    length += roundUp(requested[i].guardSize, page);
+#endif
+  }
+#ifdef HAVE_GUARD_PAGES
+  void *mapping = mmap(nullptr, length, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  base = (char *)mapping;
+#else
+  base = (char *)std::calloc(1, length);
+  if (base == nullptr) {
+    throw std::bad_alloc();
+  }
+#endif
+  char *next = base;
+  for (size_t i = 0; i < count; i++) {
+    ArenaArea &area = requested[i];
+    size_t pages = roundUp(area.size, page);
+#ifdef HAVE_GUARD_PAGES
+    if (pages > 0 && mprotect(next, pages, PROT_READ | PROT_WRITE) != 0) {
+      throw std::bad_alloc();
+    }
+#endif
+    area.start = next + pages - area.size;
+    next += pages;
+#ifdef HAVE_GUARD_PAGES
+    next += roundUp(area.guardSize, page);
+#endif
+  }
+}
+
+void Arena::clear(void *start, size_t size) {
+  char *begin = (char *)start;
+  char *end = begin + size;
+#ifdef HAVE_GUARD_PAGES
+  size_t page = pageSize();
+  char *firstPage = base + roundUp(begin - base, page);
+  char *lastPage = base + (end - base) / page * page;
+  if (lastPage > firstPage &&
+      (size_t)(lastPage - firstPage) >= REMAP_THRESHOLD &&
+      mmap(firstPage, lastPage - firstPage, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+           0) != MAP_FAILED) {
+    memset(begin, 0, firstPage - begin);
+    memset(lastPage, 0, end - lastPage);
+    return;
+  }
+#endif
+  memset(begin, 0, end - begin);
+}
+
+#ifdef HAVE_GUARD_PAGES
+// A guarded() call in progress.
+struct GuardedCall {
+  const char *begin;
+  const char *end;
+  sigjmp_buf resume;
+  GuardedCall *outer;
+};
+
+// The innermost guarded() call on this thread.
+static thread_local GuardedCall *innermost = nullptr;
+static struct sigaction previousSegv;
+static struct sigaction previousBus;
+
+static void onFault(int signal, siginfo_t *info, void *context) {
+  GuardedCall *call = innermost;
+  const char *address = (const char *)info->si_addr;
+  // Every page of an arena outside its guards may be read and written, so a
+  // fault anywhere in it is a fault in a guard.
+  if (call != nullptr && address >= call->begin && address < call->end) {
+    siglongjmp(call->resume, 1);
+  }
+  const struct sigaction &previous =
+      signal == SIGBUS ? previousBus : previousSegv;
+  if (previous.sa_flags & SA_SIGINFO) {
+    previous.sa_sigaction(signal, info, context);
+  } else if (previous.sa_handler != SIG_DFL &&
+             previous.sa_handler != SIG_IGN) {
+    previous.sa_handler(signal);
+  } else {
+    // Returning retries the access, which now stops the process as it would
+    // have without this handler.
+    struct sigaction fallback;
+    memset(&fallback, 0, sizeof(fallback));
+    fallback.sa_handler = SIG_DFL;
+    sigemptyset(&fallback.sa_mask);
+    sigaction(signal, &fallback, nullptr);
+  }
+}
+
+static void installFaultHandlers() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = onFault;
+  sigemptyset(&action.sa_mask);
+  // The handler leaves by jumping rather than returning, so the signal must
+  // not stay blocked behind it.
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigaction(SIGSEGV, &action, &previousSegv);
+  sigaction(SIGBUS, &action, &previousBus);
+}
+
+bool Arena::guarded(void (*body)(void *), void *argument) const {
+  static std::once_flag installed;
+  std::call_once(installed, installFaultHandlers);
+  GuardedCall call;
+  call.begin = base;
+  call.end = base + length;
+  call.outer = innermost;
+  // The signal mask is not saved, which would cost a system call on every
+  // call, since the handler never blocks anything.
+  if (sigsetjmp(call.resume, 0) != 0) {
+    innermost = call.outer;
+    return false;
+  }
+  innermost = &call;
+  body(argument);
+  innermost = call.outer;
+  return true;
+}
+#else
+bool Arena::guarded(void (*body)(void *), void *argument) const {
+  body(argument);
+  return true;
+}
+#endif
+} // namespace bytecode
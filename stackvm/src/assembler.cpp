@@ -1,193 +1,422 @@
 #include "assembler.h"
 #include "bytecode.h"
-#include "helper.h"
+#include "optimize.h"
+#include "program.h"
+#include <cctype>
+#include <charconv>
 #include <climits>
 #include <cstdint>
-#include <fstream>
+#include <cstring>
 #include <iostream>
-#include <limits>
-#include <map>
-#include <sstream>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 using std::cerr;
 using std::endl;
-using std::istream;
-using std::map;
-using std::numeric_limits;
 using std::ostream;
-using std::streamsize;
+using std::pair;
 using std::string;
-using std::stringbuf;
+using std::string_view;
+using std::unordered_map;
 using std::vector;
 
 namespace bytecode {
-template <typename T> void pushInstruction(stringbuf &instructions, T value) {
-  instructions.sputn((const char *)&value, sizeof(T));
+static uint32_t alignUp(size_t offset, size_t alignment) {
+  return (uint32_t)((offset + alignment - 1) / alignment * alignment);
 }
-void assemble(istream &input, ostream &output) {
+// Appends size bytes from data to output.
+static void append(vector<uint8_t> &output, const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  output.insert(output.end(), bytes, bytes + size);
+}
+
+// Splits the source into words separated by whitespace, as views into it,
+// counting the lines it passes.
+class Scanner {
+public:
+  explicit Scanner(string_view source)
+      : line(1), next(source.data()), end(source.data() + source.size()) {}
+
+  // The next word, or an empty one at the end of the source. line is then
+  // the word's line.
+  string_view word() {
+    while (next != end && isspace((unsigned char)*next)) {
+      if (*next++ == '\n') {
+        line++;
+      }
+    }
+    const char *start = next;
+    while (next != end && !isspace((unsigned char)*next)) {
+      next++;
+    }
+    return string_view(start, next - start);
+  }
+  // Skips the rest of the line, for a comment.
+  void skipLine() {
+    const char *newline = (const char *)memchr(next, '\n', end - next);
+    next = newline != nullptr ? newline : end;
+  }
+
+  size_t line;
+
+private:
+  const char *next;
+  const char *end;
+};
+
+// Reads a whole number in [min, max] into value. Reports the problem on cerr
+// and returns false if the next word is not one, rather than truncating it.
+static bool readNumber(Scanner &scanner, int64_t min, int64_t max,
+                       int64_t &value) {
+  string_view word = scanner.word();
+  const char *first = word.data();
+  const char *last = first + word.size();
+  // from_chars takes a minus sign but not a plus.
+  if (word.size() > 1 && word[0] == '+' && word[1] != '-') {
+    first++;
+  }
+  auto result = std::from_chars(first, last, value);
+  if (result.ec == std::errc::result_out_of_range) {
+    cerr << word << " on line " << scanner.line << " is out of range" << endl;
+    return false;
+  }
+  if (word.empty() || result.ec != std::errc() || result.ptr != last) {
+    cerr << "Expected a number on line " << scanner.line << endl;
+    return false;
+  }
+  if (value < min || value > max) {
+    cerr << word << " on line " << scanner.line << " is out of range" << endl;
+    return false;
+  }
+  return true;
+}
+static Instruction makeInstruction(Opcode opcode, int64_t operand = 0) {
+  Instruction instruction = {};
+  instruction.opcode = opcode;
+  instruction.operands[0] = operand;
+  return instruction;
+}
+
+// What a word that starts a statement, other than a label or a comment,
+// can be.
+enum class Keyword : uint8_t {
+  // An instruction written as it is encoded
+  PLAIN,
+  IPUSH,
+  FUNCTION,
+  END,
+  HEAP
+};
+
+// The keywords, in a table with a slot for each that is picked by a hash of
+// its name, so looking a word up takes one hash and one comparison. The hash
+// is seeded, and the seed is searched for when the table is built, until no
+// two keywords share a slot.
+class KeywordTable {
+public:
+  KeywordTable() {
+    vector<pair<string_view, Entry>> keywords = {
+        {"ipush", {Keyword::IPUSH, Opcode::IPUSH_IMM}},
+        {"function", {Keyword::FUNCTION, Opcode()}},
+        {"end", {Keyword::END, Opcode()}},
+        {"heap", {Keyword::HEAP, Opcode()}}};
+    // The instructions written as they are encoded are all of them up to
+    // the superinstructions, except the two forms of ipush.
+    for (size_t i = (size_t)Opcode::IPUSH_IMM + 1; i < (size_t)Opcode::LINC;
+         i++) {
+      keywords.push_back(
+          {opcodeInfo((Opcode)i).name, {Keyword::PLAIN, (Opcode)i}});
+    }
+    for (seed = 0;; seed++) {
+      bool collided = false;
+      for (string_view &name : names) {
+        name = string_view();
+      }
+      for (const auto &keyword : keywords) {
+        size_t slot = hash(keyword.first);
+        if (!names[slot].empty()) {
+          collided = true;
+          break;
+        }
+        names[slot] = keyword.first;
+        entries[slot] = keyword.second;
+      }
+      if (!collided) {
+        return;
+      }
+    }
+  }
+
+  // Returns false if word is not a keyword. opcode is the instruction's, and
+  // IPUSH_IMM for ipush.
+  bool find(string_view word, Keyword &keyword, Opcode &opcode) const {
+    size_t slot = hash(word);
+    if (word.empty() || names[slot] != word) {
+      return false;
+    }
+    keyword = entries[slot].keyword;
+    opcode = entries[slot].opcode;
+    return true;
+  }
+
+private:
+  static constexpr size_t SLOT_BITS = 8;
+  struct Entry {
+    Keyword keyword;
+    Opcode opcode;
+  };
+
+  // FNV-1a, with the high bits of a multiplicative hash of it for the slot.
+  size_t hash(string_view word) const {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : word) {
+      hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return (hash * 2654435769u) >> (32 - SLOT_BITS);
+  }
+
+  uint32_t seed;
+  string_view names[1 << SLOT_BITS];
+  Entry entries[1 << SLOT_BITS];
+};
+
+// A use of a label or function by name, to be filled in once every name is
+// known.
+struct Reference {
+  string_view name;
+  // The index in code of the instruction that uses it.
+  size_t index;
+};
+
+bool assemble(string_view source, ostream &output, SourceMap *sourceMap,
+              bool optimize) {
+  static const KeywordTable keywords;
   Header header;
   header.magic = BYTECODE_MAGIC;
   header.version = CURRENT_BYTECODE_VERSION;
+  header.heapSize = 0;
   vector<Constant> constants;
-  stringbuf instructions;
-  map<string, uint16_t> labels;
-  map<string, vector<uint16_t>> labelReferences;
-  while (!input.eof()) {
-    string word;
-    input >> word;
-    if (word == "ipush") {
-      Constant value;
-      input >> value;
-      if (value <= INT16_MAX && value >= INT16_MIN) {
-        pushInstruction(instructions, Opcode::IPUSH_IMM);
-        pushInstruction<int16_t>(instructions, value);
-      } else {
-        if (constants.size() >= 65535) {
-          cerr << "Too many constants in program" << endl;
-          return;
+  // The code is collected as instructions, with labels and functions
+  // resolved to indices in code, and only laid out at the end, once it is
+  // known which operands need the WIDE prefix. Names are views into source.
+  vector<Instruction> code;
+  unordered_map<string_view, size_t> labels;
+  vector<Reference> labelReferences;
+  // Function starts and sizes count instructions until the layout.
+  vector<Function> functions;
+  unordered_map<string_view, size_t> functionIndices;
+  vector<Reference> functionReferences;
+  // The source line of each instruction in code, and the labels by index in
+  // code, kept only for sourceMap.
+  vector<size_t> codeLines;
+  vector<pair<size_t, string_view>> codeLabels;
+  // Whether the code being assembled is inside a function definition.
+  bool inFunction = false;
+  Scanner scanner(source);
+  for (string_view word = scanner.word(); !word.empty();
+       word = scanner.word()) {
+    Keyword keyword;
+    Opcode opcode;
+    if (word[0] == '#') {
+      scanner.skipLine();
+    } else if (word.back() == ':') {
+      string_view label = word.substr(0, word.length() - 1);
+      if (!labels.emplace(label, code.size()).second) {
+        cerr << "Duplicate label " << label << " on line " << scanner.line
+             << endl;
+        return false;
+      }
+      if (sourceMap != nullptr) {
+        codeLabels.push_back({code.size(), label});
+      }
+    } else if (!keywords.find(word, keyword, opcode)) {
+      cerr << "Unknown opcode " << word << endl;
+      return false;
+    } else if (keyword == Keyword::PLAIN || keyword == Keyword::IPUSH) {
+      size_t line = scanner.line;
+      Instruction instruction = makeInstruction(opcode);
+      switch (opcodeInfo(opcode).operands[0]) {
+      case OperandKind::IMMEDIATE:
+        if (keyword == Keyword::IPUSH) {
+          Constant value;
+          if (!readNumber(scanner, INT64_MIN, INT64_MAX, value)) {
+            return false;
+          }
+          if (value <= INT16_MAX && value >= INT16_MIN) {
+            instruction.operands[0] = value;
+          } else {
+            if (constants.size() >= UINT32_MAX) {
+              cerr << "Too many constants in program" << endl;
+              return false;
+            }
+            instruction =
+                makeInstruction(Opcode::IPUSH_CONST, constants.size());
+            constants.push_back(value);
+          }
+        } else if (!readNumber(scanner, INT32_MIN, INT32_MAX,
+                               instruction.operands[0])) {
+          return false;
+        }
+        break;
+      case OperandKind::LOCAL:
+        if (!readNumber(scanner, 0, UINT16_MAX, instruction.operands[0])) {
+          return false;
         }
-        pushInstruction(instructions, Opcode::IPUSH_CONST);
-        pushInstruction<int16_t>(instructions, constants.size());
-        constants.push_back(value);
-      }
-    } else if (word == "dup") {
-      pushInstruction(instructions, Opcode::DUP);
-    } else if (word == "drop") {
-      pushInstruction(instructions, Opcode::DROP);
-    } else if (word == "add") {
-      pushInstruction(instructions, Opcode::ADD);
-    }else if (word == "iadd") {
-      int16_t value;
-      input >> value;
-      pushInstruction(instructions, Opcode::IADD);
-      pushInstruction(instructions, value);
-    } else if (word == "sub") {
-      pushInstruction(instructions, Opcode::SUB);
-    }else if (word == "isub") {
-      int16_t value;
-      input >> value;
-      pushInstruction(instructions, Opcode::ISUB);
-      pushInstruction(instructions, value);
-    } else if (word == "mul") {
-      pushInstruction(instructions, Opcode::MUL);
-    }else if (word == "imul") {
-      int16_t value;
-      input >> value;
-      pushInstruction(instructions, Opcode::IMUL);
-      pushInstruction(instructions, value);
-    } else if (word == "div") {
-      pushInstruction(instructions, Opcode::DIV);
-    }else if (word == "idiv") {
-      int16_t value;
-      input >> value;
-      pushInstruction(instructions, Opcode::IDIV);
-      pushInstruction(instructions, value);
-    }else if (word == "lshift") {
-      pushInstruction(instructions, Opcode::LSHIFT);
-    }else if (word == "ilshift") {
-      int16_t value;
-      input >> value;
-      pushInstruction(instructions, Opcode::ILSHIFT);
-      pushInstruction(instructions, value);
-    }else if (word == "rshift") {
-      pushInstruction(instructions, Opcode::RSHIFT);
-    }else if (word == "irshift") {
-      int16_t value;
-      input >> value;
-      pushInstruction(instructions, Opcode::IRSHIFT);
-      pushInstruction(instructions, value);
-    }else if (word == "and") {
-      pushInstruction(instructions, Opcode::AND);
-    }else if (word == "iand") {
-      int16_t value;
-      input >> value;
-      pushInstruction(instructions, Opcode::IAND);
-      pushInstruction(instructions, value);
-    }else if (word == "or") {
-      pushInstruction(instructions, Opcode::OR);
-    }else if (word == "ior") {
-      int16_t value;
-      input >> value;
-      pushInstruction(instructions, Opcode::IOR);
-      pushInstruction(instructions, value);
-    }else if (word == "xor") {
-      pushInstruction(instructions, Opcode::XOR);
-    }else if (word == "ixor") {
-      int16_t value;
-      input >> value;
-      pushInstruction(instructions, Opcode::IXOR);
-      pushInstruction(instructions, value);
-    } else if (word == "lload") {
-      uint16_t index;
-      input >> index;
-      pushInstruction(instructions, Opcode::LLOAD);
-      pushInstruction(instructions, index);
-    } else if (word == "lstore") {
-      uint16_t index;
-      input >> index;
-      pushInstruction(instructions, Opcode::LSTORE);
-      pushInstruction(instructions, index);
-    } else if (word == "goto") {
-      string label;
-      input >> label;
-      pushInstruction(instructions, Opcode::GOTO);
-      labelReferences[label].push_back(instructions.str().length());
-      pushInstruction<uint16_t>(instructions, 0);
-    } else if (word == "cgoto_eq") {
-      string label;
-      input >> label;
-      pushInstruction(instructions, Opcode::CGOTO_EQ);
-      labelReferences[label].push_back(instructions.str().length());
-      pushInstruction<uint16_t>(instructions, 0);
-    } else if (word == "cgoto_neq") {
-      string label;
-      input >> label;
-      pushInstruction(instructions, Opcode::CGOTO_NEQ);
-      labelReferences[label].push_back(instructions.str().length());
-      pushInstruction<uint16_t>(instructions, 0);
-    } else if (word == "cgoto_gt") {
-      string label;
-      input >> label;
-      pushInstruction(instructions, Opcode::CGOTO_GT);
-      labelReferences[label].push_back(instructions.str().length());
-      pushInstruction<uint16_t>(instructions, 0);
-    } else if (word == "cgoto_lt") {
-      string label;
-      input >> label;
-      pushInstruction(instructions, Opcode::CGOTO_LT);
-      labelReferences[label].push_back(instructions.str().length());
-      pushInstruction<uint16_t>(instructions, 0);
-    } else if (word == "exit") {
-      pushInstruction(instructions, Opcode::EXIT);
-    } else if (startsWith(word, "#")) {
-      input.ignore(numeric_limits<streamsize>::max(), input.widen('\n'));
-    } else if (endsWith(word, ":")) {
-      labels[word.substr(0, word.length() - 1)] = instructions.str().length();
-    } else if (word == "") {
-      continue;
+        break;
+      case OperandKind::TARGET:
+        labelReferences.push_back({scanner.word(), code.size()});
+        break;
+      case OperandKind::FUNCTION:
+        functionReferences.push_back({scanner.word(), code.size()});
+        break;
+      default:
+        break;
+      }
+      code.push_back(instruction);
+      if (sourceMap != nullptr) {
+        codeLines.push_back(line);
+      }
+    } else if (keyword == Keyword::FUNCTION) {
+      // function <name> <arguments> <locals>
+      string_view name = scanner.word();
+      int64_t argumentCount, localCount;
+      if (!readNumber(scanner, 0, UINT16_MAX, argumentCount) ||
+          !readNumber(scanner, 0, UINT16_MAX, localCount)) {
+        return false;
+      }
+      if (inFunction) {
+        cerr << "Function " << name << " is inside another function" << endl;
+        return false;
+      }
+      if (!functionIndices.emplace(name, functions.size()).second) {
+        cerr << "Function " << name << " is defined twice" << endl;
+        return false;
+      }
+      if (argumentCount > localCount) {
+        cerr << "Function " << name << " has more arguments than locals"
+             << endl;
+        return false;
+      }
+      Function function;
+      function.start = code.size();
+      function.size = 0;
+      function.argumentCount = argumentCount;
+      function.localCount = localCount;
+      functions.push_back(function);
+      inFunction = true;
+      if (sourceMap != nullptr) {
+        codeLabels.push_back({code.size(), name});
+      }
+    } else if (keyword == Keyword::END) {
+      if (!inFunction) {
+        cerr << "end outside a function" << endl;
+        return false;
+      }
+      Function &function = functions.back();
+      function.size = code.size() - function.start;
+      inFunction = false;
     } else {
-      cerr << "Unknown opcode " << word << endl;
-      return;
+      // heap <words>
+      int64_t heapSize;
+      if (!readNumber(scanner, 0, MAX_HEAP_SIZE, heapSize)) {
+        return false;
+      }
+      header.heapSize = heapSize;
     }
   }
-  header.constantCount = constants.size();
-  output.write((const char *)&header, sizeof(Header));
-  for (Constant constant : constants) {
-    output.write((const char *)&constant, sizeof(Constant));
-  }
-  string instructionString = instructions.str();
-  for (const auto &label : labelReferences) {
-    uint16_t labelLocation = labels[label.first];
-    uint8_t labelLocationLow = labelLocation & 0xff;
-    uint8_t labelLocationHigh = (uint8_t)(labelLocation >> 8);
-    for (const auto &reference : label.second) {
-      // Little endian - low byte first
-      instructionString[reference] = labelLocationLow;
-      instructionString[reference + 1] = labelLocationHigh;
+  if (inFunction) {
+    cerr << "Function without an end" << endl;
+    return false;
+  }
+  for (const Reference &reference : functionReferences) {
+    auto function = functionIndices.find(reference.name);
+    if (function == functionIndices.end()) {
+      cerr << "Unknown function " << reference.name << endl;
+      return false;
+    }
+    code[reference.index].operands[0] = function->second;
+  }
+  for (const Reference &reference : labelReferences) {
+    auto label = labels.find(reference.name);
+    if (label == labels.end()) {
+      cerr << "Unknown label " << reference.name << endl;
+      return false;
+    }
+    code[reference.index].operands[0] = label->second;
+  }
+  vector<uint8_t> laidOut;
+  vector<size_t> offsets;
+  layOutInstructions(code, laidOut, offsets);
+  if (offsets.back() > UINT32_MAX) {
+    cerr << "The program is too long" << endl;
+    return false;
+  }
+  for (Function &function : functions) {
+    size_t end = offsets[function.start + function.size];
+    function.start = offsets[function.start];
+    function.size = end - function.start;
+  }
+  if (sourceMap != nullptr) {
+    for (size_t i = 0; i < code.size(); i++) {
+      sourceMap->lines[offsets[i]] = codeLines[i];
+    }
+    for (const auto &label : codeLabels) {
+      sourceMap->labels.emplace(offsets[label.first], string(label.second));
+    }
+  }
+  if (optimize) {
+    Header assembled = header;
+    assembled.constantCount = constants.size();
+    Program program{&assembled,       constants.data(), functions.data(),
+                    functions.size(), laidOut.data(),   laidOut.size()};
+    OptimizedCode optimized;
+    if (optimizeProgram(program, constants, optimized)) {
+      laidOut = std::move(optimized.instructions);
+      functions = optimized.functions;
+      if (sourceMap != nullptr) {
+        SourceMap original = *sourceMap;
+        sourceMap->lines.clear();
+        sourceMap->labels.clear();
+        for (const auto &origin : optimized.origins) {
+          auto line = original.lines.find(origin.second);
+          if (line != original.lines.end()) {
+            sourceMap->lines[origin.first] = line->second;
+          }
+          auto label = original.labels.find(origin.second);
+          if (label != original.labels.end()) {
+            sourceMap->labels.emplace(origin.first, label->second);
+          }
+        }
+      }
     }
   }
-  output << instructionString;
+  header.reserved = 0;
+  header.constantsOffset = alignUp(sizeof(Header), CONSTANTS_ALIGNMENT);
+  header.constantCount = constants.size();
+  size_t constantsEnd =
+      header.constantsOffset + constants.size() * sizeof(Constant);
+  header.functionsOffset = alignUp(constantsEnd, FUNCTIONS_ALIGNMENT);
+  header.functionCount = functions.size();
+  size_t functionsEnd =
+      header.functionsOffset + functions.size() * sizeof(Function);
+  header.instructionsOffset = alignUp(functionsEnd, INSTRUCTIONS_ALIGNMENT);
+  header.instructionsSize = laidOut.size();
+  // The file is put together in memory, with zeros for the padding between
+  // sections, and written at once.
+  vector<uint8_t> file;
+  file.reserve(header.instructionsOffset + laidOut.size());
+  append(file, &header, sizeof(Header));
+  file.resize(header.constantsOffset);
+  append(file, constants.data(), constants.size() * sizeof(Constant));
+  file.resize(header.functionsOffset);
+  append(file, functions.data(), functions.size() * sizeof(Function));
+  file.resize(header.instructionsOffset);
+  append(file, laidOut.data(), laidOut.size());
+  output.write((const char *)file.data(), file.size());
+  return true;
 }
 } // namespace bytecode
@@ -1,10 +1,30 @@
 #ifndef _ASSEMBLER_H
 #define _ASSEMBLER_H
 
-#include <fstream>
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
 
 namespace bytecode {
-void assemble(std::istream &input, std::ostream &output);
+// Where each part of the instruction stream came from in the source.
+struct SourceMap {
+  // The 1-based source line of the instruction at each offset.
+  std::map<size_t, size_t> lines;
+  // The label defined at each offset (the first, if there are several).
+  std::map<size_t, std::string> labels;
+};
+
+// Assembles source and writes the bytecode file to output, in time linear in
+// the length of source: words are read in place, keywords are looked up in
+// a perfect hash table, and labels are filled in with one pass at the end.
+// Unless optimize is false, the code is run through optimizeProgram first, so
+// it may not be exactly what was written. If sourceMap is given, it is filled
+// in as well, for the code as written out. Returns false, having said why,
+// if source is not a valid program, in which case nothing is written.
+bool assemble(std::string_view source, std::ostream &output,
+              SourceMap *sourceMap = nullptr, bool optimize = true);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include "stackvm.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+using std::atomic;
+using std::vector;
+
+namespace bytecode {
+// The jobs a worker has yet to run: the indices [begin, end) packed into one
+// word, so the owner and thieves can both update it with a single
+// compare-and-swap. The owner takes jobs from the front one at a time, and a
+// thief takes the back half, so jobs that are next to each other in the input
+// tend to run on the same thread.
+struct alignas(64) WorkRange {
+  atomic<uint64_t> range;
+
+  static uint64_t pack(uint32_t begin, uint32_t end) {
+    return (uint64_t)end << 32 | begin;
+  }
+  static uint32_t begin(uint64_t range) { return (uint32_t)range; }
+  static uint32_t end(uint64_t range) { return (uint32_t)(range >> 32); }
+
+  // Takes the next job. Returns false if there are none left.
+  bool take(uint32_t &job) {
+    uint64_t current = range.load(std::memory_order_relaxed);
+    while (begin(current) < end(current)) {
+      uint64_t next = pack(begin(current) + 1, end(current));
+      if (range.compare_exchange_weak(current, next,
+                                      std::memory_order_acq_rel)) {
+        job = begin(current);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Takes the back half of the remaining jobs, rounded up, into
+  // [stolenBegin, stolenEnd). Returns false if there are none left.
+  bool steal(uint32_t &stolenBegin, uint32_t &stolenEnd) {
+    uint64_t current = range.load(std::memory_order_relaxed);
+    while (begin(current) < end(current)) {
+      uint32_t middle =
+          begin(current) + (end(current) - begin(current)) / 2;
+      if (range.compare_exchange_weak(current, pack(begin(current), middle),
+                                      std::memory_order_acq_rel)) {
+        stolenBegin = middle;
+        stolenEnd = end(current);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+static void runJob(Vm &vm, const vector<int64_t> &input,
+                   BatchResult &result) {
+  vm.reset();
+  size_t count = std::min(input.size(), vm.localCount());
+  std::copy(input.begin(), input.begin() + count, vm.locals());
+  result.status = vm.run();
+  result.result = vm.result();
+}
+
+static void work(const Module &module, const vector<vector<int64_t>> &inputs,
+                 vector<WorkRange> &ranges, size_t self,
+                 vector<BatchResult> &results) {
+  Vm vm(module);
+  WorkRange &own = ranges[self];
+  while (true) {
+    uint32_t job;
+    while (own.take(job)) {
+      runJob(vm, inputs[job], results[job]);
+    }
+    // Out of work: steal from the other workers, starting with the next one
+    // so that thieves spread out over their victims. Stolen jobs go into our
+    // own range, where other thieves can steal them back.
+    bool stole = false;
+    for (size_t i = 1; i < ranges.size() && !stole; i++) {
+      uint32_t stolenBegin, stolenEnd;
+      if (ranges[(self + i) % ranges.size()].steal(stolenBegin, stolenEnd)) {
+        own.range.store(WorkRange::pack(stolenBegin, stolenEnd),
+                        std::memory_order_release);
+        stole = true;
+      }
+    }
+    if (!stole) {
+      // Jobs are never added, so once every range is empty we are done.
+      return;
+    }
+  }
+}
+
+vector<BatchResult> runBatch(const Module &module,
+                             const vector<vector<int64_t>> &inputs,
+                             unsigned threadCount) {
+  if (threadCount == 0) {
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+  size_t workerCount = std::min<size_t>(threadCount, inputs.size());
+  vector<BatchResult> results(inputs.size());
+  if (workerCount == 0) {
+    return results;
+  }
+  // Start every worker with an equal share of the inputs, in order.
+  vector<WorkRange> ranges(workerCount);
+  for (size_t i = 0; i < workerCount; i++) {
+    uint32_t begin = (uint32_t)(inputs.size() * i / workerCount);
+    uint32_t end = (uint32_t)(inputs.size() * (i + 1) / workerCount);
+    ranges[i].range.store(WorkRange::pack(begin, end));
+  }
+  vector<std::thread> threads;
+  for (size_t i = 1; i < workerCount; i++) {
+    threads.emplace_back(work, std::cref(module), std::cref(inputs),
+                         std::ref(ranges), i, std::ref(results));
+  }
+  work(module, inputs, ranges, 0, results);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return results;
+}
+} // namespace bytecode
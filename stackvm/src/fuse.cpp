@@ -0,0 +1,194 @@
+#include "fuse.h"
+#include "bytecode.h"
+#include "program.h"
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iostream>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::initializer_list;
+using std::vector;
+
+namespace bytecode {
+// The unfused CGOTO_* family, which compares the top two stack values.
+static bool isStackCompareBranch(Opcode opcode) {
+  return opcode == Opcode::CGOTO_EQ || opcode == Opcode::CGOTO_NEQ ||
+         opcode == Opcode::CGOTO_GT || opcode == Opcode::CGOTO_LT;
+}
+// Maps a CGOTO_* opcode to the matching opcode in a family of fused branches
+// which are declared in the order EQ, NEQ, GT, LT.
+static Opcode fusedBranch(Opcode branch, Opcode familyStart) {
+  return (Opcode)((int)familyStart + (int)branch - (int)Opcode::CGOTO_EQ);
+}
+
+// Tries to fuse the instructions starting at code[start]. None of the
+// instructions after the first may be a branch target, since the fused
+// instruction can only be entered at the start. Returns the number of
+// instructions replaced, or 0 if no pattern matched.
+static size_t fuse(const vector<Instruction> &code, size_t start,
+                   const vector<bool> &isTarget, Instruction &fused) {
+  auto matches = [&](initializer_list<Opcode> pattern) {
+    if (start + pattern.size() > code.size()) {
+      return false;
+    }
+    size_t i = start;
+    for (Opcode opcode : pattern) {
+      if (code[i].opcode != opcode || (i != start && isTarget[i])) {
+        return false;
+      }
+      i++;
+    }
+    return true;
+  };
+  const Instruction *first = &code[start];
+  fused = *first;
+  // lload a; lload b; add; lstore c
+  if (matches({Opcode::LLOAD, Opcode::LLOAD, Opcode::ADD, Opcode::LSTORE})) {
+    fused.opcode = Opcode::LADD;
+    fused.operands[0] = first[0].operands[0];
+    fused.operands[1] = first[1].operands[0];
+    fused.operands[2] = first[3].operands[0];
+    return 4;
+  }
+  // lload n; iadd k; lstore n
+  if ((matches({Opcode::LLOAD, Opcode::IADD, Opcode::LSTORE}) ||
+       matches({Opcode::LLOAD, Opcode::ISUB, Opcode::LSTORE})) &&
+      first[0].operands[0] == first[2].operands[0]) {
+    int64_t increment = first[1].operands[0];
+    if (first[1].opcode == Opcode::ISUB) {
+      if (increment == INT32_MIN) {
+        return 0;
+      }
+      increment = -increment;
+    }
+    fused.opcode = Opcode::LINC;
+    fused.operands[0] = first[0].operands[0];
+    fused.operands[1] = increment;
+    return 3;
+  }
+  // lload n; ipush k; cgoto_* label
+  if (start + 2 < code.size() && isStackCompareBranch(first[2].opcode) &&
+      (matches({Opcode::LLOAD, Opcode::IPUSH_IMM, first[2].opcode}) ||
+       matches({Opcode::LLOAD, Opcode::IPUSH_CONST, first[2].opcode}))) {
+    fused.opcode = fusedBranch(first[2].opcode,
+                               first[1].opcode == Opcode::IPUSH_IMM
+                                   ? Opcode::LCGOTO_EQ_IMM
+                                   : Opcode::LCGOTO_EQ_CONST);
+    fused.operands[0] = first[0].operands[0];
+    fused.operands[1] = first[1].operands[0];
+    fused.operands[2] = first[2].operands[0];
+    return 3;
+  }
+  // ipush k; cgoto_* label
+  if (start + 1 < code.size() && isStackCompareBranch(first[1].opcode) &&
+      matches({Opcode::IPUSH_IMM, first[1].opcode})) {
+    fused.opcode = fusedBranch(first[1].opcode, Opcode::CGOTO_EQ_IMM);
+    fused.operands[0] = first[0].operands[0];
+    fused.operands[1] = first[1].operands[0];
+    return 2;
+  }
+  return 0;
+}
+
+bool fuseSuperinstructions(Program &program, vector<uint8_t> &instructions,
+                           vector<Function> &functions,
+                           vector<size_t> *origins) {
+  vector<Instruction> code;
+  size_t offset = 0;
+  while (offset < program.instructionsSize) {
+    Instruction instruction;
+    if (!decodeInstruction(program, offset, instruction)) {
+      cerr << "Invalid instruction at offset " << offset << endl;
+      return false;
+    }
+    code.push_back(instruction);
+    offset += instruction.length;
+  }
+  // Old offset to the index of the instruction starting there.
+  vector<int64_t> indexAt(program.instructionsSize + 1, -1);
+  for (size_t i = 0; i < code.size(); i++) {
+    indexAt[code[i].offset] = i;
+  }
+  indexAt[program.instructionsSize] = code.size();
+  vector<bool> isTarget(code.size() + 1, false);
+  for (const Instruction &instruction : code) {
+    const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+    for (size_t i = 0; i < MAX_OPERANDS; i++) {
+      if (info.operands[i] == OperandKind::TARGET) {
+        int64_t target = instruction.operands[i];
+        if ((size_t)target > program.instructionsSize ||
+            indexAt[target] < 0) {
+          cerr << "Invalid branch target at offset " << instruction.offset
+               << endl;
+          return false;
+        }
+        isTarget[indexAt[target]] = true;
+      }
+    }
+  }
+  // Both edges of a function are entered from elsewhere, as far as fusion
+  // is concerned.
+  for (size_t i = 0; i < program.functionCount; i++) {
+    const Function &function = program.functions[i];
+    for (size_t edge : {(size_t)function.start,
+                        (size_t)function.start + function.size}) {
+      if (edge > program.instructionsSize || indexAt[edge] < 0) {
+        cerr << "Function " << i << " does not start and end on instructions"
+             << endl;
+        return false;
+      }
+      isTarget[indexAt[edge]] = true;
+    }
+  }
+
+  vector<Instruction> fusedCode;
+  // Old index to new index, for every instruction that can be branched to.
+  vector<size_t> newIndex(code.size() + 1, 0);
+  if (origins != nullptr) {
+    origins->clear();
+  }
+  for (size_t i = 0; i < code.size();) {
+    Instruction instruction;
+    size_t replaced = fuse(code, i, isTarget, instruction);
+    if (replaced == 0) {
+      instruction = code[i];
+      replaced = 1;
+    }
+    newIndex[i] = fusedCode.size();
+    fusedCode.push_back(instruction);
+    if (origins != nullptr) {
+      origins->push_back(code[i].offset);
+    }
+    i += replaced;
+  }
+  newIndex[code.size()] = fusedCode.size();
+  if (origins != nullptr) {
+    origins->push_back(program.instructionsSize);
+  }
+
+  for (Instruction &instruction : fusedCode) {
+    const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+    for (size_t i = 0; i < MAX_OPERANDS; i++) {
+      if (info.operands[i] == OperandKind::TARGET) {
+        instruction.operands[i] = newIndex[indexAt[instruction.operands[i]]];
+      }
+    }
+  }
+  vector<size_t> offsets;
+  layOutInstructions(fusedCode, instructions, offsets);
+  functions.assign(program.functions,
+                   program.functions + program.functionCount);
+  for (Function &function : functions) {
+    size_t end = offsets[newIndex[indexAt[function.start + function.size]]];
+    function.start = offsets[newIndex[indexAt[function.start]]];
+    function.size = end - function.start;
+  }
+  program.instructions = instructions.data();
+  program.instructionsSize = instructions.size();
+  program.functions = functions.data();
+  return true;
+}
+} // namespace bytecode
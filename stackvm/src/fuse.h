@@ -0,0 +1,22 @@
+#ifndef _FUSE_H
+#define _FUSE_H
+
+#include "program.h"
+#include <cstdint>
+#include <vector>
+
+namespace bytecode {
+// Rewrites common instruction sequences in program into superinstructions.
+// The new instruction stream is written to instructions and the function
+// table, moved to match it, to functions, and program is updated to refer to
+// them. No superinstruction spans the edge of a function. If origins is
+// given, it is filled with the old offset of the first instruction each new
+// one was made from, in order, then the old size of the stream. Returns
+// false, after reporting the problem on cerr, if the instruction stream is
+// malformed.
+bool fuseSuperinstructions(Program &program, std::vector<uint8_t> &instructions,
+                           std::vector<Function> &functions,
+                           std::vector<size_t> *origins = nullptr);
+} // namespace bytecode
+
+#endif
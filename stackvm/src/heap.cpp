@@ -0,0 +1,184 @@
+#include "heap.h"
+#include "bytecode.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_SIMD_KERNELS)
+#define HAVE_SIMD_KERNELS
+#include <immintrin.h>
+#endif
+
+using std::string;
+
+namespace bytecode {
+// The scalar kernels compute in uint64_t, which wraps around on overflow as
+// the machine does.
+static void addScalar(Constant *destination, const Constant *left,
+                      const Constant *right, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    destination[i] = (Constant)((uint64_t)left[i] + (uint64_t)right[i]);
+  }
+}
+static void multiplyScalar(Constant *destination, const Constant *left,
+                           const Constant *right, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    destination[i] = (Constant)((uint64_t)left[i] * (uint64_t)right[i]);
+  }
+}
+static void bitwiseAndScalar(Constant *destination, const Constant *left,
+                             const Constant *right, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    destination[i] = left[i] & right[i];
+  }
+}
+static void bitwiseXorScalar(Constant *destination, const Constant *left,
+                             const Constant *right, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    destination[i] = left[i] ^ right[i];
+  }
+}
+static Constant sumScalar(const Constant *words, size_t count) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < count; i++) {
+    sum += words[i];
+  }
+  return (Constant)sum;
+}
+static Constant minimumScalar(const Constant *words, size_t count) {
+  Constant minimum = INT64_MAX;
+  for (size_t i = 0; i < count; i++) {
+    minimum = words[i] < minimum ? words[i] : minimum;
+  }
+  return minimum;
+}
+static Constant maximumScalar(const Constant *words, size_t count) {
+  Constant maximum = INT64_MIN;
+  for (size_t i = 0; i < count; i++) {
+    maximum = words[i] > maximum ? words[i] : maximum;
+  }
+  return maximum;
+}
+static void fillScalar(Constant *destination, Constant value, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    destination[i] = value;
+  }
+}
+static size_t countEqualScalar(const Constant *words, Constant value,
+                               size_t count) {
+  size_t equal = 0;
+  for (size_t i = 0; i < count; i++) {
+    equal += words[i] == value;
+  }
+  return equal;
+}
+
+static const HeapKernels scalarKernels = {
+    "scalar",         addScalar,        multiplyScalar,
+    bitwiseAndScalar, bitwiseXorScalar, sumScalar,
+    minimumScalar,    maximumScalar,    fillScalar,
+    countEqualScalar};
+
+#ifdef HAVE_SIMD_KERNELS
+// Whether destination starts inside source, past its first word, where
+// working a vector at a time would read words before the scalar order has
+// written them.
+static inline bool overlapsAhead(const Constant *destination,
+                                 const Constant *source, size_t count) {
+  return destination > source && destination < source + count;
+}
+
+// The vector kernels share their loops, written once for each register
+// width with the operations as macros. The tail that does not fill a whole
+// register is left to the scalar kernels.
+
+// AVX2. There is no 64 bit multiply, minimum or maximum below AVX-512, so
+// multiply is built from 32 bit halves and the others from compares.
+#define VECTOR __m256i
+#define WIDTH 4
+#define TARGET_ISA __attribute__((target("avx2")))
+#define LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define STORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define SPLAT(x) _mm256_set1_epi64x(x)
+#define ADD(a, b) _mm256_add_epi64(a, b)
+#define SUB(a, b) _mm256_sub_epi64(a, b)
+#define AND(a, b) _mm256_and_si256(a, b)
+#define XOR(a, b) _mm256_xor_si256(a, b)
+#define GREATER(a, b) _mm256_cmpgt_epi64(a, b)
+#define EQUAL(a, b) _mm256_cmpeq_epi64(a, b)
+#define BLEND(a, b, mask) _mm256_blendv_epi8(a, b, mask)
+#define MULTIPLY_32(a, b) _mm256_mul_epu32(a, b)
+#define SHIFT_RIGHT(a, n) _mm256_srli_epi64(a, n)
+#define SHIFT_LEFT(a, n) _mm256_slli_epi64(a, n)
+#define SUFFIX Avx2
+#include "heapkernels.inc"
+
+// SSE4.2, for the 64 bit compare.
+#define VECTOR __m128i
+#define WIDTH 2
+#define TARGET_ISA __attribute__((target("sse4.2")))
+#define LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define STORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define SPLAT(x) _mm_set1_epi64x(x)
+#define ADD(a, b) _mm_add_epi64(a, b)
+#define SUB(a, b) _mm_sub_epi64(a, b)
+#define AND(a, b) _mm_and_si128(a, b)
+#define XOR(a, b) _mm_xor_si128(a, b)
+#define GREATER(a, b) _mm_cmpgt_epi64(a, b)
+#define EQUAL(a, b) _mm_cmpeq_epi64(a, b)
+#define BLEND(a, b, mask) _mm_blendv_epi8(a, b, mask)
+#define MULTIPLY_32(a, b) _mm_mul_epu32(a, b)
+#define SHIFT_RIGHT(a, n) _mm_srli_epi64(a, n)
+#define SHIFT_LEFT(a, n) _mm_slli_epi64(a, n)
+#define SUFFIX Sse42
+#include "heapkernels.inc"
+
+static const HeapKernels avx2Kernels = {
+    "avx2",         addAvx2,        multiplyAvx2, bitwiseAndAvx2,
+    bitwiseXorAvx2, sumAvx2,        minimumAvx2,  maximumAvx2,
+    fillAvx2,       countEqualAvx2};
+static const HeapKernels sse42Kernels = {
+    "sse4.2",        addSse42,        multiplySse42, bitwiseAndSse42,
+    bitwiseXorSse42, sumSse42,        minimumSse42,  maximumSse42,
+    fillSse42,       countEqualSse42};
+#endif
+
+// The kernels called name, if this build and CPU can run them.
+static const HeapKernels *findKernels(const string &name) {
+#ifdef HAVE_SIMD_KERNELS
+  __builtin_cpu_init();
+  if (name == "avx2" && __builtin_cpu_supports("avx2")) {
+    return &avx2Kernels;
+  }
+  if (name == "sse4.2" && __builtin_cpu_supports("sse4.2")) {
+    return &sse42Kernels;
+  }
+#endif
+  if (name == "scalar") {
+    return &scalarKernels;
+  }
+  return nullptr;
+}
+
+static const HeapKernels *bestKernels() {
+  for (const char *name : {"avx2", "sse4.2"}) {
+    if (const HeapKernels *kernels = findKernels(name)) {
+      return kernels;
+    }
+  }
+  return &scalarKernels;
+}
+
+static const HeapKernels *selectedKernels = bestKernels();
+
+const HeapKernels &heapKernels() { return *selectedKernels; }
+
+bool selectHeapKernels(const string &name) {
+  const HeapKernels *kernels = findKernels(name);
+  if (kernels == nullptr) {
+    return false;
+  }
+  selectedKernels = kernels;
+  return true;
+}
+} // namespace bytecode
@@ -0,0 +1,47 @@
+#ifndef _HEAP_H
+#define _HEAP_H
+
+#include "bytecode.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace bytecode {
+// The loops behind the heap instructions, over count words each. The
+// element-wise kernels work through the words in order, so a destination
+// that overlaps a source ahead of it sees the words already written.
+struct HeapKernels {
+  const char *name;
+  // destination[i] = left[i] op right[i]
+  void (*add)(Constant *destination, const Constant *left,
+              const Constant *right, size_t count);
+  void (*multiply)(Constant *destination, const Constant *left,
+                   const Constant *right, size_t count);
+  void (*bitwiseAnd)(Constant *destination, const Constant *left,
+                     const Constant *right, size_t count);
+  void (*bitwiseXor)(Constant *destination, const Constant *left,
+                     const Constant *right, size_t count);
+  // Wraps around on overflow.
+  Constant (*sum)(const Constant *words, size_t count);
+  // INT64_MAX and INT64_MIN for no words.
+  Constant (*minimum)(const Constant *words, size_t count);
+  Constant (*maximum)(const Constant *words, size_t count);
+  void (*fill)(Constant *destination, Constant value, size_t count);
+  size_t (*countEqual)(const Constant *words, Constant value, size_t count);
+};
+
+// The kernels in use: the AVX2 or SSE4.2 ones if the CPU has them and the
+// build includes them (x86-64 with GCC or Clang, unless built with SIMD=0),
+// and the scalar ones otherwise.
+const HeapKernels &heapKernels();
+// Uses the kernels called name ("avx2", "sse4.2" or "scalar") from now on.
+// Returns false, changing nothing, if this build or CPU cannot run them.
+bool selectHeapKernels(const std::string &name);
+
+// Whether the count words from address lie inside a heap of size words.
+static inline bool inHeap(Constant address, Constant count, size_t size) {
+  return (uint64_t)address <= size && (uint64_t)count <= size - address;
+}
+} // namespace bytecode
+
+#endif
@@ -0,0 +1,501 @@
+#include "jit.h"
+#include "bytecode.h"
+#include "program.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define HAVE_JIT
+#include <sys/mman.h>
+#endif
+
+using std::cerr;
+using std::endl;
+using std::initializer_list;
+using std::vector;
+
+namespace bytecode {
+#ifdef HAVE_JIT
+// Register use in compiled code:
+//   rbx - one past the top of the operand stack
+//   rbp - the JitState
+//   rsp - the locals, local n at [rsp + 8 * n]
+//   rax, rcx, rdx - scratch
+enum Reg : uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+
+struct Mem {
+  Reg base;
+  int32_t displacement;
+};
+// Operand stack slot, counting down from the top: stackSlot(1) is the top.
+static Mem stackSlot(int32_t depth) { return {RBX, -8 * depth}; }
+static Mem localSlot(int64_t index) { return {RSP, (int32_t)(8 * index)}; }
+static Mem stateField(size_t offset) { return {RBP, (int32_t)offset}; }
+
+static bool fitsInt32(int64_t value) {
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// ALU operations that have a "op r/m64, r64" form with the given opcode and a
+// "op r/m64, imm32" form (opcode 0x81) with the given extension.
+struct AluOp {
+  uint8_t registerOpcode;
+  uint8_t immediateExtension;
+};
+static const AluOp ALU_ADD = {0x01, 0};
+static const AluOp ALU_OR = {0x09, 1};
+static const AluOp ALU_AND = {0x21, 4};
+static const AluOp ALU_SUB = {0x29, 5};
+static const AluOp ALU_XOR = {0x31, 6};
+static const AluOp ALU_CMP = {0x39, 7};
+
+// Condition codes for Jcc.
+enum Condition : uint8_t {
+  EQUAL = 0x4,
+  NOT_EQUAL = 0x5,
+  LESS = 0xc,
+  GREATER = 0xf
+};
+
+struct CodeBuffer {
+  vector<uint8_t> code;
+
+  void bytes(initializer_list<uint8_t> values) {
+    code.insert(code.end(), values);
+  }
+  void imm32(int32_t value) {
+    const uint8_t *valueBytes = (const uint8_t *)&value;
+    code.insert(code.end(), valueBytes, valueBytes + sizeof(value));
+  }
+  void imm64(int64_t value) {
+    const uint8_t *valueBytes = (const uint8_t *)&value;
+    code.insert(code.end(), valueBytes, valueBytes + sizeof(value));
+  }
+  void modrm(uint8_t reg, Mem mem) {
+    if (mem.base == RSP) {
+      bytes({(uint8_t)(0x84 | reg << 3), 0x24});
+      imm32(mem.displacement);
+    } else if (mem.displacement >= INT8_MIN && mem.displacement <= INT8_MAX) {
+      bytes({(uint8_t)(0x40 | reg << 3 | mem.base),
+             (uint8_t)mem.displacement});
+    } else {
+      bytes({(uint8_t)(0x80 | reg << 3 | mem.base)});
+      imm32(mem.displacement);
+    }
+  }
+  // Emits REX.W, the opcode bytes and a ModRM for reg and mem.
+  void memoryOp(initializer_list<uint8_t> opcode, uint8_t reg, Mem mem) {
+    bytes({0x48});
+    bytes(opcode);
+    modrm(reg, mem);
+  }
+
+  void load(Reg reg, Mem mem) { memoryOp({0x8b}, reg, mem); }
+  void store(Mem mem, Reg reg) { memoryOp({0x89}, reg, mem); }
+  void alu(AluOp op, Mem mem, Reg reg) {
+    memoryOp({op.registerOpcode}, reg, mem);
+  }
+  void aluImmediate(AluOp op, Mem mem, int32_t value) {
+    memoryOp({0x81}, op.immediateExtension, mem);
+    imm32(value);
+  }
+  void moveImmediate(Reg reg, int64_t value) {
+    bytes({0x48, (uint8_t)(0xb8 + reg)});
+    imm64(value);
+  }
+  // Moves a 64 bit immediate into memory, through rax if it does not fit in
+  // a sign-extended 32 bit immediate.
+  void storeImmediate(Mem mem, int64_t value) {
+    if (fitsInt32(value)) {
+      memoryOp({0xc7}, 0, mem);
+      imm32(value);
+    } else {
+      moveImmediate(RAX, value);
+      store(mem, RAX);
+    }
+  }
+  void adjustStack(int8_t slots) {
+    if (slots > 0) {
+      bytes({0x48, 0x83, 0xc3, (uint8_t)(8 * slots)}); // add rbx, 8 * slots
+    } else if (slots < 0) {
+      bytes({0x48, 0x83, 0xeb, (uint8_t)(-8 * slots)}); // sub rbx, 8 * -slots
+    }
+  }
+  // Emits a jump with a 32 bit displacement and returns the position of the
+  // displacement, to be filled in by patch().
+  size_t jump() {
+    bytes({0xe9});
+    imm32(0);
+    return code.size() - 4;
+  }
+  size_t jumpIf(Condition condition) {
+    bytes({0x0f, (uint8_t)(0x80 | condition)});
+    imm32(0);
+    return code.size() - 4;
+  }
+  void patch(size_t position, size_t target) {
+    int32_t displacement = (int32_t)(target - (position + 4));
+    memcpy(code.data() + position, &displacement, sizeof(displacement));
+  }
+};
+
+static Condition branchCondition(Opcode opcode) {
+  switch (opcode) {
+  case Opcode::CGOTO_EQ:
+  case Opcode::CGOTO_EQ_IMM:
+  case Opcode::LCGOTO_EQ_IMM:
+  case Opcode::LCGOTO_EQ_CONST:
+    return EQUAL;
+  case Opcode::CGOTO_NEQ:
+  case Opcode::CGOTO_NEQ_IMM:
+  case Opcode::LCGOTO_NEQ_IMM:
+  case Opcode::LCGOTO_NEQ_CONST:
+    return NOT_EQUAL;
+  case Opcode::CGOTO_GT:
+  case Opcode::CGOTO_GT_IMM:
+  case Opcode::LCGOTO_GT_IMM:
+  case Opcode::LCGOTO_GT_CONST:
+    return GREATER;
+  default:
+    return LESS;
+  }
+}
+
+// Jumps that still need their displacement filled in.
+struct Fixup {
+  size_t position;
+  // Index of the target instruction; the end of the program is one past the
+  // last instruction.
+  size_t target;
+};
+
+bool jitAvailable() { return true; }
+
+bool jitCompile(const Program &program, JitCode &jitCode) {
+  vector<Instruction> instructions;
+  vector<int64_t> indexAt(program.instructionsSize + 1, -1);
+  size_t offset = 0;
+  size_t localCount = 0;
+  while (offset < program.instructionsSize) {
+    Instruction instruction;
+    if (!decodeInstruction(program, offset, instruction)) {
+      cerr << "Invalid instruction at offset " << offset << endl;
+      return false;
+    }
+    const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+    for (size_t i = 0; i < MAX_OPERANDS; i++) {
+      if (info.operands[i] == OperandKind::CONSTANT &&
+          instruction.operands[i] >= program.header->constantCount) {
+        cerr << "Constant index out of range at offset " << offset << endl;
+        return false;
+      }
+      if (info.operands[i] == OperandKind::LOCAL &&
+          (size_t)instruction.operands[i] >= localCount) {
+        localCount = instruction.operands[i] + 1;
+      }
+    }
+    indexAt[offset] = instructions.size();
+    instructions.push_back(instruction);
+    offset += instruction.length;
+  }
+  indexAt[program.instructionsSize] = instructions.size();
+
+  // Keep rsp 16 byte aligned: it is 8 off on entry, and the two pushes in the
+  // prologue leave it that way.
+  size_t frameSize = localCount * 8;
+  if (frameSize % 16 == 0) {
+    frameSize += 8;
+  }
+
+  CodeBuffer code;
+  vector<size_t> instructionStart(instructions.size() + 1);
+  vector<Fixup> fixups;
+  vector<size_t> divideByZeroJumps;
+  auto branchTo = [&](size_t position, int64_t targetOffset) {
+    if ((size_t)targetOffset > program.instructionsSize ||
+        indexAt[targetOffset] < 0) {
+      return false;
+    }
+    fixups.push_back({position, (size_t)indexAt[targetOffset]});
+    return true;
+  };
+  auto returnStatus = [&](JitStatus status) {
+    code.bytes({0xb8}); // mov eax, status
+    code.imm32((int32_t)status);
+    return code.jump();
+  };
+  vector<size_t> epilogueJumps;
+
+  // Prologue
+  code.bytes({0x53, 0x55});             // push rbx; push rbp
+  code.bytes({0x48, 0x89, 0xfd});       // mov rbp, rdi
+  code.bytes({0x48, 0x81, 0xec});       // sub rsp, frameSize
+  code.imm32(frameSize);
+  code.load(RBX, stateField(offsetof(JitState, stackTop)));
+  code.load(RSI, stateField(offsetof(JitState, locals)));
+  code.bytes({0x48, 0x89, 0xe7});       // mov rdi, rsp
+  code.bytes({0xb9});                   // mov ecx, localCount
+  code.imm32(localCount);
+  code.bytes({0xf3, 0x48, 0xa5});       // rep movsq
+
+  for (size_t i = 0; i < instructions.size(); i++) {
+    const Instruction &instruction = instructions[i];
+    const int64_t *operands = instruction.operands;
+    instructionStart[i] = code.code.size();
+    bool validTargets = true;
+    switch (instruction.opcode) {
+    case Opcode::IPUSH_CONST:
+      code.storeImmediate(stackSlot(0), program.constants[operands[0]]);
+      code.adjustStack(1);
+      break;
+    case Opcode::IPUSH_IMM:
+      code.storeImmediate(stackSlot(0), operands[0]);
+      code.adjustStack(1);
+      break;
+    case Opcode::DUP:
+      code.load(RAX, stackSlot(1));
+      code.store(stackSlot(0), RAX);
+      code.adjustStack(1);
+      break;
+    case Opcode::DROP:
+      code.adjustStack(-1);
+      break;
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::AND:
+    case Opcode::OR:
+    case Opcode::XOR: {
+      AluOp op = instruction.opcode == Opcode::ADD   ? ALU_ADD
+                 : instruction.opcode == Opcode::SUB ? ALU_SUB
+                 : instruction.opcode == Opcode::AND ? ALU_AND
+                 : instruction.opcode == Opcode::OR  ? ALU_OR
+                                                     : ALU_XOR;
+      code.load(RAX, stackSlot(1));
+      code.adjustStack(-1);
+      code.alu(op, stackSlot(1), RAX);
+      break;
+    }
+    case Opcode::IADD:
+    case Opcode::ISUB:
+    case Opcode::IAND:
+    case Opcode::IOR:
+    case Opcode::IXOR: {
+      AluOp op = instruction.opcode == Opcode::IADD   ? ALU_ADD
+                 : instruction.opcode == Opcode::ISUB ? ALU_SUB
+                 : instruction.opcode == Opcode::IAND ? ALU_AND
+                 : instruction.opcode == Opcode::IOR  ? ALU_OR
+                                                      : ALU_XOR;
+      code.aluImmediate(op, stackSlot(1), operands[0]);
+      break;
+    }
+    case Opcode::MUL:
+      code.load(RAX, stackSlot(1));
+      code.adjustStack(-1);
+      code.memoryOp({0x0f, 0xaf}, RAX, stackSlot(1)); // imul rax, left
+      code.store(stackSlot(1), RAX);
+      break;
+    case Opcode::IMUL:
+      code.memoryOp({0x69}, RAX, stackSlot(1)); // imul rax, left, imm32
+      code.imm32(operands[0]);
+      code.store(stackSlot(1), RAX);
+      break;
+    case Opcode::DIV:
+      code.load(RCX, stackSlot(1));
+      code.adjustStack(-1);
+      code.bytes({0x48, 0x85, 0xc9}); // test rcx, rcx
+      divideByZeroJumps.push_back(code.jumpIf(EQUAL));
+      code.load(RAX, stackSlot(1));
+      code.bytes({0x48, 0x99, 0x48, 0xf7, 0xf9}); // cqo; idiv rcx
+      code.store(stackSlot(1), RAX);
+      break;
+    case Opcode::IDIV:
+      if (operands[0] == 0) {
+        divideByZeroJumps.push_back(code.jump());
+        break;
+      }
+      code.load(RAX, stackSlot(1));
+      code.moveImmediate(RCX, operands[0]);
+      code.bytes({0x48, 0x99, 0x48, 0xf7, 0xf9}); // cqo; idiv rcx
+      code.store(stackSlot(1), RAX);
+      break;
+    case Opcode::LSHIFT:
+    case Opcode::RSHIFT:
+      code.load(RCX, stackSlot(1));
+      code.adjustStack(-1);
+      // shl/sar qword [left], cl
+      code.memoryOp({0xd3}, instruction.opcode == Opcode::LSHIFT ? 4 : 7,
+                    stackSlot(1));
+      break;
+    case Opcode::ILSHIFT:
+    case Opcode::IRSHIFT:
+      // shl/sar qword [left], imm8. The interpreter's shifts also use the
+      // low six bits of the count.
+      code.memoryOp({0xc1}, instruction.opcode == Opcode::ILSHIFT ? 4 : 7,
+                    stackSlot(1));
+      code.bytes({(uint8_t)(operands[0] & 63)});
+      break;
+    case Opcode::LLOAD:
+      code.load(RAX, localSlot(operands[0]));
+      code.store(stackSlot(0), RAX);
+      code.adjustStack(1);
+      break;
+    case Opcode::LSTORE:
+      code.load(RAX, stackSlot(1));
+      code.adjustStack(-1);
+      code.store(localSlot(operands[0]), RAX);
+      break;
+    case Opcode::GOTO:
+      validTargets = branchTo(code.jump(), operands[0]);
+      break;
+    case Opcode::CGOTO_EQ:
+    case Opcode::CGOTO_NEQ:
+    case Opcode::CGOTO_GT:
+    case Opcode::CGOTO_LT:
+      code.load(RAX, stackSlot(1));
+      code.load(RCX, stackSlot(2));
+      code.adjustStack(-2);
+      code.bytes({0x48, 0x39, 0xc1}); // cmp rcx, rax
+      validTargets = branchTo(
+          code.jumpIf(branchCondition(instruction.opcode)), operands[0]);
+      break;
+    case Opcode::EXIT:
+      code.load(RAX, stackSlot(1));
+      code.adjustStack(-1);
+      code.store(stateField(offsetof(JitState, result)), RAX);
+      epilogueJumps.push_back(returnStatus(JitStatus::EXIT));
+      break;
+    case Opcode::CALL:
+    case Opcode::RET:
+      // Compiled code keeps the locals in its own stack frame, which has no
+      // room for those of the functions it calls.
+      cerr << "Cannot compile the call at offset " << instruction.offset
+           << endl;
+      return false;
+    case Opcode::HLOAD:
+    case Opcode::HSTORE:
+    case Opcode::VADD:
+    case Opcode::VMUL:
+    case Opcode::VAND:
+    case Opcode::VXOR:
+    case Opcode::VSUM:
+    case Opcode::VMIN:
+    case Opcode::VMAX:
+    case Opcode::VFILL:
+    case Opcode::VCOPY:
+    case Opcode::VCOUNT_EQ:
+      // Nor is the heap within reach of compiled code.
+      cerr << "Cannot compile the heap instruction at offset "
+           << instruction.offset << endl;
+      return false;
+    case Opcode::LINC:
+      code.aluImmediate(ALU_ADD, localSlot(operands[0]), operands[1]);
+      break;
+    case Opcode::LADD:
+      code.load(RAX, localSlot(operands[0]));
+      code.memoryOp({0x03}, RAX, localSlot(operands[1])); // add rax, right
+      code.store(localSlot(operands[2]), RAX);
+      break;
+    case Opcode::CGOTO_EQ_IMM:
+    case Opcode::CGOTO_NEQ_IMM:
+    case Opcode::CGOTO_GT_IMM:
+    case Opcode::CGOTO_LT_IMM:
+      code.adjustStack(-1);
+      code.aluImmediate(ALU_CMP, stackSlot(0), operands[0]);
+      validTargets = branchTo(
+          code.jumpIf(branchCondition(instruction.opcode)), operands[1]);
+      break;
+    case Opcode::LCGOTO_EQ_IMM:
+    case Opcode::LCGOTO_NEQ_IMM:
+    case Opcode::LCGOTO_GT_IMM:
+    case Opcode::LCGOTO_LT_IMM:
+      code.aluImmediate(ALU_CMP, localSlot(operands[0]), operands[1]);
+      validTargets = branchTo(
+          code.jumpIf(branchCondition(instruction.opcode)), operands[2]);
+      break;
+    case Opcode::LCGOTO_EQ_CONST:
+    case Opcode::LCGOTO_NEQ_CONST:
+    case Opcode::LCGOTO_GT_CONST:
+    case Opcode::LCGOTO_LT_CONST:
+      code.moveImmediate(RAX, program.constants[operands[1]]);
+      code.alu(ALU_CMP, localSlot(operands[0]), RAX);
+      validTargets = branchTo(
+          code.jumpIf(branchCondition(instruction.opcode)), operands[2]);
+      break;
+    case Opcode::WIDE:
+      // Decoding leaves the prefix out.
+      break;
+    }
+    if (!validTargets) {
+      cerr << "Invalid branch target at offset " << instruction.offset
+           << endl;
+      return false;
+    }
+  }
+  // Falling off the end of the program
+  instructionStart[instructions.size()] = code.code.size();
+  epilogueJumps.push_back(returnStatus(JitStatus::END_OF_PROGRAM));
+  size_t divideByZero = code.code.size();
+  epilogueJumps.push_back(returnStatus(JitStatus::DIVIDE_BY_ZERO));
+
+  // Epilogue, with the status in eax
+  size_t epilogue = code.code.size();
+  code.store(stateField(offsetof(JitState, stackTop)), RBX);
+  code.bytes({0x89, 0xc2});             // mov edx, eax
+  code.load(RDI, stateField(offsetof(JitState, locals)));
+  code.bytes({0x48, 0x89, 0xe6});       // mov rsi, rsp
+  code.bytes({0xb9});                   // mov ecx, localCount
+  code.imm32(localCount);
+  code.bytes({0xf3, 0x48, 0xa5});       // rep movsq
+  code.bytes({0x89, 0xd0});             // mov eax, edx
+  code.bytes({0x48, 0x81, 0xc4});       // add rsp, frameSize
+  code.imm32(frameSize);
+  code.bytes({0x5d, 0x5b, 0xc3});       // pop rbp; pop rbx; ret
+
+  for (const Fixup &fixup : fixups) {
+    code.patch(fixup.position, instructionStart[fixup.target]);
+  }
+  for (size_t position : divideByZeroJumps) {
+    code.patch(position, divideByZero);
+  }
+  for (size_t position : epilogueJumps) {
+    code.patch(position, epilogue);
+  }
+
+  size_t size = code.code.size();
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    cerr << "Could not allocate memory for compiled code" << endl;
+    return false;
+  }
+  memcpy(memory, code.code.data(), size);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    cerr << "Could not make compiled code executable" << endl;
+    munmap(memory, size);
+    return false;
+  }
+  jitCode.memory = memory;
+  jitCode.size = size;
+  jitCode.entry = (JitFunction)memory;
+  return true;
+}
+
+void jitRelease(JitCode &code) {
+  munmap(code.memory, code.size);
+  code.memory = nullptr;
+}
+#else
+bool jitAvailable() { return false; }
+
+bool jitCompile(const Program &, JitCode &) {
+  cerr << "This build cannot compile to native code" << endl;
+  return false;
+}
+
+void jitRelease(JitCode &) {}
+#endif
+} // namespace bytecode
@@ -0,0 +1,41 @@
+#ifndef _JIT_H
+#define _JIT_H
+
+#include "bytecode.h"
+#include "program.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace bytecode {
+// State shared between the interpreter and compiled code.
+struct JitState {
+  // One past the top of the operand stack. Updated when the code returns.
+  Constant *stackTop;
+  // The locals, which the code copies into its own stack frame on entry and
+  // back out when it returns.
+  Constant *locals;
+  // The value passed to EXIT.
+  Constant result;
+};
+
+enum class JitStatus : uint32_t { EXIT, DIVIDE_BY_ZERO, END_OF_PROGRAM };
+
+typedef JitStatus (*JitFunction)(JitState *state);
+
+// Native x86-64 code for a whole program, in its own executable mapping.
+struct JitCode {
+  void *memory;
+  size_t size;
+  JitFunction entry;
+};
+
+// Whether this build can compile to native code.
+bool jitAvailable();
+
+// Compiles program to native code. Reports the problem on cerr and returns
+// false if the program is malformed or cannot be compiled.
+bool jitCompile(const Program &program, JitCode &code);
+void jitRelease(JitCode &code);
+} // namespace bytecode
+
+#endif
@@ -1,48 +1,453 @@
+#include "aot.h"
 #include "assembler.h"
+#include "heap.h"
 #include "helper.h"
+#include "mappedfile.h"
+#include "program.h"
 #include "run.h"
+#include "translate.h"
+#include <algorithm>
+#include <charconv>
 #include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
 
 using std::cerr;
 using std::cout;
 using std::endl;
-using std::ifstream;
 using std::ios;
 using std::ofstream;
 using std::string;
+using std::string_view;
+using std::vector;
 using std::chrono::duration_cast;
 using std::chrono::high_resolution_clock;
 using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
 
 static void usage(char *filePath) {
-  cout << "Usage: " << filePath << " <file>" << endl;
+  cout << "Usage: " << filePath << " [options] <file>" << endl;
   cout << endl;
   cout << "Arguments:" << endl;
   cout << "<file> the file to use. If the file ends in \".vasm\", it is "
           "assembled, otherwise it is run."
        << endl;
+  cout << endl;
+  cout << "Options:" << endl;
+  cout << "--dispatch=switch|threaded how to dispatch instructions. Defaults "
+          "to threaded where the compiler supports it."
+       << endl;
+  cout << "--no-predecode run the bytecode as it is stored rather than "
+          "translating it first."
+       << endl;
+  cout << "--no-tier translate the program before running it, rather than "
+          "once it has run for a while."
+       << endl;
+  cout << "--no-fuse do not combine common instruction sequences into "
+          "superinstructions."
+       << endl;
+  cout << "--cache-top keep the top of the operand stack in a register rather "
+          "than in memory."
+       << endl;
+  cout << "--jit compile the program to native x86-64 code and run that."
+       << endl;
+  cout << "--kernels=avx2|sse4.2|scalar which loops to run the heap "
+          "instructions with. Defaults to the fastest the CPU supports."
+       << endl;
+  cout << "--no-optimize assemble the program exactly as written, without "
+          "optimizing it."
+       << endl;
+  cout << "--translate write the program as register VM assembly to "
+          "<file>.ras instead of running it."
+       << endl;
+  cout << "--aot write the program as a standalone C++ program to "
+          "<file>.cpp instead of running it, to be compiled with "
+          "\"c++ -std=c++17 -O3\"."
+       << endl;
+  cout << "--batch=<count> run the program <count> times, with local 0 set to "
+          "the number of the run, and print every result."
+       << endl;
+  cout << "--threads=<count> how many threads --batch uses. Defaults to one "
+          "per core."
+       << endl;
+  cout << "--fuel=<count> stop the program, or each run of --batch, after "
+          "<count> branches taken, calls and returns."
+       << endl;
+  cout << "--slice=<count> with --batch, run every run at once, taking turns "
+          "of <count> branches taken, calls and returns on the threads, "
+          "rather than each to the end."
+       << endl;
+  cout << "--save=<image> when the program runs out of fuel, save its state "
+          "to <image>."
+       << endl;
+  cout << "--resume=<image> continue the program from the state saved in "
+          "<image> rather than from the start."
+       << endl;
+  cout << "--bench=<runs> time <runs> runs of the program, after one to warm "
+          "up, and print a tab-separated line of results."
+       << endl;
+  cout << "--profile count what the program does, as stored and ignoring the "
+          "other options, and write a report to <file>.profile. Needs a "
+          "build made with PROFILE=1."
+       << endl;
+}
+
+// Reads the whole number after the = of option into count. Says why and
+// returns false if there is none, or if it is not from min to max.
+static bool parseCount(const string &option, uint64_t min, uint64_t max,
+                       uint64_t &count) {
+  const char *first = option.c_str() + option.find('=') + 1;
+  const char *last = option.c_str() + option.length();
+  auto result = std::from_chars(first, last, count);
+  if (result.ec == std::errc::result_out_of_range ||
+      (result.ec == std::errc() && count > max)) {
+    cerr << option << " is out of range" << endl;
+    return false;
+  }
+  if (first == last || result.ec != std::errc() || result.ptr != last ||
+      count < min) {
+    cerr << "Expected a whole number of at least " << min << " in " << option
+         << endl;
+    return false;
+  }
+  return true;
+}
+
+// A short name for the engine that options select, for benchmark results.
+// compiled says whether a module loaded with jit was compiled; one that was
+// refused is named for the interpreter that ran it instead.
+static string engineName(const bytecode::RunOptions &options,
+                         bool compiled) {
+  if (options.jit && compiled) {
+    return "jit";
+  }
+  string name = options.dispatch == bytecode::Dispatch::THREADED ? "threaded"
+                                                                 : "switch";
+  if (options.predecode) {
+    name += options.tiered ? "+predecode+tiered" : "+predecode";
+  }
+  if (options.fuse) {
+    name += "+fuse";
+  }
+  if (options.cacheTop) {
+    name += "+cache-top";
+  }
+  if (options.metered) {
+    name += "+metered";
+  }
+  if (options.jit) {
+    name += "+jit-refused";
+  }
+  return name;
+}
+
+// Times runCount runs of the program on one Vm and prints the file, the
+// engine, the number of runs, the instructions each run executes (as stored,
+// before fusion), the mean, standard deviation and minimum time of a run in
+// nanoseconds, the mean time per instruction in nanoseconds and the
+// instructions per second, separated by tabs.
+static bool benchmark(const string &file, const void *bytes, size_t size,
+                      const bytecode::RunOptions &options, size_t runCount) {
+  uint64_t instructions;
+  if (!bytecode::countInstructions(bytes, size, instructions)) {
+    return false;
+  }
+  std::unique_ptr<bytecode::Module> module(new bytecode::Module());
+  if (!module->load(bytes, size, options)) {
+    return false;
+  }
+  bool compiled = module->compiled();
+  // A tiered module is loaded afresh for every run, so that each run pays
+  // for its own warmup and translation rather than finding the program
+  // translated by the run before.
+  bool reload = options.predecode && options.tiered && !compiled;
+  // Reloads skip a compiler that has already refused the program.
+  bytecode::RunOptions reloadOptions = options;
+  reloadOptions.jit = compiled;
+  std::unique_ptr<bytecode::Vm> vm(new bytecode::Vm(*module));
+  vector<double> times;
+  // The first run warms up the caches and branch predictors, and is not
+  // counted.
+  for (size_t run = 0; run <= runCount; run++) {
+    if (reload && run > 0) {
+      vm = nullptr;
+      module.reset(new bytecode::Module());
+      if (!module->load(bytes, size, reloadOptions)) {
+        return false;
+      }
+      vm.reset(new bytecode::Vm(*module));
+    }
+    vm->reset();
+    auto startTime = steady_clock::now();
+    bytecode::Status status = vm->run();
+    auto timeTaken = steady_clock::now() - startTime;
+    if (status != bytecode::Status::FINISHED) {
+      cerr << bytecode::statusMessage(status) << endl;
+      return false;
+    }
+    if (run > 0) {
+      times.push_back(duration_cast<nanoseconds>(timeTaken).count());
+    }
+  }
+  double mean = 0;
+  for (double time : times) {
+    mean += time;
+  }
+  mean /= times.size();
+  double variance = 0;
+  for (double time : times) {
+    variance += (time - mean) * (time - mean);
+  }
+  if (times.size() > 1) {
+    variance /= times.size() - 1;
+  }
+  double fastest = *std::min_element(times.begin(), times.end());
+  cout << std::fixed << std::setprecision(0) << file << '\t'
+       << engineName(options, compiled) << '\t' << runCount << '\t'
+       << instructions << '\t' << mean << '\t' << std::sqrt(variance) << '\t'
+       << fastest << '\t' << std::setprecision(3) << mean / instructions << '\t'
+       << std::setprecision(0) << instructions / (mean / 1e9) << endl;
+  return true;
+}
+
+// Runs every job at once on a scheduler, in turns of sliceFuel, each with
+// fuel in all, and collects the results in order.
+static vector<bytecode::BatchResult>
+runScheduled(const bytecode::Module &module, size_t jobCount,
+             unsigned threadCount, uint64_t sliceFuel, uint64_t fuel) {
+  vector<std::unique_ptr<bytecode::Vm>> vms;
+  vector<bytecode::BatchResult> results(jobCount);
+  bytecode::Scheduler scheduler(threadCount, sliceFuel);
+  for (size_t i = 0; i < jobCount; i++) {
+    vms.emplace_back(new bytecode::Vm(module));
+    bytecode::Vm &vm = *vms.back();
+    vm.locals()[0] = (int64_t)i;
+    bytecode::BatchResult &result = results[i];
+    scheduler.submit(vm, fuel, [&vm, &result](bytecode::Status status) {
+      result.status = status;
+      result.result = vm.result();
+    });
+  }
+  scheduler.wait();
+  return results;
+}
+
+// Runs the program once per job on every core and prints the results in
+// order. With sliceFuel or fuel, the runs go through a scheduler.
+static bool runBatch(const void *bytes, size_t size,
+                     const bytecode::RunOptions &options, size_t jobCount,
+                     unsigned threadCount, uint64_t sliceFuel,
+                     uint64_t fuel) {
+  bytecode::Module module;
+  if (!module.load(bytes, size, options)) {
+    return false;
+  }
+  vector<bytecode::BatchResult> results;
+  if (options.metered) {
+    results = runScheduled(module, jobCount, threadCount,
+                           sliceFuel > 0 ? sliceFuel : fuel, fuel);
+  } else {
+    vector<vector<int64_t>> inputs(jobCount);
+    for (size_t i = 0; i < jobCount; i++) {
+      inputs[i].push_back((int64_t)i);
+    }
+    results = bytecode::runBatch(module, inputs, threadCount);
+  }
+  for (const bytecode::BatchResult &result : results) {
+    if (result.status == bytecode::Status::FINISHED) {
+      cout << "Finished with " << result.result << endl;
+    } else {
+      cout << bytecode::statusMessage(result.status) << endl;
+    }
+  }
+  return true;
 }
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
+  bytecode::RunOptions options = bytecode::defaultRunOptions();
+  bool translate = false;
+  bool aot = false;
+  bool optimize = true;
+  size_t batchSize = 0;
+  unsigned threadCount = 0;
+  uint64_t fuel = UINT64_MAX;
+  uint64_t sliceFuel = 0;
+  string saveTo;
+  string resumeFrom;
+  size_t benchRuns = 0;
+#ifdef PROFILE
+  bool profile = false;
+#endif
+  int argIndex = 1;
+  for (; argIndex < argc && startsWith(argv[argIndex], "--"); argIndex++) {
+    string option(argv[argIndex]);
+    uint64_t count;
+    if (option == "--dispatch=switch") {
+      options.dispatch = bytecode::Dispatch::SWITCH;
+    } else if (option == "--dispatch=threaded") {
+      if (!bytecode::threadedDispatchAvailable()) {
+        cerr << "This build does not support threaded dispatch" << endl;
+        return -1;
+      }
+      options.dispatch = bytecode::Dispatch::THREADED;
+    } else if (option == "--no-predecode") {
+      options.predecode = false;
+    } else if (option == "--no-tier") {
+      options.tiered = false;
+    } else if (option == "--no-fuse") {
+      options.fuse = false;
+    } else if (option == "--cache-top") {
+      options.cacheTop = true;
+    } else if (option == "--jit") {
+      if (!bytecode::jitAvailable()) {
+        cerr << "This build cannot compile to native code" << endl;
+        return -1;
+      }
+      options.jit = true;
+    } else if (startsWith(option, "--kernels=")) {
+      if (!bytecode::selectHeapKernels(option.substr(10))) {
+        cerr << "This build or CPU cannot run the " << option.substr(10)
+             << " kernels" << endl;
+        return -1;
+      }
+    } else if (option == "--translate") {
+      translate = true;
+    } else if (option == "--aot") {
+      aot = true;
+    } else if (option == "--no-optimize") {
+      optimize = false;
+    } else if (startsWith(option, "--batch=")) {
+      if (!parseCount(option, 1, SIZE_MAX, count)) {
+        return -1;
+      }
+      batchSize = count;
+    } else if (startsWith(option, "--threads=")) {
+      if (!parseCount(option, 1, UINT_MAX, count)) {
+        return -1;
+      }
+      threadCount = count;
+    } else if (startsWith(option, "--fuel=")) {
+      if (!parseCount(option, 0, UINT64_MAX, fuel)) {
+        return -1;
+      }
+      options.metered = true;
+    } else if (startsWith(option, "--slice=")) {
+      if (!parseCount(option, 1, UINT64_MAX, sliceFuel)) {
+        return -1;
+      }
+      options.metered = true;
+    } else if (startsWith(option, "--save=")) {
+      saveTo = option.substr(7);
+    } else if (startsWith(option, "--resume=")) {
+      resumeFrom = option.substr(9);
+    } else if (startsWith(option, "--bench=")) {
+      if (!parseCount(option, 1, SIZE_MAX, count)) {
+        return -1;
+      }
+      benchRuns = count;
+    } else if (option == "--profile") {
+#ifdef PROFILE
+      profile = true;
+#else
+      cerr << "This build cannot profile programs. Build it with PROFILE=1"
+           << endl;
+      return -1;
+#endif
+    } else {
+      cerr << "Unknown option " << option << endl;
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (argIndex >= argc) {
     usage(argv[0]);
     return -1;
   }
-  string file(argv[1]);
+  string file(argv[argIndex]);
   if (endsWith(file, ".vasm")) {
-    ifstream input(file);
-    ofstream output(file + ".bin", ios::binary);
-    bytecode::assemble(input, output);
+    bytecode::MappedFile input;
+    if (!input.open(file)) {
+      return -1;
+    }
+    // Assembled in memory, so a program with errors leaves the file it
+    // would have replaced as it was.
+    std::ostringstream output;
+    if (!bytecode::assemble(
+            string_view((const char *)input.data(), input.size()), output,
+            nullptr, optimize)) {
+      return -1;
+    }
+    ofstream(file + ".bin", ios::binary) << output.str();
   } else {
-    ifstream input(file, ios::binary);
-    size_t fileSize = getFileSize(input);
-    char *fileBytes = new char[fileSize];
-    input.read(fileBytes, fileSize);
+    bytecode::MappedFile input;
+    if (!input.open(file)) {
+      return -1;
+    }
+    const void *fileBytes = input.data();
+    size_t fileSize = input.size();
+    if (translate) {
+      bytecode::Program program;
+      if (!bytecode::loadProgram(fileBytes, fileSize, program)) {
+        return -1;
+      }
+      // Translated in memory, so a program that cannot be translated leaves
+      // no file behind for the register VM to take for an empty program.
+      std::ostringstream output;
+      if (!bytecode::translateToRegisterVm(program, output)) {
+        return -1;
+      }
+      ofstream(file + ".ras") << output.str();
+      return 0;
+    }
+    if (aot) {
+      bytecode::Program program;
+      if (!bytecode::loadProgram(fileBytes, fileSize, program)) {
+        return -1;
+      }
+      std::ostringstream output;
+      if (!bytecode::translateToCpp(program, file, output)) {
+        return -1;
+      }
+      ofstream(file + ".cpp") << output.str();
+      return 0;
+    }
+    if (benchRuns > 0) {
+      return benchmark(file, fileBytes, fileSize, options, benchRuns) ? 0 : -1;
+    }
+#ifdef PROFILE
+    if (profile) {
+      // Programs assembled from foo.vasm are stored in foo.vasm.bin.
+      string source = endsWith(file, ".vasm.bin")
+                          ? file.substr(0, file.length() - 4)
+                          : string();
+      ofstream report(file + ".profile");
+      if (!bytecode::runProfiled(fileBytes, fileSize, source, report)) {
+        return -1;
+      }
+      cout << "Wrote the profile to " << file << ".profile" << endl;
+      return 0;
+    }
+#endif
     auto startTime = high_resolution_clock::now();
-    bytecode::run(fileBytes, fileSize);
+    if (batchSize > 0) {
+      if (!runBatch(fileBytes, fileSize, options, batchSize, threadCount,
+                    sliceFuel, fuel)) {
+        return -1;
+      }
+    } else {
+      bytecode::run(fileBytes, fileSize, options, fuel, saveTo, resumeFrom);
+    }
     auto timeTaken = high_resolution_clock::now() - startTime;
     cout << "It took " << duration_cast<milliseconds>(timeTaken).count() / 1000.0
          << " seconds" << endl;
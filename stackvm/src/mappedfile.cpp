@@ -0,0 +1,75 @@
+#include "mappedfile.h"
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using std::cerr;
+using std::endl;
+using std::ifstream;
+using std::ios;
+using std::string;
+
+namespace bytecode {
+MappedFile::MappedFile() : bytes(nullptr), length(0), mapped(false) {}
+
+MappedFile::~MappedFile() {
+#ifdef HAVE_MMAP
+  if (mapped) {
+    munmap((void *)bytes, length);
+  }
+#endif
+}
+
+bool MappedFile::open(const string &path) {
+#ifdef HAVE_MMAP
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open " << path << ": " << strerror(errno) << endl;
+    return false;
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    cerr << "Could not read " << path << ": " << strerror(errno) << endl;
+    close(fd);
+    return false;
+  }
+  length = status.st_size;
+  // Nothing can be mapped for an empty file, and the loader will reject it
+  // anyway.
+  if (length > 0) {
+    void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      bytes = mapping;
+      mapped = true;
+      close(fd);
+      return true;
+    }
+  }
+  close(fd);
+#endif
+  // Where the file cannot be mapped, read it into an aligned buffer instead.
+  ifstream input(path, ios::binary);
+  if (!input) {
+    cerr << "Could not open " << path << endl;
+    return false;
+  }
+  input.seekg(0, ios::end);
+  length = input.tellg();
+  input.seekg(0, ios::beg);
+  buffer.resize((length + sizeof(Block) - 1) / sizeof(Block));
+  input.read((char *)buffer.data(), length);
+  bytes = buffer.data();
+  return true;
+}
+} // namespace bytecode
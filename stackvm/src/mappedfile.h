@@ -0,0 +1,37 @@
+#ifndef _MAPPEDFILE_H
+#define _MAPPEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bytecode {
+// A whole file, read-only, at a page-aligned address. Where the platform
+// allows, the file is mapped rather than read, so its pages are shared with
+// the page cache and with every other process that maps it.
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // Reports the problem on cerr and returns false if the file cannot be read.
+  bool open(const std::string &path);
+  const void *data() const { return bytes; }
+  size_t size() const { return length; }
+
+private:
+  const void *bytes;
+  size_t length;
+  bool mapped;
+  // The file's contents, where it could not be mapped.
+  struct alignas(16) Block {
+    uint8_t bytes[16];
+  };
+  std::vector<Block> buffer;
+};
+} // namespace bytecode
+
+#endif
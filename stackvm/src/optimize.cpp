@@ -0,0 +1,1377 @@
+#include "optimize.h"
+#include "bytecode.h"
+#include "program.h"
+#include "verify.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <utility>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::map;
+using std::pair;
+using std::vector;
+
+namespace bytecode {
+// The owner of code outside every function.
+#define MAIN_PROGRAM -1
+// The successor of a block that ends in EXIT or RET.
+#define NO_BLOCK SIZE_MAX
+// Rounds of the passes to run before giving up on reaching a fixed point.
+#define MAX_ROUNDS 16
+
+// A basic block. TARGET operands in its code are block indices rather than
+// offsets, and a GOTO that ended it is folded into next, so blocks can be
+// moved and linked without fixing up their code. writeCode puts GOTOs back
+// where the layout needs them.
+struct Block {
+  vector<Instruction> code;
+  // Where control goes after the code when a branch at its end is not
+  // taken, or NO_BLOCK if the code ends in EXIT or RET.
+  size_t next;
+  int32_t owner;
+  // Offset of the original instruction the block stands for, for the
+  // source map.
+  size_t origin;
+  // Cleared when the block can no longer be reached.
+  bool live;
+};
+
+struct Graph {
+  vector<Block> blocks;
+  // The order blocks are written out in. The main program's entry comes
+  // first, and each function's blocks are together, entry first.
+  vector<size_t> layout;
+  size_t mainEntry;
+  vector<size_t> functionEntries;
+  vector<Function> functions;
+  vector<Constant> *constants;
+};
+
+// Each binary operation from ADD to XOR is followed by its immediate form.
+static bool isBinary(Opcode opcode) {
+  return opcode >= Opcode::ADD && opcode <= Opcode::IXOR &&
+         ((int)opcode - (int)Opcode::ADD) % 2 == 0;
+}
+static bool isImmediateOperation(Opcode opcode) {
+  return opcode >= Opcode::ADD && opcode <= Opcode::IXOR &&
+         ((int)opcode - (int)Opcode::ADD) % 2 == 1;
+}
+static Opcode immediateForm(Opcode binary) {
+  return (Opcode)((int)binary + 1);
+}
+static Opcode binaryForm(Opcode immediate) {
+  return (Opcode)((int)immediate - 1);
+}
+static bool isCommutative(Opcode binary) {
+  return binary == Opcode::ADD || binary == Opcode::MUL ||
+         binary == Opcode::AND || binary == Opcode::OR ||
+         binary == Opcode::XOR;
+}
+// The unfused CGOTO_* family, which compares the top two stack values.
+static bool isStackCompareBranch(Opcode opcode) {
+  return opcode == Opcode::CGOTO_EQ || opcode == Opcode::CGOTO_NEQ ||
+         opcode == Opcode::CGOTO_GT || opcode == Opcode::CGOTO_LT;
+}
+static bool fitsImmediate(Constant value) {
+  return value >= INT16_MIN && value <= INT16_MAX;
+}
+static bool isPowerOfTwo(Constant value) {
+  return value > 1 && (value & (value - 1)) == 0;
+}
+static int64_t exponentOf(Constant powerOfTwo) {
+  int64_t result = 0;
+  while (powerOfTwo > 1) {
+    powerOfTwo >>= 1;
+    result++;
+  }
+  return result;
+}
+
+// Computes left op right as the engines would, for a binary operation.
+// Returns false if the result is undefined or the operation traps, which is
+// then left to happen at run time.
+static bool fold(Opcode binary, Constant left, Constant right,
+                 Constant &result) {
+  // Wrap around on overflow, as the machine does.
+  uint64_t l = left;
+  uint64_t r = right;
+  switch (binary) {
+  case Opcode::ADD:
+    result = (Constant)(l + r);
+    return true;
+  case Opcode::SUB:
+    result = (Constant)(l - r);
+    return true;
+  case Opcode::MUL:
+    result = (Constant)(l * r);
+    return true;
+  case Opcode::DIV:
+    if (right == 0 || (left == INT64_MIN && right == -1)) {
+      return false;
+    }
+    result = left / right;
+    return true;
+  case Opcode::LSHIFT:
+    if (right < 0 || right >= 64) {
+      return false;
+    }
+    result = (Constant)(l << right);
+    return true;
+  case Opcode::RSHIFT:
+    if (right < 0 || right >= 64) {
+      return false;
+    }
+    result = left >> right;
+    return true;
+  case Opcode::AND:
+    result = left & right;
+    return true;
+  case Opcode::OR:
+    result = left | right;
+    return true;
+  case Opcode::XOR:
+    result = left ^ right;
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Whether a stack compare branch is taken with these operands.
+static bool compare(Opcode branch, Constant left, Constant right) {
+  switch (branch) {
+  case Opcode::CGOTO_EQ:
+    return left == right;
+  case Opcode::CGOTO_NEQ:
+    return left != right;
+  case Opcode::CGOTO_GT:
+    return left > right;
+  default:
+    return left < right;
+  }
+}
+
+// Whether an operation with an immediate leaves the value it works on as
+// it is.
+static bool isIdentity(Opcode opcode, int64_t immediate) {
+  switch (opcode) {
+  case Opcode::IADD:
+  case Opcode::ISUB:
+  case Opcode::ILSHIFT:
+  case Opcode::IRSHIFT:
+  case Opcode::IOR:
+  case Opcode::IXOR:
+    return immediate == 0;
+  case Opcode::IMUL:
+  case Opcode::IDIV:
+    return immediate == 1;
+  case Opcode::IAND:
+    return immediate == -1;
+  default:
+    return false;
+  }
+}
+
+static Instruction makeInstruction(Opcode opcode, size_t origin,
+                                   int64_t operand = 0) {
+  Instruction instruction;
+  instruction.offset = origin;
+  instruction.opcode = opcode;
+  instruction.operands[0] = operand;
+  for (size_t i = 1; i < MAX_OPERANDS; i++) {
+    instruction.operands[i] = 0;
+  }
+  instruction.length = encodedLength(instruction);
+  return instruction;
+}
+
+// The value instruction pushes, if it pushes a constant.
+static bool pushedConstant(const Graph &graph, const Instruction &instruction,
+                           Constant &value) {
+  if (instruction.opcode == Opcode::IPUSH_IMM) {
+    value = instruction.operands[0];
+    return true;
+  }
+  if (instruction.opcode == Opcode::IPUSH_CONST) {
+    value = (*graph.constants)[instruction.operands[0]];
+    return true;
+  }
+  return false;
+}
+
+// An instruction that pushes value, made from the instruction at origin.
+// Returns false if value needs a new constant and the pool is full.
+static bool makePush(Graph &graph, Constant value, size_t origin,
+                     Instruction &push) {
+  if (fitsImmediate(value)) {
+    push = makeInstruction(Opcode::IPUSH_IMM, origin, value);
+    return true;
+  }
+  vector<Constant> &constants = *graph.constants;
+  auto found = std::find(constants.begin(), constants.end(), value);
+  if (found == constants.end()) {
+    if (constants.size() >= UINT32_MAX) {
+      return false;
+    }
+    found = constants.insert(constants.end(), value);
+  }
+  push = makeInstruction(Opcode::IPUSH_CONST, origin,
+                         found - constants.begin());
+  return true;
+}
+
+// The operand of instruction that holds its branch target, if it has one.
+static int64_t *targetOperand(Instruction &instruction) {
+  const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+  for (size_t i = 0; i < MAX_OPERANDS; i++) {
+    if (info.operands[i] == OperandKind::TARGET) {
+      return &instruction.operands[i];
+    }
+  }
+  return nullptr;
+}
+
+// The blocks control can go to from block: the target of the branch at its
+// end, if any, then next.
+static void successors(const Block &block, vector<size_t> &result) {
+  result.clear();
+  if (!block.code.empty() && isConditionalBranch(block.code.back().opcode)) {
+    Instruction branch = block.code.back();
+    result.push_back(*targetOperand(branch));
+  }
+  if (block.next != NO_BLOCK) {
+    result.push_back(block.next);
+  }
+}
+
+static size_t localCount(const Graph &graph, int32_t owner) {
+  return owner == MAIN_PROGRAM ? MAX_LOCALS
+                               : graph.functions[owner].localCount;
+}
+
+// How many values instruction takes off the operand stack.
+static size_t pops(const Graph &graph, const Instruction &instruction) {
+  size_t count = opcodeInfo(instruction.opcode).pops;
+  if (instruction.opcode == Opcode::CALL) {
+    count += graph.functions[instruction.operands[0]].argumentCount;
+  }
+  return count;
+}
+
+// Splits the code that verifyProgram found reachable into blocks.
+static void buildGraph(const Program &program, const ProgramInfo &info,
+                       Graph &graph) {
+  vector<int32_t> owner(program.instructionsSize + 1, MAIN_PROGRAM);
+  vector<bool> leader(program.instructionsSize + 1, false);
+  leader[0] = true;
+  for (size_t i = 0; i < program.functionCount; i++) {
+    const Function &function = program.functions[i];
+    std::fill(owner.begin() + function.start,
+              owner.begin() + function.start + function.size, i);
+    leader[function.start] = true;
+    leader[function.start + function.size] = true;
+  }
+  vector<Instruction> code;
+  for (size_t offset = 0; offset < program.instructionsSize;) {
+    Instruction instruction;
+    decodeInstruction(program, offset, instruction);
+    offset += instruction.length;
+    if (info.stackDepth[instruction.offset] < 0) {
+      continue;
+    }
+    Opcode opcode = instruction.opcode;
+    if (int64_t *target = targetOperand(instruction)) {
+      leader[*target] = true;
+    }
+    if (opcode == Opcode::GOTO || opcode == Opcode::EXIT ||
+        opcode == Opcode::RET || isConditionalBranch(opcode)) {
+      leader[offset] = true;
+    }
+    code.push_back(instruction);
+  }
+
+  vector<size_t> blockAt(program.instructionsSize + 1, NO_BLOCK);
+  size_t previousEnd = SIZE_MAX;
+  for (const Instruction &instruction : code) {
+    // Unreachable code was skipped, so a gap also starts a block.
+    if (leader[instruction.offset] || instruction.offset != previousEnd) {
+      blockAt[instruction.offset] = graph.blocks.size();
+      graph.blocks.push_back(
+          {{}, NO_BLOCK, owner[instruction.offset], instruction.offset, true});
+    }
+    graph.blocks.back().code.push_back(instruction);
+    previousEnd = instruction.offset + instruction.length;
+  }
+  for (Block &block : graph.blocks) {
+    Instruction &last = block.code.back();
+    size_t end = last.offset + last.length;
+    if (last.opcode == Opcode::GOTO) {
+      block.next = blockAt[last.operands[0]];
+      block.code.pop_back();
+    } else if (last.opcode != Opcode::EXIT && last.opcode != Opcode::RET &&
+               end < program.instructionsSize) {
+      block.next = blockAt[end];
+    }
+    for (Instruction &instruction : block.code) {
+      if (int64_t *target = targetOperand(instruction)) {
+        *target = blockAt[*target];
+      }
+    }
+  }
+  for (size_t i = 0; i < graph.blocks.size(); i++) {
+    graph.layout.push_back(i);
+  }
+  graph.mainEntry = blockAt[0];
+  graph.functions.assign(program.functions,
+                         program.functions + program.functionCount);
+  for (const Function &function : graph.functions) {
+    graph.functionEntries.push_back(blockAt[function.start]);
+  }
+}
+
+// What constant propagation knows about a value.
+struct Value {
+  enum Kind : uint8_t { ANY, NON_NEGATIVE, CONSTANT } kind;
+  Constant constant;
+};
+static Value anyValue() { return {Value::ANY, 0}; }
+static Value constantValue(Constant constant) {
+  return {Value::CONSTANT, constant};
+}
+static bool isNonNegative(const Value &value) {
+  return value.kind == Value::NON_NEGATIVE ||
+         (value.kind == Value::CONSTANT && value.constant >= 0);
+}
+static bool isConstant(const Value &value) {
+  return value.kind == Value::CONSTANT;
+}
+static bool sameValue(const Value &a, const Value &b) {
+  return a.kind == b.kind &&
+         (a.kind != Value::CONSTANT || a.constant == b.constant);
+}
+// What is known of a value that can come from either a or b.
+static Value meet(const Value &a, const Value &b) {
+  if (sameValue(a, b)) {
+    return a;
+  }
+  if (isNonNegative(a) && isNonNegative(b)) {
+    return {Value::NON_NEGATIVE, 0};
+  }
+  return anyValue();
+}
+
+struct State {
+  bool reached = false;
+  vector<Value> stack;
+  vector<Value> locals;
+};
+
+// Adds what is known on one path into a block to into. Returns whether that
+// changed into.
+static bool merge(State &into, const State &from) {
+  if (!into.reached) {
+    into = from;
+    into.reached = true;
+    return true;
+  }
+  bool changed = false;
+  auto mergeValues = [&](vector<Value> &values, const vector<Value> &other) {
+    for (size_t i = 0; i < values.size(); i++) {
+      Value merged = meet(values[i], other[i]);
+      if (!sameValue(merged, values[i])) {
+        values[i] = merged;
+        changed = true;
+      }
+    }
+  };
+  mergeValues(into.stack, from.stack);
+  mergeValues(into.locals, from.locals);
+  return changed;
+}
+
+// Runs instruction on what is known in state.
+static void step(const Graph &graph, const Instruction &instruction,
+                 State &state) {
+  vector<Value> &stack = state.stack;
+  Opcode opcode = instruction.opcode;
+  Constant constant;
+  if (pushedConstant(graph, instruction, constant)) {
+    stack.push_back(constantValue(constant));
+    return;
+  }
+  if (isBinary(opcode) || isImmediateOperation(opcode)) {
+    Value right = constantValue(instruction.operands[0]);
+    if (isBinary(opcode)) {
+      right = stack.back();
+      stack.pop_back();
+    } else {
+      opcode = binaryForm(opcode);
+    }
+    Value left = stack.back();
+    Value result = anyValue();
+    Constant folded;
+    if (isConstant(left) && isConstant(right) &&
+        fold(opcode, left.constant, right.constant, folded)) {
+      result = constantValue(folded);
+    } else if ((opcode == Opcode::AND &&
+                (isNonNegative(left) || isNonNegative(right))) ||
+               (opcode == Opcode::RSHIFT && isNonNegative(left)) ||
+               (opcode == Opcode::DIV && isNonNegative(left) &&
+                isNonNegative(right))) {
+      result = {Value::NON_NEGATIVE, 0};
+    }
+    stack.back() = result;
+    return;
+  }
+  switch (opcode) {
+  case Opcode::DUP:
+    stack.push_back(stack.back());
+    return;
+  case Opcode::LLOAD:
+    stack.push_back(state.locals[instruction.operands[0]]);
+    return;
+  case Opcode::LSTORE:
+    state.locals[instruction.operands[0]] = stack.back();
+    stack.pop_back();
+    return;
+  default:
+    break;
+  }
+  // Nothing is known about what anything else pushes, or about any local it
+  // names.
+  stack.resize(stack.size() - pops(graph, instruction));
+  stack.resize(stack.size() + opcodeInfo(opcode).pushes, anyValue());
+  const OpcodeInfo &info = opcodeInfo(opcode);
+  for (size_t i = 0; i < MAX_OPERANDS; i++) {
+    if (info.operands[i] == OperandKind::LOCAL) {
+      state.locals[instruction.operands[i]] = anyValue();
+    }
+  }
+}
+
+// Whether the stack compare branch at the end of a block is decided by
+// what state knows just before it, and if so, whether it is taken.
+static bool decideBranch(const Instruction &branch, const State &state,
+                         bool &taken) {
+  if (!isStackCompareBranch(branch.opcode)) {
+    return false;
+  }
+  const Value &right = state.stack[state.stack.size() - 1];
+  const Value &left = state.stack[state.stack.size() - 2];
+  if (!isConstant(left) || !isConstant(right)) {
+    return false;
+  }
+  taken = compare(branch.opcode, left.constant, right.constant);
+  return true;
+}
+
+// Finds what is known on entry to every block, following only branches
+// that can be taken. The main program's locals may hold inputs, so nothing
+// is known of them at first; a function's locals other than its arguments
+// start at zero.
+static void findEntryStates(const Graph &graph, vector<State> &entry) {
+  entry.assign(graph.blocks.size(), State());
+  vector<size_t> worklist;
+  State &main = entry[graph.mainEntry];
+  main.reached = true;
+  main.locals.assign(MAX_LOCALS, anyValue());
+  worklist.push_back(graph.mainEntry);
+  for (size_t i = 0; i < graph.functions.size(); i++) {
+    const Function &function = graph.functions[i];
+    State &state = entry[graph.functionEntries[i]];
+    state.reached = true;
+    state.locals.assign(function.localCount, constantValue(0));
+    std::fill(state.locals.begin(),
+              state.locals.begin() + function.argumentCount, anyValue());
+    worklist.push_back(graph.functionEntries[i]);
+  }
+  while (!worklist.empty()) {
+    size_t index = worklist.back();
+    worklist.pop_back();
+    const Block &block = graph.blocks[index];
+    State state = entry[index];
+    bool decided = false;
+    bool taken = false;
+    for (size_t i = 0; i < block.code.size(); i++) {
+      if (i + 1 == block.code.size()) {
+        decided = decideBranch(block.code[i], state, taken);
+      }
+      step(graph, block.code[i], state);
+    }
+    auto follow = [&](size_t successor) {
+      if (merge(entry[successor], state)) {
+        worklist.push_back(successor);
+      }
+    };
+    if (!block.code.empty() && isConditionalBranch(block.code.back().opcode)) {
+      Instruction branch = block.code.back();
+      if (!decided || taken) {
+        follow(*targetOperand(branch));
+      }
+      if ((!decided || !taken) && block.next != NO_BLOCK) {
+        follow(block.next);
+      }
+    } else if (block.next != NO_BLOCK) {
+      follow(block.next);
+    }
+  }
+}
+
+// Whether replacing the LLOAD of a constant at code[i] with a push leaves
+// one fewer instruction once the push is folded into the next instruction.
+// Leaves alone loads that load-time fusion turns into LADD.
+static bool isFoldablePush(const vector<Instruction> &code, size_t i) {
+  if (i + 1 >= code.size()) {
+    return false;
+  }
+  Opcode next = code[i + 1].opcode;
+  if (next == Opcode::ADD && i >= 1 && code[i - 1].opcode == Opcode::LLOAD &&
+      code[i].opcode == Opcode::LLOAD && i + 2 < code.size() &&
+      code[i + 2].opcode == Opcode::LSTORE) {
+    return false;
+  }
+  return isBinary(next) || isImmediateOperation(next) ||
+         isStackCompareBranch(next) || next == Opcode::DROP;
+}
+
+// Propagates constants through the stack and locals, replacing loads of
+// known constants, deciding branches on them, and turning divisions of
+// non-negative values by powers of two into shifts. Drops the blocks that
+// can no longer be reached.
+static bool propagateConstants(Graph &graph) {
+  vector<State> entry;
+  findEntryStates(graph, entry);
+  bool changed = false;
+  for (size_t index = 0; index < graph.blocks.size(); index++) {
+    Block &block = graph.blocks[index];
+    if (!block.live) {
+      continue;
+    }
+    if (!entry[index].reached) {
+      block.live = false;
+      changed = true;
+      continue;
+    }
+    vector<Instruction> &code = block.code;
+    State state = entry[index];
+    for (size_t i = 0; i < code.size(); i++) {
+      Instruction &instruction = code[i];
+      Value top = state.stack.empty() ? anyValue() : state.stack.back();
+      Value loaded = instruction.opcode == Opcode::LLOAD
+                         ? state.locals[instruction.operands[0]]
+                         : top;
+      Instruction push;
+      if ((instruction.opcode == Opcode::LLOAD ||
+           instruction.opcode == Opcode::DUP) &&
+          isConstant(loaded) && isFoldablePush(code, i) &&
+          makePush(graph, loaded.constant, instruction.offset, push)) {
+        instruction = push;
+        changed = true;
+      } else if (instruction.opcode == Opcode::IDIV &&
+                 isPowerOfTwo(instruction.operands[0]) &&
+                 isNonNegative(top)) {
+        instruction = makeInstruction(Opcode::IRSHIFT, instruction.offset,
+                                      exponentOf(instruction.operands[0]));
+        changed = true;
+      }
+      bool taken;
+      if (i + 1 == code.size() && decideBranch(instruction, state, taken)) {
+        size_t target = *targetOperand(instruction);
+        Instruction drop = makeInstruction(Opcode::DROP, instruction.offset);
+        code.back() = drop;
+        code.push_back(drop);
+        if (taken) {
+          block.next = target;
+        }
+        changed = true;
+        break;
+      }
+      step(graph, instruction, state);
+    }
+  }
+  return changed;
+}
+
+// Rewrites the instructions starting at code[i] into fewer, if they match
+// a pattern. Returns whether anything changed.
+static bool simplifyAt(Graph &graph, Block &block, size_t i) {
+  vector<Instruction> &code = block.code;
+  Instruction *a = &code[i];
+  Instruction *b = i + 1 < code.size() ? &code[i + 1] : nullptr;
+  Instruction *c = i + 2 < code.size() ? &code[i + 2] : nullptr;
+  auto replace = [&](size_t count, vector<Instruction> with) {
+    code.erase(code.begin() + i, code.begin() + i + count);
+    code.insert(code.begin() + i, with.begin(), with.end());
+    return true;
+  };
+  Constant x = 0, y = 0, folded = 0;
+  Instruction push;
+  bool aPushes = pushedConstant(graph, *a, x);
+  bool bPushes = b != nullptr && pushedConstant(graph, *b, y);
+  // ipush x; ipush y; op  =>  ipush (x op y)
+  if (aPushes && bPushes && c != nullptr && isBinary(c->opcode) &&
+      fold(c->opcode, x, y, folded) &&
+      makePush(graph, folded, c->offset, push)) {
+    return replace(3, {push});
+  }
+  // ipush x; ipush y; cgoto_* label  =>  goto label, or nothing
+  if (aPushes && bPushes && c != nullptr && i + 3 == code.size() &&
+      isStackCompareBranch(c->opcode)) {
+    if (compare(c->opcode, x, y)) {
+      block.next = c->operands[0];
+    }
+    return replace(3, {});
+  }
+  // ipush x; iop y  =>  ipush (x op y)
+  if (aPushes && b != nullptr && isImmediateOperation(b->opcode) &&
+      fold(binaryForm(b->opcode), x, b->operands[0], folded) &&
+      makePush(graph, folded, b->offset, push)) {
+    return replace(2, {push});
+  }
+  // ipush x; op  =>  iop x
+  if (aPushes && b != nullptr && isBinary(b->opcode) && fitsImmediate(x)) {
+    return replace(2, {makeInstruction(immediateForm(b->opcode), b->offset,
+                                       x)});
+  }
+  // ipush x; lload n; op  =>  lload n; iop x, for commutative operations
+  if (aPushes && b != nullptr && b->opcode == Opcode::LLOAD &&
+      c != nullptr && isCommutative(c->opcode) && fitsImmediate(x)) {
+    return replace(3, {*b, makeInstruction(immediateForm(c->opcode),
+                                           c->offset, x)});
+  }
+  if (isImmediateOperation(a->opcode)) {
+    int64_t immediate = a->operands[0];
+    if (isIdentity(a->opcode, immediate)) {
+      return replace(1, {});
+    }
+    if (a->opcode == Opcode::IMUL && isPowerOfTwo(immediate)) {
+      return replace(1, {makeInstruction(Opcode::ILSHIFT, a->offset,
+                                         exponentOf(immediate))});
+    }
+    // Two operations with immediates in a row, as one.
+    if (b != nullptr && isImmediateOperation(b->opcode)) {
+      Opcode first = a->opcode;
+      Opcode second = b->opcode;
+      int64_t other = b->operands[0];
+      Opcode combined = first;
+      int64_t value = 0;
+      bool combines = true;
+      if ((first == Opcode::IADD || first == Opcode::ISUB) &&
+          (second == Opcode::IADD || second == Opcode::ISUB)) {
+        combined = Opcode::IADD;
+        value = (first == Opcode::IADD ? immediate : -immediate) +
+                (second == Opcode::IADD ? other : -other);
+      } else if (first == second && first == Opcode::IMUL) {
+        value = immediate * other;
+      } else if (first == second && (first == Opcode::ILSHIFT ||
+                                     first == Opcode::IRSHIFT)) {
+        value = immediate + other;
+        combines = immediate >= 0 && other >= 0 && value < 64;
+      } else if (first == second && first == Opcode::IAND) {
+        value = immediate & other;
+      } else if (first == second && first == Opcode::IOR) {
+        value = immediate | other;
+      } else if (first == second && first == Opcode::IXOR) {
+        value = immediate ^ other;
+      } else {
+        combines = false;
+      }
+      if (combines && fitsImmediate(value)) {
+        return replace(2, {makeInstruction(combined, a->offset, value)});
+      }
+    }
+  }
+  if (b != nullptr && b->opcode == Opcode::DROP) {
+    // A value that is pushed and dropped again.
+    if (aPushes || a->opcode == Opcode::LLOAD || a->opcode == Opcode::DUP) {
+      return replace(2, {});
+    }
+    // An operation whose result is dropped, unless it can trap.
+    Instruction drop = *b;
+    if (isBinary(a->opcode) && a->opcode != Opcode::DIV) {
+      return replace(2, {drop, drop});
+    }
+    if (isImmediateOperation(a->opcode) && a->opcode != Opcode::IDIV) {
+      return replace(2, {drop});
+    }
+  }
+  // lload n; lstore n  =>  nothing
+  if (a->opcode == Opcode::LLOAD && b != nullptr &&
+      b->opcode == Opcode::LSTORE && a->operands[0] == b->operands[0]) {
+    return replace(2, {});
+  }
+  return false;
+}
+
+// Redirects branches that lead to an empty block to where it leads.
+static bool threadJumps(Graph &graph) {
+  bool changed = false;
+  auto skipEmpty = [&](size_t target) {
+    // Bounded, in case empty blocks form a loop.
+    for (size_t hops = 0; hops < graph.blocks.size(); hops++) {
+      const Block &block = graph.blocks[target];
+      if (!block.code.empty() || block.next == NO_BLOCK ||
+          block.next == target) {
+        break;
+      }
+      target = block.next;
+    }
+    return target;
+  };
+  for (size_t position = 0; position < graph.layout.size(); position++) {
+    Block &block = graph.blocks[graph.layout[position]];
+    if (!block.live) {
+      continue;
+    }
+    if (!block.code.empty()) {
+      if (int64_t *target = targetOperand(block.code.back())) {
+        size_t skipped = skipEmpty(*target);
+        if (skipped != (size_t)*target) {
+          *target = skipped;
+          changed = true;
+        }
+      }
+    }
+    // Leave alone a fall through into the next block, which costs nothing.
+    if (block.next != NO_BLOCK && (position + 1 == graph.layout.size() ||
+                                   graph.layout[position + 1] != block.next)) {
+      size_t skipped = skipEmpty(block.next);
+      if (skipped != block.next) {
+        block.next = skipped;
+        changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+// Rewrites short instruction sequences within each block into shorter ones.
+static bool simplifyBlocks(Graph &graph) {
+  bool changed = false;
+  for (Block &block : graph.blocks) {
+    if (!block.live) {
+      continue;
+    }
+    for (size_t i = 0; i < block.code.size();) {
+      if (simplifyAt(graph, block, i)) {
+        changed = true;
+        // The patterns span up to three instructions, so the rewrite may
+        // complete one that starts up to two before it.
+        i = i >= 2 ? i - 2 : 0;
+      } else {
+        i++;
+      }
+    }
+  }
+  return threadJumps(graph) || changed;
+}
+
+// Runs instruction backwards on the set of live locals.
+static void stepLiveness(const Instruction &instruction, vector<bool> &live) {
+  const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+  if (instruction.opcode == Opcode::LSTORE) {
+    live[instruction.operands[0]] = false;
+    return;
+  }
+  for (size_t i = 0; i < MAX_OPERANDS; i++) {
+    if (info.operands[i] == OperandKind::LOCAL) {
+      live[instruction.operands[i]] = true;
+    }
+  }
+}
+
+// Removes stores to locals that are never read again. No local is read
+// after EXIT or RET, and a call cannot read its caller's locals. A store
+// that is read back straight away by a load, and never again, goes along
+// with the load, leaving the value on the stack.
+static bool removeDeadStores(Graph &graph) {
+  size_t blockCount = graph.blocks.size();
+  vector<vector<bool>> liveIn(blockCount);
+  for (size_t i = 0; i < blockCount; i++) {
+    liveIn[i].assign(localCount(graph, graph.blocks[i].owner), false);
+  }
+  vector<size_t> next;
+  auto liveOut = [&](const Block &block, vector<bool> &live) {
+    live.assign(localCount(graph, block.owner), false);
+    successors(block, next);
+    for (size_t successor : next) {
+      for (size_t i = 0; i < live.size(); i++) {
+        live[i] = live[i] || liveIn[successor][i];
+      }
+    }
+  };
+  vector<bool> live;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t position = graph.layout.size(); position-- > 0;) {
+      size_t index = graph.layout[position];
+      const Block &block = graph.blocks[index];
+      if (!block.live) {
+        continue;
+      }
+      liveOut(block, live);
+      for (size_t i = block.code.size(); i-- > 0;) {
+        stepLiveness(block.code[i], live);
+      }
+      if (live != liveIn[index]) {
+        liveIn[index] = live;
+        changed = true;
+      }
+    }
+  }
+
+  bool changed = false;
+  for (Block &block : graph.blocks) {
+    if (!block.live) {
+      continue;
+    }
+    vector<Instruction> &code = block.code;
+    liveOut(block, live);
+    for (size_t i = code.size(); i-- > 0;) {
+      Instruction &instruction = code[i];
+      if (instruction.opcode == Opcode::LLOAD && i > 0 &&
+          code[i - 1].opcode == Opcode::LSTORE &&
+          code[i - 1].operands[0] == instruction.operands[0] &&
+          !live[instruction.operands[0]]) {
+        code.erase(code.begin() + i - 1, code.begin() + i + 1);
+        i--;
+        changed = true;
+        continue;
+      }
+      if (instruction.opcode == Opcode::LSTORE &&
+          !live[instruction.operands[0]]) {
+        instruction = makeInstruction(Opcode::DROP, instruction.offset);
+        changed = true;
+      }
+      stepLiveness(instruction, live);
+    }
+  }
+  return changed;
+}
+
+// Immediate dominators of the live blocks, found with the iterative
+// algorithm of Cooper, Harvey and Kennedy. The entries of the main program
+// and of every function hang off a virtual root, numbered blocks.size().
+static void findDominators(const Graph &graph,
+                           const vector<vector<size_t>> &predecessors,
+                           vector<size_t> &dominator) {
+  size_t root = graph.blocks.size();
+  vector<size_t> postorder(root + 1, SIZE_MAX);
+  vector<size_t> order;
+  // Depth first search without recursion, which deep code would overflow.
+  vector<pair<size_t, size_t>> path;
+  vector<bool> visited(root + 1, false);
+  vector<vector<size_t>> next(root + 1);
+  next[root].push_back(graph.mainEntry);
+  next[root].insert(next[root].end(), graph.functionEntries.begin(),
+                    graph.functionEntries.end());
+  for (size_t i = 0; i < root; i++) {
+    if (graph.blocks[i].live) {
+      successors(graph.blocks[i], next[i]);
+    }
+  }
+  path.push_back({root, 0});
+  visited[root] = true;
+  while (!path.empty()) {
+    auto &top = path.back();
+    if (top.second < next[top.first].size()) {
+      size_t successor = next[top.first][top.second++];
+      if (!visited[successor]) {
+        visited[successor] = true;
+        path.push_back({successor, 0});
+      }
+    } else {
+      postorder[top.first] = order.size();
+      order.push_back(top.first);
+      path.pop_back();
+    }
+  }
+
+  dominator.assign(root + 1, SIZE_MAX);
+  dominator[root] = root;
+  auto intersect = [&](size_t a, size_t b) {
+    while (a != b) {
+      while (postorder[a] < postorder[b]) {
+        a = dominator[a];
+      }
+      while (postorder[b] < postorder[a]) {
+        b = dominator[b];
+      }
+    }
+    return a;
+  };
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t i = order.size() - 1; i-- > 0;) {
+      size_t block = order[i];
+      size_t dominatedBy = SIZE_MAX;
+      auto consider = [&](size_t predecessor) {
+        if (dominator[predecessor] == SIZE_MAX) {
+          return;
+        }
+        dominatedBy = dominatedBy == SIZE_MAX
+                          ? predecessor
+                          : intersect(predecessor, dominatedBy);
+      };
+      for (size_t predecessor : predecessors[block]) {
+        consider(predecessor);
+      }
+      if (std::find(next[root].begin(), next[root].end(), block) !=
+          next[root].end()) {
+        consider(root);
+      }
+      if (dominator[block] != dominatedBy) {
+        dominator[block] = dominatedBy;
+        changed = true;
+      }
+    }
+  }
+}
+
+static bool dominates(const vector<size_t> &dominator, size_t a, size_t b) {
+  while (true) {
+    if (a == b) {
+      return true;
+    }
+    if (dominator[b] == b || dominator[b] == SIZE_MAX) {
+      return false;
+    }
+    b = dominator[b];
+  }
+}
+
+// A pure computation within a block that leaves one value on the stack,
+// from code[start] to just before code[end].
+struct Expression {
+  size_t block;
+  size_t start;
+  size_t end;
+};
+
+// Finds the longest expressions in a block that compute the same value
+// every time round a loop, from constants and locals the loop never writes.
+// Expressions without a load are left to folding.
+static void findInvariantExpressions(const Graph &graph, size_t index,
+                                     const vector<bool> &written,
+                                     vector<Expression> &found) {
+  const vector<Instruction> &code = graph.blocks[index].code;
+  struct Entry {
+    bool invariant;
+    bool loads;
+    size_t start;
+  };
+  vector<Entry> stack;
+  auto pop = [&]() {
+    if (stack.empty()) {
+      // A value from before the block.
+      return Entry{false, false, 0};
+    }
+    Entry entry = stack.back();
+    stack.pop_back();
+    return entry;
+  };
+  size_t firstFound = found.size();
+  Constant constant;
+  for (size_t i = 0; i < code.size(); i++) {
+    const Instruction &instruction = code[i];
+    Opcode opcode = instruction.opcode;
+    int64_t immediate = instruction.operands[0];
+    if (pushedConstant(graph, instruction, constant)) {
+      stack.push_back({true, false, i});
+    } else if (opcode == Opcode::LLOAD) {
+      stack.push_back({!written[immediate], true, i});
+    } else if ((isBinary(opcode) && opcode != Opcode::DIV) ||
+               (isImmediateOperation(opcode) &&
+                (opcode != Opcode::IDIV ||
+                 (immediate != 0 && immediate != -1)))) {
+      Entry right = isBinary(opcode) ? pop() : Entry{true, false, i};
+      Entry left = pop();
+      Entry result{left.invariant && right.invariant,
+                   left.loads || right.loads, left.start};
+      stack.push_back(result);
+      // lload a; lload b; add; lstore c is fused into one LADD at load
+      // time, which beats a load of the hoisted sum and a store.
+      bool fusesToLocalAdd = i == left.start + 2 && opcode == Opcode::ADD &&
+                             code[left.start].opcode == Opcode::LLOAD &&
+                             code[left.start + 1].opcode == Opcode::LLOAD &&
+                             i + 1 < code.size() &&
+                             code[i + 1].opcode == Opcode::LSTORE;
+      if (result.invariant && result.loads && !fusesToLocalAdd) {
+        // It contains any expression found since it started.
+        while (found.size() > firstFound &&
+               found.back().start >= result.start) {
+          found.pop_back();
+        }
+        found.push_back({index, result.start, i + 1});
+      }
+    } else {
+      // Anything else ends every expression in progress, so none can span
+      // it.
+      for (Entry &entry : stack) {
+        entry.invariant = false;
+      }
+      for (size_t j = pops(graph, instruction); j > 0; j--) {
+        pop();
+      }
+      for (size_t j = opcodeInfo(opcode).pushes; j > 0; j--) {
+        stack.push_back({false, false, i});
+      }
+    }
+  }
+}
+
+// Finds a local the code of owner never uses, to hold a value hoisted out
+// of a loop. Returns false if there is none.
+static bool newLocal(Graph &graph, int32_t owner, uint16_t &local) {
+  if (owner != MAIN_PROGRAM) {
+    Function &function = graph.functions[owner];
+    if (function.localCount >= MAX_LOCALS) {
+      return false;
+    }
+    local = function.localCount++;
+    return true;
+  }
+  vector<bool> used(MAX_LOCALS, false);
+  for (const Block &block : graph.blocks) {
+    if (block.owner != MAIN_PROGRAM) {
+      continue;
+    }
+    for (const Instruction &instruction : block.code) {
+      const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+      for (size_t i = 0; i < MAX_OPERANDS; i++) {
+        if (info.operands[i] == OperandKind::LOCAL) {
+          used[instruction.operands[i]] = true;
+        }
+      }
+    }
+  }
+  // Take the highest, as inputs are passed in the lowest.
+  for (size_t i = MAX_LOCALS; i-- > 0;) {
+    if (!used[i]) {
+      local = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+struct Loop {
+  size_t header;
+  vector<bool> body;
+  size_t size;
+};
+
+// Computes the loop-invariant expressions of loop once, in a new block
+// that runs before the loop is entered, and stores them in new locals for
+// the loop to load. Returns whether anything was hoisted.
+static bool hoistFromLoop(Graph &graph,
+                          const vector<vector<size_t>> &predecessors,
+                          const Loop &loop, vector<Loop> &loops) {
+  size_t header = loop.header;
+  int32_t owner = graph.blocks[header].owner;
+  vector<bool> written(localCount(graph, owner), false);
+  for (size_t i = 0; i < loop.body.size(); i++) {
+    if (!loop.body[i]) {
+      continue;
+    }
+    for (const Instruction &instruction : graph.blocks[i].code) {
+      const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+      for (size_t j = 0; j < MAX_OPERANDS; j++) {
+        if (info.operands[j] == OperandKind::LOCAL &&
+            instruction.opcode != Opcode::LLOAD) {
+          written[instruction.operands[j]] = true;
+        }
+      }
+    }
+  }
+  vector<Expression> expressions;
+  for (size_t i = 0; i < loop.body.size(); i++) {
+    if (loop.body[i]) {
+      findInvariantExpressions(graph, i, written, expressions);
+    }
+  }
+  if (expressions.empty()) {
+    return false;
+  }
+
+  // Place the new block where entering the loop falls into it and nothing
+  // in the loop has to jump over it.
+  auto positionOf = [&](size_t block) {
+    return std::find(graph.layout.begin(), graph.layout.end(), block) -
+           graph.layout.begin();
+  };
+  vector<size_t> outside;
+  for (size_t predecessor : predecessors[header]) {
+    if (!loop.body[predecessor]) {
+      outside.push_back(predecessor);
+    }
+  }
+  size_t headerPosition = positionOf(header);
+  size_t before = SIZE_MAX;
+  for (size_t i = headerPosition; i-- > 0;) {
+    if (graph.blocks[graph.layout[i]].live) {
+      before = graph.layout[i];
+      break;
+    }
+  }
+  bool isEntry = header == graph.mainEntry ||
+                 std::find(graph.functionEntries.begin(),
+                           graph.functionEntries.end(),
+                           header) != graph.functionEntries.end();
+  size_t insertAt = SIZE_MAX;
+  if (isEntry || before == SIZE_MAX || graph.blocks[before].next != header ||
+      !loop.body[before]) {
+    insertAt = headerPosition;
+  } else {
+    for (size_t predecessor : outside) {
+      if (graph.blocks[predecessor].next == header) {
+        insertAt = positionOf(predecessor) + 1;
+        break;
+      }
+    }
+  }
+  if (insertAt == SIZE_MAX) {
+    return false;
+  }
+
+  Block preheader{{}, header, owner, graph.blocks[header].origin, true};
+  map<vector<pair<Opcode, int64_t>>, uint16_t> hoisted;
+  // Later expressions first, so the positions of earlier ones in the same
+  // block stay put.
+  for (size_t i = expressions.size(); i-- > 0;) {
+    const Expression &expression = expressions[i];
+    vector<Instruction> &code = graph.blocks[expression.block].code;
+    vector<pair<Opcode, int64_t>> key;
+    for (size_t j = expression.start; j < expression.end; j++) {
+      key.push_back({code[j].opcode, code[j].operands[0]});
+    }
+    auto found = hoisted.find(key);
+    uint16_t local;
+    if (found != hoisted.end()) {
+      local = found->second;
+    } else {
+      if (!newLocal(graph, owner, local)) {
+        break;
+      }
+      hoisted[key] = local;
+      preheader.code.insert(preheader.code.end(),
+                            code.begin() + expression.start,
+                            code.begin() + expression.end);
+      preheader.code.push_back(
+          makeInstruction(Opcode::LSTORE, code[expression.end - 1].offset,
+                          local));
+    }
+    Instruction load = makeInstruction(Opcode::LLOAD,
+                                       code[expression.start].offset, local);
+    code.erase(code.begin() + expression.start + 1,
+               code.begin() + expression.end);
+    code[expression.start] = load;
+  }
+  if (hoisted.empty()) {
+    return false;
+  }
+
+  size_t index = graph.blocks.size();
+  graph.blocks.push_back(preheader);
+  graph.layout.insert(graph.layout.begin() + insertAt, index);
+  for (size_t predecessor : outside) {
+    Block &block = graph.blocks[predecessor];
+    if (block.next == header) {
+      block.next = index;
+    }
+    if (!block.code.empty()) {
+      int64_t *target = targetOperand(block.code.back());
+      if (target != nullptr && (size_t)*target == header) {
+        *target = index;
+      }
+    }
+  }
+  if (graph.mainEntry == header) {
+    graph.mainEntry = index;
+  }
+  for (size_t &entry : graph.functionEntries) {
+    if (entry == header) {
+      entry = index;
+    }
+  }
+  // The new block runs every time round any loop around this one.
+  for (Loop &other : loops) {
+    other.body.resize(graph.blocks.size(), false);
+    other.body[index] = &other != &loop && other.body[header];
+  }
+  return true;
+}
+
+// Moves the loop-invariant expressions of every loop out of it, innermost
+// loops first.
+static bool hoistLoopInvariants(Graph &graph) {
+  size_t blockCount = graph.blocks.size();
+  vector<vector<size_t>> predecessors(blockCount);
+  vector<size_t> next;
+  for (size_t i = 0; i < blockCount; i++) {
+    if (graph.blocks[i].live) {
+      successors(graph.blocks[i], next);
+      for (size_t successor : next) {
+        predecessors[successor].push_back(i);
+      }
+    }
+  }
+  vector<size_t> dominator;
+  findDominators(graph, predecessors, dominator);
+
+  // A back edge goes to a block that dominates where it comes from. The
+  // loop is every block that reaches the source without passing through
+  // the header.
+  map<size_t, size_t> loopAt;
+  vector<Loop> loops;
+  for (size_t i = 0; i < blockCount; i++) {
+    if (!graph.blocks[i].live) {
+      continue;
+    }
+    successors(graph.blocks[i], next);
+    for (size_t header : next) {
+      if (!dominates(dominator, header, i)) {
+        continue;
+      }
+      if (loopAt.count(header) == 0) {
+        loopAt[header] = loops.size();
+        Loop loop{header, vector<bool>(blockCount, false), 1};
+        loop.body[header] = true;
+        loops.push_back(loop);
+      }
+      Loop &loop = loops[loopAt[header]];
+      vector<size_t> worklist{i};
+      while (!worklist.empty()) {
+        size_t block = worklist.back();
+        worklist.pop_back();
+        if (loop.body[block]) {
+          continue;
+        }
+        loop.body[block] = true;
+        loop.size++;
+        worklist.insert(worklist.end(), predecessors[block].begin(),
+                        predecessors[block].end());
+      }
+    }
+  }
+  vector<size_t> order;
+  for (size_t i = 0; i < loops.size(); i++) {
+    order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return loops[a].size < loops[b].size;
+  });
+  bool changed = false;
+  for (size_t i : order) {
+    // Hoisting adds a block, so predecessors grows to match.
+    if (hoistFromLoop(graph, predecessors, loops[i], loops)) {
+      predecessors.resize(graph.blocks.size());
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Lays the live blocks out in order, with GOTOs where a block does not fall
+// through to its successor, and encodes them.
+static bool writeCode(const Graph &graph, OptimizedCode &optimized) {
+  vector<size_t> order;
+  for (size_t index : graph.layout) {
+    if (graph.blocks[index].live) {
+      order.push_back(index);
+    }
+  }
+  // The code in order, with branch targets as indices into it.
+  vector<Instruction> code;
+  vector<size_t> blockStart(graph.blocks.size(), 0);
+  vector<bool> needsGoto(graph.blocks.size(), false);
+  for (size_t i = 0; i < order.size(); i++) {
+    const Block &block = graph.blocks[order[i]];
+    blockStart[order[i]] = code.size();
+    code.insert(code.end(), block.code.begin(), block.code.end());
+    if (block.next != NO_BLOCK &&
+        (i + 1 == order.size() || order[i + 1] != block.next)) {
+      needsGoto[order[i]] = true;
+      code.push_back(makeInstruction(Opcode::GOTO, block.origin, block.next));
+    }
+  }
+  for (Instruction &instruction : code) {
+    if (int64_t *target = targetOperand(instruction)) {
+      *target = blockStart[*target];
+    }
+  }
+  vector<size_t> offsets;
+  layOutInstructions(code, optimized.instructions, offsets);
+  if (offsets.back() > UINT32_MAX) {
+    cerr << "The optimized program is too long for the format" << endl;
+    return false;
+  }
+
+  optimized.origins.clear();
+  for (size_t i = 0; i < code.size(); i++) {
+    optimized.origins[offsets[i]] = code[i].offset;
+  }
+  optimized.functions = graph.functions;
+  vector<size_t> functionEnd(graph.functions.size(), 0);
+  for (size_t index : order) {
+    const Block &block = graph.blocks[index];
+    if (block.owner != MAIN_PROGRAM) {
+      size_t end = blockStart[index] + block.code.size() +
+                   (needsGoto[index] ? 1 : 0);
+      functionEnd[block.owner] = offsets[end];
+    }
+  }
+  for (size_t i = 0; i < optimized.functions.size(); i++) {
+    Function &function = optimized.functions[i];
+    function.start = offsets[blockStart[graph.functionEntries[i]]];
+    function.size = functionEnd[i] - function.start;
+  }
+  return true;
+}
+
+bool optimizeProgram(const Program &program, vector<Constant> &constants,
+                     OptimizedCode &optimized) {
+  ProgramInfo info;
+  if (!verifyProgram(program, info)) {
+    return false;
+  }
+  Graph graph;
+  graph.constants = &constants;
+  buildGraph(program, info, graph);
+  for (size_t round = 0; round < MAX_ROUNDS; round++) {
+    bool changed = propagateConstants(graph);
+    changed = simplifyBlocks(graph) || changed;
+    changed = removeDeadStores(graph) || changed;
+    changed = hoistLoopInvariants(graph) || changed;
+    if (!changed) {
+      break;
+    }
+  }
+  if (!writeCode(graph, optimized)) {
+    return false;
+  }
+
+  // Every pass keeps what the verifier checks, but make sure before the
+  // program is written.
+  Header header = *program.header;
+  header.constantCount = constants.size();
+  header.functionCount = optimized.functions.size();
+  Program result{&header,
+                 constants.data(),
+                 optimized.functions.data(),
+                 optimized.functions.size(),
+                 optimized.instructions.data(),
+                 optimized.instructions.size()};
+  ProgramInfo resultInfo;
+  if (!verifyProgram(result, resultInfo)) {
+    cerr << "Optimizing broke the program, so it was left as it is" << endl;
+    return false;
+  }
+  return true;
+}
+} // namespace bytecode
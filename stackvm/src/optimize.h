@@ -0,0 +1,36 @@
+#ifndef _OPTIMIZE_H
+#define _OPTIMIZE_H
+
+#include "bytecode.h"
+#include "program.h"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace bytecode {
+// The instructions and function table of an optimized program.
+struct OptimizedCode {
+  std::vector<uint8_t> instructions;
+  std::vector<Function> functions;
+  // For each instruction, by its offset, the offset in the original program
+  // of the instruction it was made from.
+  std::map<size_t, size_t> origins;
+};
+
+// Optimizes the code of a freshly assembled program, whose constant pool is
+// constants. The program is split into basic blocks, and then, until nothing
+// more changes: constants are propagated through locals and branches on them
+// are decided, constant expressions are folded, multiplications and
+// (non-negative) divisions by powers of two become shifts, stores to locals
+// that are never read again are removed along with the loads that follow
+// them, unreachable blocks are dropped, and expressions that do not change
+// inside a loop are computed once before it into a spare local. Constants the
+// new code needs are added to constants. Returns false, leaving the program
+// to be written as it is, if it does not verify (after reporting why on
+// cerr) or the optimized code would not fit the format.
+bool optimizeProgram(const Program &program, std::vector<Constant> &constants,
+                     OptimizedCode &optimized);
+} // namespace bytecode
+
+#endif
@@ -0,0 +1,89 @@
+#include "predecode.h"
+#include "bytecode.h"
+#include "program.h"
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::vector;
+
+namespace bytecode {
+bool predecode(const Program &program, DecodedProgram &decoded) {
+  // Record index of the instruction starting at each byte offset, or -1 for
+  // offsets in the middle of an instruction.
+  vector<int64_t> recordAt(program.instructionsSize + 1, -1);
+  vector<Instruction> instructions;
+  size_t offset = 0;
+  while (offset < program.instructionsSize) {
+    Instruction instruction;
+    if (!decodeInstruction(program, offset, instruction)) {
+      cerr << "Invalid instruction at offset " << offset << endl;
+      return false;
+    }
+    recordAt[offset] = instructions.size();
+    instructions.push_back(instruction);
+    offset += instruction.length;
+  }
+  recordAt[program.instructionsSize] = instructions.size();
+
+  decoded.instructions.assign(instructions.size() + 1, DecodedInstruction{});
+  decoded.instructions.back().opcode = END_OF_PROGRAM;
+  decoded.offsets.resize(instructions.size() + 1);
+  decoded.offsets.back() = program.instructionsSize;
+  for (size_t i = 0; i < instructions.size(); i++) {
+    const Instruction &instruction = instructions[i];
+    DecodedInstruction &record = decoded.instructions[i];
+    record.opcode = instruction.opcode;
+    decoded.offsets[i] = instruction.offset;
+    const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+    for (size_t j = 0; j < MAX_OPERANDS; j++) {
+      int64_t operand = instruction.operands[j];
+      switch (info.operands[j]) {
+      case OperandKind::NONE:
+        break;
+      case OperandKind::IMMEDIATE:
+        record.value = operand;
+        break;
+      case OperandKind::CONSTANT:
+        if (operand >= program.header->constantCount) {
+          cerr << "Constant index out of range at offset "
+               << instruction.offset << endl;
+          return false;
+        }
+        record.value = program.constants[operand];
+        break;
+      case OperandKind::LOCAL:
+        record.locals[j] = operand;
+        break;
+      case OperandKind::TARGET:
+        if ((size_t)operand > program.instructionsSize ||
+            recordAt[operand] < 0) {
+          cerr << "Invalid branch target at offset " << instruction.offset
+               << endl;
+          return false;
+        }
+        record.target = &decoded.instructions[recordAt[operand]];
+        break;
+      case OperandKind::FUNCTION: {
+        // Calls always go to the same function, so resolve the call to the
+        // record of its entry here rather than looking it up on every call.
+        size_t start = operand < (int64_t)program.functionCount
+                           ? program.functions[operand].start
+                           : program.instructionsSize + 1;
+        if (start > program.instructionsSize || recordAt[start] < 0) {
+          cerr << "Invalid function at offset " << instruction.offset << endl;
+          return false;
+        }
+        record.value = operand;
+        record.target = &decoded.instructions[recordAt[start]];
+        break;
+      }
+      }
+    }
+  }
+  return true;
+}
+} // namespace bytecode
@@ -0,0 +1,42 @@
+#ifndef _PREDECODE_H
+#define _PREDECODE_H
+
+#include "bytecode.h"
+#include "program.h"
+#include <cstdint>
+#include <vector>
+
+namespace bytecode {
+// An instruction with its operands already resolved, so the interpreter does
+// not have to decode it again each time it runs.
+struct alignas(32) DecodedInstruction {
+  // Address of the handler in the threaded engine, filled in by the engine.
+  const void *handler;
+  // Immediate operand, the constant for IPUSH_CONST, or the function index
+  // for CALL.
+  Constant value;
+  // Branch target, or the entry of the function for CALL.
+  DecodedInstruction *target;
+  // Local operands, by operand position.
+  uint16_t locals[MAX_OPERANDS];
+  Opcode opcode;
+};
+
+// Opcode of the record that follows the last instruction.
+constexpr Opcode END_OF_PROGRAM = (Opcode)0xff;
+
+struct DecodedProgram {
+  // One record per instruction, followed by a record that stands for the end
+  // of the program.
+  std::vector<DecodedInstruction> instructions;
+  // The offset in the instruction stream of each record, in order, so that
+  // a program stopped in the bytecode can carry on in the records.
+  std::vector<size_t> offsets;
+};
+
+// Translates program into its pre-decoded form. Reports the problem on cerr
+// and returns false if the instruction stream is malformed.
+bool predecode(const Program &program, DecodedProgram &decoded);
+} // namespace bytecode
+
+#endif
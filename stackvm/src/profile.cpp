@@ -0,0 +1,241 @@
+#include "profile.h"
+#include "assembler.h"
+#include "program.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::endl;
+using std::fixed;
+using std::ifstream;
+using std::istringstream;
+using std::ostream;
+using std::ostringstream;
+using std::pair;
+using std::setprecision;
+using std::setw;
+using std::string;
+using std::vector;
+
+namespace bytecode {
+// How many rows the longer tables of the report show.
+#define HOT_INSTRUCTION_ROWS 20
+#define OPCODE_PAIR_ROWS 20
+
+void Profile::reset(size_t instructionsSize) {
+  executions.assign(instructionsSize, 0);
+  taken.assign(instructionsSize, 0);
+  notTaken.assign(instructionsSize, 0);
+  sampledCycles.assign(instructionsSize, 0);
+  samples.assign(instructionsSize, 0);
+  memset(opcodeExecutions, 0, sizeof(opcodeExecutions));
+  memset(opcodePairs, 0, sizeof(opcodePairs));
+  counterOverhead = UINT64_MAX;
+  for (int i = 0; i < 1000; i++) {
+    uint64_t start = readCycleCounter();
+    counterOverhead = std::min(counterOverhead, readCycleCounter() - start);
+  }
+}
+
+bool loadSource(const string &path, const void *bytes, size_t size,
+                ProgramSource &source) {
+  ifstream input(path);
+  if (!input) {
+    return false;
+  }
+  string text((std::istreambuf_iterator<char>(input)),
+              std::istreambuf_iterator<char>());
+  istringstream lines(text);
+  for (string line; std::getline(lines, line);) {
+    source.lines.push_back(line);
+  }
+  // The file may have been assembled with or without optimizing.
+  for (bool optimize : {true, false}) {
+    ostringstream assembled;
+    source.map = SourceMap();
+    assemble(text, assembled, &source.map, optimize);
+    string output = assembled.str();
+    if (output.size() == size && memcmp(output.data(), bytes, size) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static double share(uint64_t part, uint64_t total) {
+  return total == 0 ? 0 : 100.0 * part / total;
+}
+
+static double cyclesPerExecution(const Profile &profile, uint64_t cycles,
+                                 uint64_t samples) {
+  if (samples == 0) {
+    return 0;
+  }
+  return std::max(0.0, (double)cycles / samples - profile.counterOverhead);
+}
+
+// The nearest label at or before offset, as "label+distance", or "-" if
+// there is no label before it.
+static string location(const ProgramSource *source, size_t offset) {
+  if (source != nullptr) {
+    auto label = source->map.labels.upper_bound(offset);
+    if (label != source->map.labels.begin()) {
+      --label;
+      return label->second + "+" + std::to_string(offset - label->first);
+    }
+  }
+  return "-";
+}
+
+// The source line of the instruction at offset, or its disassembly if the
+// source is not known.
+static string sourceText(const Program &program, const ProgramSource *source,
+                         size_t offset) {
+  if (source != nullptr) {
+    auto line = source->map.lines.find(offset);
+    if (line != source->map.lines.end() &&
+        line->second <= source->lines.size()) {
+      string text = source->lines[line->second - 1];
+      size_t start = text.find_first_not_of(" \t");
+      return "line " + std::to_string(line->second) + ": " +
+             (start == string::npos ? "" : text.substr(start));
+    }
+  }
+  Instruction instruction;
+  if (!decodeInstruction(program, offset, instruction)) {
+    return "?";
+  }
+  const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+  string text = info.name;
+  for (size_t i = 0; i < MAX_OPERANDS; i++) {
+    if (info.operands[i] != OperandKind::NONE) {
+      text += " " + std::to_string(instruction.operands[i]);
+    }
+  }
+  return text;
+}
+
+void writeProfileReport(const Program &program, const Profile &profile,
+                        const ProgramSource *source, ostream &output) {
+  uint64_t total = 0, totalCycles = 0, totalSamples = 0;
+  vector<uint64_t> opcodeCycles(OPCODE_COUNT, 0);
+  vector<uint64_t> opcodeSamples(OPCODE_COUNT, 0);
+  vector<size_t> executed;
+  for (size_t offset = 0; offset < profile.executions.size(); offset++) {
+    if (profile.executions[offset] == 0) {
+      continue;
+    }
+    Opcode opcode = (Opcode)program.instructions[offset];
+    executed.push_back(offset);
+    total += profile.executions[offset];
+    totalCycles += profile.sampledCycles[offset];
+    totalSamples += profile.samples[offset];
+    opcodeCycles[(size_t)opcode] += profile.sampledCycles[offset];
+    opcodeSamples[(size_t)opcode] += profile.samples[offset];
+  }
+  output << fixed << setprecision(1);
+  output << total << " instructions executed, "
+         << cyclesPerExecution(profile, totalCycles, totalSamples)
+         << " cycles each on average (1 in " << PROFILE_SAMPLE_INTERVAL
+         << " timed, less " << profile.counterOverhead
+         << " cycles for reading the counter)" << endl;
+  if (source == nullptr) {
+    output << "The source is not known, so instructions are shown "
+              "disassembled."
+           << endl;
+  }
+
+  output << endl << "Opcodes" << endl;
+  output << setw(14) << "executions" << setw(8) << "share" << setw(9)
+         << "cycles"
+         << "  opcode" << endl;
+  vector<size_t> opcodes;
+  for (size_t opcode = 0; opcode < OPCODE_COUNT; opcode++) {
+    if (profile.opcodeExecutions[opcode] > 0) {
+      opcodes.push_back(opcode);
+    }
+  }
+  std::stable_sort(opcodes.begin(), opcodes.end(), [&](size_t a, size_t b) {
+    return profile.opcodeExecutions[a] > profile.opcodeExecutions[b];
+  });
+  for (size_t opcode : opcodes) {
+    output << setw(14) << profile.opcodeExecutions[opcode] << setw(7)
+           << share(profile.opcodeExecutions[opcode], total) << "%"
+           << setw(9)
+           << cyclesPerExecution(profile, opcodeCycles[opcode],
+                                 opcodeSamples[opcode])
+           << "  " << opcodeInfo((Opcode)opcode).name << endl;
+  }
+
+  output << endl << "Hottest instructions" << endl;
+  output << setw(8) << "offset" << setw(14) << "executions" << setw(8)
+         << "share" << setw(9) << "cycles"
+         << "  location  source" << endl;
+  vector<size_t> hottest = executed;
+  std::stable_sort(hottest.begin(), hottest.end(), [&](size_t a, size_t b) {
+    return profile.executions[a] > profile.executions[b];
+  });
+  if (hottest.size() > HOT_INSTRUCTION_ROWS) {
+    hottest.resize(HOT_INSTRUCTION_ROWS);
+  }
+  for (size_t offset : hottest) {
+    output << setw(8) << offset << setw(14) << profile.executions[offset]
+           << setw(7) << share(profile.executions[offset], total) << "%"
+           << setw(9)
+           << cyclesPerExecution(profile, profile.sampledCycles[offset],
+                                 profile.samples[offset])
+           << "  " << location(source, offset) << "  "
+           << sourceText(program, source, offset) << endl;
+  }
+
+  output << endl << "Conditional branches" << endl;
+  output << setw(8) << "offset" << setw(14) << "taken" << setw(14)
+         << "not taken" << setw(8) << "taken"
+         << "  location  source" << endl;
+  for (size_t offset : executed) {
+    if (!isConditionalBranch((Opcode)program.instructions[offset])) {
+      continue;
+    }
+    output << setw(8) << offset << setw(14) << profile.taken[offset]
+           << setw(14) << profile.notTaken[offset] << setw(7)
+           << share(profile.taken[offset], profile.executions[offset]) << "%"
+           << "  " << location(source, offset) << "  "
+           << sourceText(program, source, offset) << endl;
+  }
+
+  output << endl << "Commonest opcode pairs" << endl;
+  output << setw(14) << "executions" << setw(8) << "share"
+         << "  first, then second" << endl;
+  vector<pair<size_t, size_t>> pairs;
+  for (size_t first = 0; first < OPCODE_COUNT; first++) {
+    for (size_t second = 0; second < OPCODE_COUNT; second++) {
+      if (profile.opcodePairs[first][second] > 0) {
+        pairs.emplace_back(first, second);
+      }
+    }
+  }
+  std::stable_sort(pairs.begin(), pairs.end(),
+                   [&](const pair<size_t, size_t> &a,
+                       const pair<size_t, size_t> &b) {
+                     return profile.opcodePairs[a.first][a.second] >
+                            profile.opcodePairs[b.first][b.second];
+                   });
+  if (pairs.size() > OPCODE_PAIR_ROWS) {
+    pairs.resize(OPCODE_PAIR_ROWS);
+  }
+  for (const pair<size_t, size_t> &opcodes : pairs) {
+    uint64_t count = profile.opcodePairs[opcodes.first][opcodes.second];
+    output << setw(14) << count << setw(7) << share(count, total) << "%"
+           << "  " << opcodeInfo((Opcode)opcodes.first).name << ", "
+           << opcodeInfo((Opcode)opcodes.second).name << endl;
+  }
+}
+} // namespace bytecode
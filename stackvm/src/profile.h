@@ -0,0 +1,79 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include "assembler.h"
+#include "program.h"
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace bytecode {
+// The profiling engine times one instruction in this many, on average, with
+// the cycle counter. Timing every instruction would mostly measure the
+// counter.
+#define PROFILE_SAMPLE_INTERVAL 64
+
+// What the profiling engine saw. The per-instruction counts are indexed by
+// the byte offset of the instruction.
+struct Profile {
+  std::vector<uint64_t> executions;
+  // Conditional branches only.
+  std::vector<uint64_t> taken;
+  std::vector<uint64_t> notTaken;
+  // Cycles spent in the sampled executions, and how many there were.
+  std::vector<uint64_t> sampledCycles;
+  std::vector<uint64_t> samples;
+  uint64_t opcodeExecutions[OPCODE_COUNT];
+  // How often each opcode ran straight after another, indexed by the first
+  // and then the second.
+  uint64_t opcodePairs[OPCODE_COUNT][OPCODE_COUNT];
+  // What reading the cycle counter twice costs on its own, which the report
+  // takes off every timed execution.
+  uint64_t counterOverhead;
+
+  // Clears the counts for a program with this many bytes of instructions,
+  // and measures the counter overhead.
+  void reset(size_t instructionsSize);
+};
+
+// Time stamp counter ticks on x86, nanoseconds elsewhere.
+static inline uint64_t readCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// The assembly a program was built from.
+struct ProgramSource {
+  std::vector<std::string> lines;
+  SourceMap map;
+};
+
+// Reads the .vasm file at path and assembles it again to find where each
+// instruction came from. Returns false if it cannot be read or does not
+// assemble, optimized or not, to exactly the bytecode file in bytes.
+bool loadSource(const std::string &path, const void *bytes, size_t size,
+                ProgramSource &source);
+
+// Writes a report of where the program spent its time: executions and cycles
+// by opcode, the hottest instructions with their labels and source lines,
+// every conditional branch with how often it was taken, and the commonest
+// opcode pairs, which are the candidates for new superinstructions. source
+// may be null.
+void writeProfileReport(const Program &program, const Profile &profile,
+                        const ProgramSource *source, std::ostream &output);
+} // namespace bytecode
+
+#endif
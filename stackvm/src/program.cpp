@@ -0,0 +1,316 @@
+#include "program.h"
+#include "bytecode.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::vector;
+
+namespace bytecode {
+bool loadProgram(const void *data, size_t size, Program &program) {
+  if (size < sizeof(Header)) {
+    cerr << "This is not a bytecode file" << endl;
+    return false;
+  }
+  if ((uintptr_t)data % INSTRUCTIONS_ALIGNMENT != 0) {
+    cerr << "The program is not aligned in memory" << endl;
+    return false;
+  }
+  const Header *header = (const Header *)data;
+  if (header->magic != BYTECODE_MAGIC) {
+    cerr << "This is not a bytecode file" << endl;
+    return false;
+  }
+  if (header->version != CURRENT_BYTECODE_VERSION) {
+    cerr << "Get the right version of the interpreter" << endl;
+    return false;
+  }
+  // Every section must lie inside the file, after the header, in order and
+  // without overlapping the others.
+  uint64_t constantsEnd = (uint64_t)header->constantsOffset +
+                          (uint64_t)header->constantCount * sizeof(Constant);
+  uint64_t functionsEnd = (uint64_t)header->functionsOffset +
+                          (uint64_t)header->functionCount * sizeof(Function);
+  uint64_t instructionsEnd =
+      (uint64_t)header->instructionsOffset + header->instructionsSize;
+  if (header->constantsOffset % CONSTANTS_ALIGNMENT != 0 ||
+      header->functionsOffset % FUNCTIONS_ALIGNMENT != 0 ||
+      header->instructionsOffset % INSTRUCTIONS_ALIGNMENT != 0) {
+    cerr << "A section is misaligned" << endl;
+    return false;
+  }
+  if (header->constantsOffset < sizeof(Header) ||
+      header->functionsOffset < constantsEnd || constantsEnd > size) {
+    cerr << "The constant pool is truncated" << endl;
+    return false;
+  }
+  if (header->instructionsOffset < functionsEnd || functionsEnd > size) {
+    cerr << "The function table is truncated" << endl;
+    return false;
+  }
+  if (instructionsEnd > size) {
+    cerr << "The instructions are truncated" << endl;
+    return false;
+  }
+  if (header->heapSize > MAX_HEAP_SIZE) {
+    cerr << "The program asks for too large a heap" << endl;
+    return false;
+  }
+  const uint8_t *bytes = (const uint8_t *)data;
+  program.header = header;
+  program.constants = (const Constant *)(bytes + header->constantsOffset);
+  program.functions = (const Function *)(bytes + header->functionsOffset);
+  program.functionCount = header->functionCount;
+  program.instructions = bytes + header->instructionsOffset;
+  program.instructionsSize = header->instructionsSize;
+  return true;
+}
+
+using Kind = OperandKind;
+static const OpcodeInfo opcodeInfos[] = {
+    {"ipush_const", {Kind::CONSTANT}, 0, 1},
+    {"ipush_imm", {Kind::IMMEDIATE}, 0, 1},
+    {"dup", {}, 1, 2},
+    {"drop", {}, 1, 0},
+    {"add", {}, 2, 1},
+    {"iadd", {Kind::IMMEDIATE}, 1, 1},
+    {"sub", {}, 2, 1},
+    {"isub", {Kind::IMMEDIATE}, 1, 1},
+    {"mul", {}, 2, 1},
+    {"imul", {Kind::IMMEDIATE}, 1, 1},
+    {"div", {}, 2, 1},
+    {"idiv", {Kind::IMMEDIATE}, 1, 1},
+    {"lshift", {}, 2, 1},
+    {"ilshift", {Kind::IMMEDIATE}, 1, 1},
+    {"rshift", {}, 2, 1},
+    {"irshift", {Kind::IMMEDIATE}, 1, 1},
+    {"and", {}, 2, 1},
+    {"iand", {Kind::IMMEDIATE}, 1, 1},
+    {"or", {}, 2, 1},
+    {"ior", {Kind::IMMEDIATE}, 1, 1},
+    {"xor", {}, 2, 1},
+    {"ixor", {Kind::IMMEDIATE}, 1, 1},
+    {"lload", {Kind::LOCAL}, 0, 1},
+    {"lstore", {Kind::LOCAL}, 1, 0},
+    {"goto", {Kind::TARGET}, 0, 0},
+    {"cgoto_eq", {Kind::TARGET}, 2, 0},
+    {"cgoto_neq", {Kind::TARGET}, 2, 0},
+    {"cgoto_gt", {Kind::TARGET}, 2, 0},
+    {"cgoto_lt", {Kind::TARGET}, 2, 0},
+    {"exit", {}, 1, 0},
+    {"call", {Kind::FUNCTION}, 0, 1},
+    {"ret", {}, 1, 0},
+    {"hload", {}, 1, 1},
+    {"hstore", {}, 2, 0},
+    {"vadd", {}, 4, 0},
+    {"vmul", {}, 4, 0},
+    {"vand", {}, 4, 0},
+    {"vxor", {}, 4, 0},
+    {"vsum", {}, 2, 1},
+    {"vmin", {}, 2, 1},
+    {"vmax", {}, 2, 1},
+    {"vfill", {}, 3, 0},
+    {"vcopy", {}, 3, 0},
+    {"vcount_eq", {}, 3, 1},
+    {"linc", {Kind::LOCAL, Kind::IMMEDIATE}, 0, 0},
+    {"ladd", {Kind::LOCAL, Kind::LOCAL, Kind::LOCAL}, 0, 0},
+    {"cgoto_eq_imm", {Kind::IMMEDIATE, Kind::TARGET}, 1, 0},
+    {"cgoto_neq_imm", {Kind::IMMEDIATE, Kind::TARGET}, 1, 0},
+    {"cgoto_gt_imm", {Kind::IMMEDIATE, Kind::TARGET}, 1, 0},
+    {"cgoto_lt_imm", {Kind::IMMEDIATE, Kind::TARGET}, 1, 0},
+    {"lcgoto_eq_imm", {Kind::LOCAL, Kind::IMMEDIATE, Kind::TARGET}, 0, 0},
+    {"lcgoto_neq_imm", {Kind::LOCAL, Kind::IMMEDIATE, Kind::TARGET}, 0, 0},
+    {"lcgoto_gt_imm", {Kind::LOCAL, Kind::IMMEDIATE, Kind::TARGET}, 0, 0},
+    {"lcgoto_lt_imm", {Kind::LOCAL, Kind::IMMEDIATE, Kind::TARGET}, 0, 0},
+    {"lcgoto_eq_const", {Kind::LOCAL, Kind::CONSTANT, Kind::TARGET}, 0, 0},
+    {"lcgoto_neq_const", {Kind::LOCAL, Kind::CONSTANT, Kind::TARGET}, 0, 0},
+    {"lcgoto_gt_const", {Kind::LOCAL, Kind::CONSTANT, Kind::TARGET}, 0, 0},
+    {"lcgoto_lt_const", {Kind::LOCAL, Kind::CONSTANT, Kind::TARGET}, 0, 0}};
+static_assert(sizeof(opcodeInfos) / sizeof(opcodeInfos[0]) == OPCODE_COUNT,
+              "Every opcode needs an entry in opcodeInfos");
+
+const OpcodeInfo &opcodeInfo(Opcode opcode) {
+  return opcodeInfos[(size_t)opcode];
+}
+
+bool isConditionalBranch(Opcode opcode) {
+  if (opcode == Opcode::GOTO) {
+    return false;
+  }
+  for (OperandKind kind : opcodeInfo(opcode).operands) {
+    if (kind == OperandKind::TARGET) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool decodeInstruction(const Program &program, size_t offset,
+                       Instruction &instruction) {
+  if (offset >= program.instructionsSize) {
+    return false;
+  }
+  size_t position = offset;
+  bool wide = program.instructions[position] == (uint8_t)Opcode::WIDE;
+  if (wide) {
+    position++;
+  }
+  if (position >= program.instructionsSize ||
+      program.instructions[position] >= OPCODE_COUNT) {
+    return false;
+  }
+  instruction.offset = offset;
+  instruction.opcode = (Opcode)program.instructions[position++];
+  const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+  size_t size = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+  size_t operandCount = 0;
+  for (size_t i = 0; i < MAX_OPERANDS; i++) {
+    instruction.operands[i] = 0;
+    if (info.operands[i] == OperandKind::NONE) {
+      continue;
+    }
+    if (position + size > program.instructionsSize) {
+      return false;
+    }
+    const uint8_t *bytes = program.instructions + position;
+    position += size;
+    operandCount++;
+    if (wide) {
+      uint32_t operand;
+      memcpy(&operand, bytes, sizeof(operand));
+      if (info.operands[i] == OperandKind::IMMEDIATE) {
+        instruction.operands[i] = (int32_t)operand;
+      } else {
+        instruction.operands[i] = operand;
+      }
+    } else {
+      uint16_t operand;
+      memcpy(&operand, bytes, sizeof(operand));
+      if (info.operands[i] == OperandKind::IMMEDIATE) {
+        instruction.operands[i] = (int16_t)operand;
+      } else {
+        instruction.operands[i] = operand;
+      }
+    }
+  }
+  // A prefix on an instruction without operands means nothing.
+  if (wide && operandCount == 0) {
+    return false;
+  }
+  instruction.length = position - offset;
+  return true;
+}
+
+// Whether every operand of instruction fits in the 16 bit encoding.
+static bool fitsNarrow(const Instruction &instruction) {
+  const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+  for (size_t i = 0; i < MAX_OPERANDS; i++) {
+    int64_t operand = instruction.operands[i];
+    switch (info.operands[i]) {
+    case OperandKind::NONE:
+      break;
+    case OperandKind::IMMEDIATE:
+      if (operand < INT16_MIN || operand > INT16_MAX) {
+        return false;
+      }
+      break;
+    default:
+      if (operand < 0 || operand > UINT16_MAX) {
+        return false;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+void encodeInstruction(const Instruction &instruction,
+                       vector<uint8_t> &output) {
+  bool wide = !fitsNarrow(instruction);
+  if (wide) {
+    output.push_back((uint8_t)Opcode::WIDE);
+  }
+  output.push_back((uint8_t)instruction.opcode);
+  const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+  for (size_t i = 0; i < MAX_OPERANDS; i++) {
+    if (info.operands[i] == OperandKind::NONE) {
+      continue;
+    }
+    if (wide) {
+      uint32_t operand = (uint32_t)instruction.operands[i];
+      const uint8_t *bytes = (const uint8_t *)&operand;
+      output.insert(output.end(), bytes, bytes + sizeof(operand));
+    } else {
+      uint16_t operand = (uint16_t)instruction.operands[i];
+      const uint8_t *bytes = (const uint8_t *)&operand;
+      output.insert(output.end(), bytes, bytes + sizeof(operand));
+    }
+  }
+}
+
+size_t encodedLength(const Instruction &instruction) {
+  bool wide = !fitsNarrow(instruction);
+  const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+  size_t length = wide ? 2 : 1;
+  for (size_t i = 0; i < MAX_OPERANDS; i++) {
+    if (info.operands[i] != OperandKind::NONE) {
+      length += wide ? sizeof(uint32_t) : sizeof(uint16_t);
+    }
+  }
+  return length;
+}
+
+// code[index] with its branch target turned from an index into an offset.
+static Instruction placed(const vector<Instruction> &code, size_t index,
+                          const vector<size_t> &offsets) {
+  Instruction instruction = code[index];
+  const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+  for (size_t i = 0; i < MAX_OPERANDS; i++) {
+    if (info.operands[i] == OperandKind::TARGET) {
+      instruction.operands[i] = offsets[instruction.operands[i]];
+    }
+  }
+  return instruction;
+}
+
+void layOutInstructions(const vector<Instruction> &code,
+                        vector<uint8_t> &output, vector<size_t> &offsets) {
+  // Start with every instruction narrow. Offsets only grow from one round
+  // to the next, so an instruction that needed the prefix keeps needing it,
+  // and the rounds end.
+  vector<size_t> lengths(code.size());
+  for (size_t i = 0; i < code.size(); i++) {
+    Instruction instruction = code[i];
+    const OpcodeInfo &info = opcodeInfo(instruction.opcode);
+    for (size_t j = 0; j < MAX_OPERANDS; j++) {
+      if (info.operands[j] == OperandKind::TARGET) {
+        instruction.operands[j] = 0;
+      }
+    }
+    lengths[i] = encodedLength(instruction);
+  }
+  offsets.assign(code.size() + 1, 0);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < code.size(); i++) {
+      offsets[i + 1] = offsets[i] + lengths[i];
+    }
+    for (size_t i = 0; i < code.size(); i++) {
+      size_t length = encodedLength(placed(code, i, offsets));
+      if (length != lengths[i]) {
+        lengths[i] = length;
+        changed = true;
+      }
+    }
+  }
+  output.clear();
+  for (size_t i = 0; i < code.size(); i++) {
+    encodeInstruction(placed(code, i, offsets), output);
+  }
+}
+} // namespace bytecode
@@ -0,0 +1,106 @@
+#ifndef _PROGRAM_H
+#define _PROGRAM_H
+
+#include "bytecode.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace bytecode {
+// Limits of the machine. Programs that could exceed them are rejected by
+// verifyProgram. STACK_SIZE limits the operand stack of the main program and
+// of each function on its own.
+#define STACK_SIZE 256
+#define MAX_LOCALS 256
+// Limits on calls, which the engines check as functions are called: how deep
+// calls can nest, the operand stack shared by every active function, and the
+// locals of every active function after the main program's.
+#define MAX_CALL_DEPTH 1024
+#define OPERAND_STACK_SIZE 4096
+#define FRAME_LOCALS_SIZE 16384
+// The largest heap a program can ask for, in words (128 MB).
+#define MAX_HEAP_SIZE (1 << 24)
+
+// A bytecode file split into its sections. The pointers refer into the
+// buffer the program was loaded from, which is never written to, so it can be
+// a read-only mapping of the file.
+struct Program {
+  const Header *header;
+  const Constant *constants;
+  const Function *functions;
+  size_t functionCount;
+  const uint8_t *instructions;
+  size_t instructionsSize;
+};
+
+// Checks the header of a bytecode file and splits it into sections, in place.
+// data must be aligned to INSTRUCTIONS_ALIGNMENT. Reports the problem on cerr
+// and returns false if the file is not usable.
+bool loadProgram(const void *data, size_t size, Program &program);
+
+// Operands are 16 bits wide, or 32 bits after the WIDE prefix.
+enum class OperandKind : uint8_t {
+  NONE,
+  // Signed immediate value
+  IMMEDIATE,
+  // Index into the constant pool
+  CONSTANT,
+  // Index of a local
+  LOCAL,
+  // Offset of an instruction
+  TARGET,
+  // Index into the function table
+  FUNCTION
+};
+
+#define MAX_OPERANDS 3
+struct OpcodeInfo {
+  const char *name;
+  OperandKind operands[MAX_OPERANDS];
+  // How many values the instruction takes off the operand stack, and how
+  // many it then puts back. CALL takes its function's arguments as well.
+  uint8_t pops;
+  uint8_t pushes;
+};
+
+#define COUNT_OPCODE(opcode) +1
+constexpr size_t OPCODE_COUNT = 0 FOR_EACH_OPCODE(COUNT_OPCODE);
+#undef COUNT_OPCODE
+
+const OpcodeInfo &opcodeInfo(Opcode opcode);
+// Whether opcode branches only some of the time, falling through otherwise.
+bool isConditionalBranch(Opcode opcode);
+
+// One instruction decoded from the instruction stream. opcode is never WIDE:
+// a prefixed instruction decodes to the instruction it prefixes, with the
+// prefix counted in its length.
+struct Instruction {
+  size_t offset;
+  size_t length;
+  Opcode opcode;
+  int64_t operands[MAX_OPERANDS];
+};
+
+// Decodes the instruction at offset. Returns false if there is no valid
+// instruction there.
+bool decodeInstruction(const Program &program, size_t offset,
+                       Instruction &instruction);
+// Appends the bytecode for instruction to output, with the WIDE prefix if an
+// operand does not fit in 16 bits. Operands are truncated to 32 bits.
+void encodeInstruction(const Instruction &instruction,
+                       std::vector<uint8_t> &output);
+// The number of bytes encodeInstruction writes for instruction.
+size_t encodedLength(const Instruction &instruction);
+// Encodes code into output, replacing what it held. Every TARGET operand in
+// code holds the index in code of the instruction it branches to
+// (code.size() for the end of the stream) and is written as that
+// instruction's offset. Widening one instruction moves the ones after it,
+// which may push more targets out of 16 bits, so the layout is repeated until
+// no more instructions need the prefix. Fills offsets with the offset of
+// every instruction, then the size of the stream.
+void layOutInstructions(const std::vector<Instruction> &code,
+                        std::vector<uint8_t> &output,
+                        std::vector<size_t> &offsets);
+} // namespace bytecode
+
+#endif
@@ -1,255 +1,1294 @@
 #include "run.h"
+#include "arena.h"
 #include "bytecode.h"
+#include "fuse.h"
+#include "heap.h"
+#include "jit.h"
+#include "mappedfile.h"
+#include "predecode.h"
+#include "profile.h"
+#include "program.h"
+#include "verify.h"
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 using std::cerr;
 using std::cout;
 using std::endl;
 using std::istream;
+using std::vector;
 
-#define STACK_SIZE 256
-#define MAX_LOCALS 256
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define HAVE_THREADED_DISPATCH
+#endif
 
 namespace bytecode {
+// What the engines need to know to call a function.
+struct FunctionInfo {
+  // Offset of the first instruction, in the instructions the engine runs.
+  size_t entry;
+  uint16_t argumentCount;
+  uint16_t localCount;
+  // The deepest the function's own operand stack gets.
+  size_t stackDepth;
+};
+
+// The state a CALL saves for the matching RET.
+struct Frame {
+  // Where to continue in the caller, in the form the engine uses for branch
+  // targets.
+  uintptr_t returnAddress;
+  Constant *locals;
+};
+
+// How much room a Vm has for the operand stack, calls and their locals,
+// after the main program's MAX_LOCALS locals.
+struct StackLimits {
+  size_t stackSize;
+  size_t callDepth;
+  size_t frameLocals;
+};
+
+// A program without functions never calls, so its operand stack only gets as
+// deep as the verifier found, and it needs no frames or locals for them. How
+// deep calls nest is only known as they run, so a program with functions
+// gets the fixed limits, which CALL checks.
+static StackLimits stackLimits(const Program &program,
+                               const ProgramInfo &info) {
+  if (program.functionCount == 0) {
+    return {info.maxStackDepth, 0, 0};
+  }
+  return {OPERAND_STACK_SIZE, MAX_CALL_DEPTH, FRAME_LOCALS_SIZE};
+}
+
+// The heap as the engines see it.
+struct HeapWords {
+  Constant *words;
+  size_t count;
+  Constant *data() const { return words; }
+  size_t size() const { return count; }
+  Constant &operator[](size_t index) const { return words[index]; }
+};
+
+// The engines check nothing about the program as they run it: no stack
+// bounds, local or constant indices, or branch targets. run() only hands them
+// programs that verifyProgram has accepted. The verifier cannot bound how
+// deep calls nest, so CALL checks that there is room for the callee's frame,
+// locals and operand stack, and heap addresses are only known as the program
+// runs, so the heap instructions check them.
+//
+// A metered engine that runs out of fuel saves where it stopped here, so
+// that the next run continues there: ip, the operand stack, and the calls.
+// A fresh run starts with them all zero.
 struct VmContext {
-  uint8_t *instructions;
+  const uint8_t *instructions;
+  // An offset in the instructions, or the index of a record for the engines
+  // that run the pre-decoded program.
   size_t ip;
-  Constant stack[STACK_SIZE];
+  // Whether ip and the return addresses in frames are in records rather
+  // than bytes. Only a tiered module changes which, as a program runs.
+  bool decoded;
+  // How many more branches taken, calls and returns a tiered module runs
+  // in the bytecode before it moves the program over to the records.
+  uint64_t warmup;
+  const FunctionInfo *functions;
+  // The stacks and the heap, in areas of the arena, each sized to limits.
+  Arena arena;
+  StackLimits limits;
+  // limits.stackSize + 1 values. stack[0] is spare, so an engine that caches
+  // the top of the stack has somewhere to spill its (meaningless) cached
+  // value when the stack is empty. The stack itself starts at stack[1].
+  Constant *stack;
   size_t stackPointer;
-  Constant locals[MAX_LOCALS];
+  // The main program's MAX_LOCALS locals, followed by limits.frameLocals for
+  // those of each active function.
+  Constant *locals;
+  // limits.callDepth of them.
+  Frame *frames;
+  // How many calls are active, where the running locals start in locals,
+  // and where the locals of every active function end, past the main
+  // program's.
+  size_t callDepth;
+  size_t runningLocals;
+  size_t frameLocalsEnd;
+  // How many more branches taken, calls and returns the metered engines may
+  // make before they stop with OUT_OF_FUEL.
+  uint64_t fuel;
+  // As many words as the program's header asks for.
+  HeapWords heap;
+  Constant result;
+  // Instructions run so far, kept only by the counting engine.
+  uint64_t executed;
+
+  // Reserves the arena, with stacks to limits and a heap of heapSize words.
+  // The areas start zeroed, as does every other member.
+  VmContext(const StackLimits &limits, size_t heapSize);
 };
-template <typename T> static inline T readInstruction(VmContext &vm) {
-  T &result = *((T *)(vm.instructions + vm.ip));
-  vm.ip += sizeof(T);
-  return result;
-}
-static inline void push(VmContext &vm, Constant value) {
-  vm.stack[vm.stackPointer++] = value;
+
+// The stacks are reserved at their limits, as only the pages a program
+// reaches are ever backed, and the guards make an engine that runs past one
+// fault on the spot rather than overwrite its neighbour. The engines run
+// inside Arena::guarded(), so such a fault stops the program with
+// STACK_OVERFLOW. CALL still checks the limits itself: dropping the check to
+// rely on the guards alone saves two compares a call but upsets how the
+// compiler lays out the engines, which costs far more.
+VmContext::VmContext(const StackLimits &limits, size_t heapSize)
+    : instructions(nullptr), ip(0), decoded(false), warmup(0),
+      functions(nullptr), limits(limits), stackPointer(0),
+      callDepth(0), runningLocals(0), frameLocalsEnd(0), fuel(0), result(0),
+      executed(0) {
+  ArenaArea areas[] = {
+      {(limits.stackSize + 1) * sizeof(Constant), 1, nullptr},
+      {(MAX_LOCALS + limits.frameLocals) * sizeof(Constant), 1, nullptr},
+      {limits.callDepth * sizeof(Frame), 1, nullptr},
+      {heapSize * sizeof(Constant), 1, nullptr}};
+  arena.reserve(areas, 4);
+  stack = (Constant *)areas[0].start;
+  locals = (Constant *)areas[1].start;
+  frames = (Frame *)areas[2].start;
+  heap.words = (Constant *)areas[3].start;
+  heap.count = heapSize;
 }
-static inline Constant pop(VmContext &vm) {
-  return vm.stack[--vm.stackPointer];
+
+template <typename T> static inline T readInstruction(const uint8_t *&ip) {
+  const T &result = *((const T *)ip);
+  ip += sizeof(T);
+  return result;
 }
 
-void run(void *program, size_t) {
-  Header *header = (Header *)program;
-  if (header->magic != BYTECODE_MAGIC) {
-    cerr << "This is not a bytecode file" << endl;
-    return;
+// The operand stack as seen by an engine. With CacheTop, the top of the
+// stack lives in a local rather than in memory, so the compiler can keep it
+// in a register. Every opcode then follows the same rules: pushing spills the
+// cached value to memory, popping refills it from memory, and an operation
+// that replaces the top (ADD, IADD, ...) touches memory only for its other
+// operand. DUP spills and keeps the cached value, DROP and the CGOTO_* family
+// refill it, and EXIT takes it as the result.
+template <bool CacheTop> struct OperandStack;
+
+template <> struct OperandStack<false> {
+  Constant *sp;
+  OperandStack(VmContext &context)
+      : sp(context.stack + 1 + context.stackPointer) {}
+  inline void push(Constant value) { *sp++ = value; }
+  inline Constant pop() { return *--sp; }
+  inline Constant &top() { return sp[-1]; }
+  // How many more values fit below limit, the end of the stack.
+  inline size_t room(const Constant *limit) const { return limit - sp; }
+  inline void save(VmContext &context) {
+    context.stackPointer = sp - (context.stack + 1);
   }
-  if (header->version != CURRENT_BYTECODE_VERSION) {
-    cerr << "Get the right version of the interpreter" << endl;
-    return;
+};
+
+template <> struct OperandStack<true> {
+  // Points just past the values that are in memory, which are all but the
+  // cached top.
+  Constant *sp;
+  Constant cached;
+  OperandStack(VmContext &context)
+      : sp(context.stack + context.stackPointer), cached(*sp) {}
+  inline void push(Constant value) {
+    *sp++ = cached;
+    cached = value;
+  }
+  inline Constant pop() {
+    Constant value = cached;
+    cached = *--sp;
+    return value;
+  }
+  inline Constant &top() { return cached; }
+  // sp is one below where it is without the cache, as the top value is not
+  // in memory, but that value still needs its place when it is spilled.
+  inline size_t room(const Constant *limit) const { return limit - sp - 1; }
+  inline void save(VmContext &context) {
+    *sp = cached;
+    context.stackPointer = sp - context.stack;
+  }
+};
+
+// The active calls as seen by an engine, as the context left them.
+struct CallStack {
+  Frame *frame;
+  Frame *const framesEnd;
+  // Just past the locals of the running function.
+  Constant *localsEnd;
+  Constant *const localsLimit;
+  Constant *const stackLimit;
+  CallStack(VmContext &context)
+      : frame(context.frames + context.callDepth),
+        framesEnd(context.frames + context.limits.callDepth),
+        localsEnd(context.locals + MAX_LOCALS + context.frameLocalsEnd),
+        localsLimit(context.locals + MAX_LOCALS + context.limits.frameLocals),
+        stackLimit(context.stack + context.limits.stackSize + 1) {}
+};
+
+// Saves where a metered engine stopped for want of fuel, with ip the
+// instruction to continue at, and returns OUT_OF_FUEL.
+template <typename Stack>
+static Status suspend(VmContext &context, Stack &stack,
+                      const CallStack &calls, const Constant *locals,
+                      size_t ip) {
+  context.ip = ip;
+  stack.save(context);
+  context.callDepth = calls.frame - context.frames;
+  context.runningLocals = locals - context.locals;
+  context.frameLocalsEnd = calls.localsEnd - (context.locals + MAX_LOCALS);
+  context.fuel = 0;
+  return Status::OUT_OF_FUEL;
+}
+
+// Stack access for the handlers in handlers.inc.
+#define PUSH(value) stack.push(value)
+#define POP() stack.pop()
+#define TOP() stack.top()
+#define STACK_ROOM() stack.room(calls.stackLimit)
+#define RESULT() context.result
+
+// Engines that run the bytecode as it is stored in the file. They include
+// the handlers a second time for instructions with the WIDE prefix, in a
+// scope where Immediate and Index are redefined to the 32 bit operand types,
+// so the narrow handlers read their operands as fast as ever.
+using Immediate = int16_t;
+using Index = uint16_t;
+#define IMMEDIATE() ((Constant)readInstruction<Immediate>(ip))
+#define CONSTANT() (constants[readInstruction<Index>(ip)])
+#define LOCAL(position) readInstruction<Index>(ip)
+#define TARGET() readInstruction<Index>(ip)
+#define FUNCTION() readInstruction<Index>(ip)
+#define CALL_TARGET(function) (functions[function].entry)
+#define RETURN_ADDRESS() ((uintptr_t)(ip - instructions))
+#define RETURN_TARGET(address) ((size_t)(address))
+
+// With Metered, every branch taken, call and return uses up a unit of fuel,
+// and the engine suspends when there is none left. With Count, also counts
+// every instruction into context.executed.
+template <bool CacheTop, bool Metered = false, bool Count = false>
+static Status runSwitch(VmContext &context, const Constant *constants) {
+  const uint8_t *instructions = context.instructions;
+  const uint8_t *ip = instructions + context.ip;
+  uint64_t fuel = context.fuel;
+  OperandStack<CacheTop> stack(context);
+  Constant *locals = context.locals + context.runningLocals;
+  // Reached through the context rather than copied into locals, to leave
+  // the registers to the instructions that run most.
+  HeapWords &heap = context.heap;
+  const FunctionInfo *functions = context.functions;
+  CallStack calls(context);
+#define HANDLER(opcode) case Opcode::opcode:
+#define NEXT() break
+#define JUMP(target)                                                           \
+  {                                                                            \
+    ip = instructions + (target);                                              \
+    if (Metered && --fuel == 0) {                                              \
+      return suspend(context, stack, calls, locals, ip - instructions);        \
+    }                                                                          \
+    break;                                                                     \
   }
-  Constant *constants = (Constant *)((uint8_t *)program + sizeof(Header));
-  uint8_t *instructions = (uint8_t *)(constants + header->constantCount);
-  VmContext context;
-  context.instructions = instructions;
-  context.ip = 0;
-  context.stackPointer = 0;
   while (true) {
-    Opcode opcode = readInstruction<Opcode>(context);
+    if (Count) {
+      context.executed++;
+    }
+    Opcode opcode = readInstruction<Opcode>(ip);
     switch (opcode) {
-    case Opcode::IPUSH_CONST: {
-      uint16_t index = readInstruction<uint16_t>(context);
-      push(context, constants[index]);
-      break;
-    }
-    case Opcode::IPUSH_IMM: {
-      int16_t immediate = readInstruction<int16_t>(context);
-      push(context, immediate);
-      break;
-    }
-    case Opcode::DUP: {
-      Constant value = pop(context);
-      push(context, value);
-      push(context, value);
-      break;
-    }
-    case Opcode::DROP: {
-      pop(context);
-      break;
-    }
-    case Opcode::ADD: {
-      Constant right = pop(context);
-      Constant left = pop(context);
-      push(context, left + right);
-      break;
-    }
-    case Opcode::IADD: {
-      int16_t right = readInstruction<int16_t>(context);
-      Constant left = pop(context);
-      push(context, left + right);
-      break;
-    }
-    case Opcode::SUB: {
-      Constant right = pop(context);
-      Constant left = pop(context);
-      push(context, left - right);
-      break;
-    }
-    case Opcode::ISUB: {
-      int16_t right = readInstruction<int16_t>(context);
-      Constant left = pop(context);
-      push(context, left - right);
-      break;
-    }
-    case Opcode::MUL: {
-      Constant right = pop(context);
-      Constant left = pop(context);
-      push(context, left * right);
-      break;
-    }
-    case Opcode::IMUL: {
-      int16_t right = readInstruction<int16_t>(context);
-      Constant left = pop(context);
-      push(context, left * right);
-      break;
-    }
-    case Opcode::DIV: {
-      Constant right = pop(context);
-      Constant left = pop(context);
-      if (right != 0) {
-        push(context, left / right);
-      } else {
-        cerr << "Divide by zero" << endl;
-        return;
+#include "handlers.inc"
+    case Opcode::WIDE:
+      goto wide;
+    default:
+      return Status::UNKNOWN_INSTRUCTION;
+    }
+    continue;
+    // Prefixed instructions are handled apart from the switch, which keeps
+    // the code the compiler generates for the narrow handlers as it was.
+  wide: {
+    using Immediate = int32_t;
+    using Index = uint32_t;
+    switch (readInstruction<Opcode>(ip)) {
+#include "handlers.inc"
+    default:
+      return Status::UNKNOWN_INSTRUCTION;
+    }
+  }
+  }
+#undef HANDLER
+#undef NEXT
+#undef JUMP
+}
+
+#ifdef PROFILE
+// The switch engine, counting everything it runs into profile. It runs the
+// program as it is stored, without fusing it, so the counts refer to the
+// instructions in the file.
+static Status runProfiled(VmContext &context, const Constant *constants,
+                          Profile &profile) {
+  const uint8_t *instructions = context.instructions;
+  const uint8_t *ip = instructions + context.ip;
+  OperandStack<false> stack(context);
+  Constant *locals = context.locals + context.runningLocals;
+  HeapWords &heap = context.heap;
+  const FunctionInfo *functions = context.functions;
+  CallStack calls(context);
+  size_t previousOpcode = OPCODE_COUNT;
+  uint32_t random = 1;
+  uint64_t untilSample = PROFILE_SAMPLE_INTERVAL;
+#define HANDLER(opcode) case Opcode::opcode:
+#define NEXT() break
+#define JUMP(target)                                                           \
+  {                                                                            \
+    ip = instructions + (target);                                              \
+    jumped = true;                                                             \
+    break;                                                                     \
+  }
+  while (true) {
+    size_t offset = ip - instructions;
+    Opcode opcode = readInstruction<Opcode>(ip);
+    // A prefixed instruction counts as the instruction it prefixes.
+    bool wide = opcode == Opcode::WIDE;
+    if (wide) {
+      opcode = readInstruction<Opcode>(ip);
+    }
+    if ((size_t)opcode >= OPCODE_COUNT) {
+      return Status::UNKNOWN_INSTRUCTION;
+    }
+    profile.executions[offset]++;
+    profile.opcodeExecutions[(size_t)opcode]++;
+    if (previousOpcode < OPCODE_COUNT) {
+      profile.opcodePairs[previousOpcode][(size_t)opcode]++;
+    }
+    previousOpcode = (size_t)opcode;
+    bool jumped = false;
+    bool sampled = --untilSample == 0;
+    uint64_t start = sampled ? readCycleCounter() : 0;
+    if (!wide) {
+      switch (opcode) {
+#include "handlers.inc"
+      default:
+        return Status::UNKNOWN_INSTRUCTION;
       }
-      break;
-    }
-    case Opcode::IDIV: {
-      int16_t right = readInstruction<int16_t>(context);
-      Constant left = pop(context);
-      if (right != 0) {
-        push(context, left / right);
-      }else {
-        cerr << "Divide by zero" << endl;
-        return;
+    } else {
+      using Immediate = int32_t;
+      using Index = uint32_t;
+      switch (opcode) {
+#include "handlers.inc"
+      default:
+        return Status::UNKNOWN_INSTRUCTION;
       }
-      break;
-    }
-    case Opcode::LSHIFT: {
-      Constant right = pop(context);
-      Constant left = pop(context);
-      push(context, left << right);
-      break;
-    }
-    case Opcode::ILSHIFT: {
-      int16_t right = readInstruction<int16_t>(context);
-      Constant left = pop(context);
-      push(context, left << right);
-      break;
-    }
-    case Opcode::RSHIFT: {
-      Constant right = pop(context);
-      Constant left = pop(context);
-      push(context, left >> right);
-      break;
-    }
-    case Opcode::IRSHIFT: {
-      int16_t right = readInstruction<int16_t>(context);
-      Constant left = pop(context);
-      push(context, left >> right);
-      break;
-    }
-    case Opcode::AND: {
-      Constant right = pop(context);
-      Constant left = pop(context);
-      push(context, left & right);
-      break;
-    }
-    case Opcode::IAND: {
-      int16_t right = readInstruction<int16_t>(context);
-      Constant left = pop(context);
-      push(context, left & right);
-      break;
-    }
-    case Opcode::OR: {
-      Constant right = pop(context);
-      Constant left = pop(context);
-      push(context, left | right);
-      break;
-    }
-    case Opcode::IOR: {
-      int16_t right = readInstruction<int16_t>(context);
-      Constant left = pop(context);
-      push(context, left | right);
-      break;
-    }
-    case Opcode::XOR: {
-      Constant right = pop(context);
-      Constant left = pop(context);
-      push(context, left ^ right);
-      break;
-    }
-    case Opcode::IXOR: {
-      int16_t right = readInstruction<int16_t>(context);
-      Constant left = pop(context);
-      push(context, left ^ right);
-      break;
-    }
-    case Opcode::LLOAD: {
-      uint16_t index = readInstruction<uint16_t>(context);
-      push(context, context.locals[index]);
-      break;
-    }
-    case Opcode::LSTORE: {
-      uint16_t index = readInstruction<uint16_t>(context);
-      context.locals[index] = pop(context);
-      break;
-    }
-    case Opcode::GOTO: {
-      uint16_t offset = readInstruction<uint16_t>(context);
-      context.ip = offset;
-      break;
-    }
-    case Opcode::CGOTO_EQ: {
-      uint16_t offset = readInstruction<uint16_t>(context);
-      Constant right = pop(context);
-      Constant left = pop(context);
-      if (left == right) {
-        context.ip = offset;
+    }
+    if (sampled) {
+      profile.sampledCycles[offset] += readCycleCounter() - start;
+      profile.samples[offset]++;
+      // A fixed interval would keep timing the same few instructions of a
+      // loop whose length divides it, so vary it around the average with
+      // xorshift.
+      random ^= random << 13;
+      random ^= random >> 17;
+      random ^= random << 5;
+      untilSample = 1 + random % (2 * PROFILE_SAMPLE_INTERVAL - 1);
+    }
+    if (isConditionalBranch(opcode)) {
+      if (jumped) {
+        profile.taken[offset]++;
+      } else {
+        profile.notTaken[offset]++;
       }
-      break;
-    }
-    case Opcode::CGOTO_NEQ: {
-      uint16_t offset = readInstruction<uint16_t>(context);
-      Constant right = pop(context);
-      Constant left = pop(context);
-      if (left != right) {
-        context.ip = offset;
+    }
+  }
+#undef HANDLER
+#undef NEXT
+#undef JUMP
+}
+#endif
+
+#ifdef HAVE_THREADED_DISPATCH
+// Labels as values are a GNU extension.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+template <bool CacheTop, bool Metered>
+static Status runThreaded(VmContext &context, const Constant *constants) {
+  const uint8_t *instructions = context.instructions;
+  const uint8_t *ip = instructions + context.ip;
+  uint64_t fuel = context.fuel;
+  OperandStack<CacheTop> stack(context);
+  Constant *locals = context.locals + context.runningLocals;
+  HeapWords &heap = context.heap;
+  const FunctionInfo *functions = context.functions;
+  CallStack calls(context);
+  const void *dispatchTable[256];
+  for (const void *&handler : dispatchTable) {
+    handler = &&unknown;
+  }
+  const void *wideDispatchTable[256];
+  for (const void *&handler : wideDispatchTable) {
+    handler = &&unknown;
+  }
+#define SET_HANDLER(opcode)                                                    \
+  dispatchTable[(uint8_t)Opcode::opcode] = &&opcode;                           \
+  wideDispatchTable[(uint8_t)Opcode::opcode] = &&WIDE_##opcode;
+  FOR_EACH_OPCODE(SET_HANDLER)
+#undef SET_HANDLER
+  dispatchTable[(uint8_t)Opcode::WIDE] = &&wide;
+#define HANDLER(opcode) opcode:
+#define NEXT() goto *dispatchTable[readInstruction<uint8_t>(ip)]
+#define JUMP(target)                                                           \
+  {                                                                            \
+    ip = instructions + (target);                                              \
+    if (Metered && --fuel == 0) {                                              \
+      return suspend(context, stack, calls, locals, ip - instructions);        \
+    }                                                                          \
+    NEXT();                                                                    \
+  }
+  NEXT();
+#include "handlers.inc"
+wide:
+  goto *wideDispatchTable[readInstruction<uint8_t>(ip)];
+  {
+    using Immediate = int32_t;
+    using Index = uint32_t;
+#undef HANDLER
+#define HANDLER(opcode) WIDE_##opcode:
+#include "handlers.inc"
+  }
+unknown:
+  return Status::UNKNOWN_INSTRUCTION;
+#undef HANDLER
+#undef NEXT
+#undef JUMP
+}
+#pragma GCC diagnostic pop
+#endif
+
+#undef IMMEDIATE
+#undef CONSTANT
+#undef LOCAL
+#undef TARGET
+#undef FUNCTION
+#undef CALL_TARGET
+#undef RETURN_ADDRESS
+#undef RETURN_TARGET
+
+// Engines that run the pre-decoded form of the program. ip points at the
+// record of the instruction being run.
+#define IMMEDIATE() (ip->value)
+#define CONSTANT() (ip->value)
+#define LOCAL(position) (ip->locals[position])
+#define TARGET() (ip->target)
+#define FUNCTION() (ip->value)
+#define CALL_TARGET(function) (ip->target)
+#define RETURN_ADDRESS() ((uintptr_t)(ip + 1))
+#define RETURN_TARGET(address) ((DecodedInstruction *)(address))
+
+template <bool CacheTop, bool Metered>
+static Status runDecodedSwitch(VmContext &context, DecodedProgram &program) {
+  DecodedInstruction *const records = program.instructions.data();
+  DecodedInstruction *ip = records + context.ip;
+  uint64_t fuel = context.fuel;
+  OperandStack<CacheTop> stack(context);
+  Constant *locals = context.locals + context.runningLocals;
+  HeapWords &heap = context.heap;
+  const FunctionInfo *functions = context.functions;
+  CallStack calls(context);
+#define HANDLER(opcode) case Opcode::opcode:
+#define NEXT()                                                                 \
+  {                                                                            \
+    ip++;                                                                      \
+    break;                                                                     \
+  }
+#define JUMP(target)                                                           \
+  {                                                                            \
+    ip = (target);                                                             \
+    if (Metered && --fuel == 0) {                                              \
+      return suspend(context, stack, calls, locals, ip - records);             \
+    }                                                                          \
+    break;                                                                     \
+  }
+  while (true) {
+    switch (ip->opcode) {
+#include "handlers.inc"
+    default: // END_OF_PROGRAM
+      return Status::END_OF_PROGRAM;
+    }
+  }
+#undef HANDLER
+#undef NEXT
+#undef JUMP
+}
+
+#ifdef HAVE_THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+// Called with a null context, this fills in the handler of every record in
+// program and returns without running anything. Records linked by one
+// instantiation can only be run by the same instantiation.
+template <bool CacheTop, bool Metered>
+static Status runDecodedThreaded(VmContext *context,
+                                 DecodedProgram &program) {
+  if (context == nullptr) {
+#define HANDLER_ADDRESS(opcode) &&opcode,
+    static const void *const handlers[] = {FOR_EACH_OPCODE(HANDLER_ADDRESS)};
+#undef HANDLER_ADDRESS
+    for (DecodedInstruction &instruction : program.instructions) {
+      if (instruction.opcode == END_OF_PROGRAM) {
+        instruction.handler = &&end;
+      } else {
+        instruction.handler = handlers[(size_t)instruction.opcode];
       }
-      break;
-    }
-    case Opcode::CGOTO_GT: {
-      uint16_t offset = readInstruction<uint16_t>(context);
-      Constant right = pop(context);
-      Constant left = pop(context);
-      if (left > right) {
-        context.ip = offset;
+    }
+    return Status::FINISHED;
+  }
+  DecodedInstruction *const records = program.instructions.data();
+  DecodedInstruction *ip = records + context->ip;
+  uint64_t fuel = context->fuel;
+  OperandStack<CacheTop> stack(*context);
+  Constant *locals = context->locals + context->runningLocals;
+  HeapWords &heap = context->heap;
+  const FunctionInfo *functions = context->functions;
+  CallStack calls(*context);
+#undef RESULT
+#define RESULT() context->result
+#define HANDLER(opcode) opcode:
+#define NEXT() goto *(++ip)->handler
+#define JUMP(target)                                                           \
+  {                                                                            \
+    ip = (target);                                                             \
+    if (Metered && --fuel == 0) {                                              \
+      return suspend(*context, stack, calls, locals, ip - records);            \
+    }                                                                          \
+    goto *ip->handler;                                                         \
+  }
+  goto *ip->handler;
+#include "handlers.inc"
+end:
+  return Status::END_OF_PROGRAM;
+#undef HANDLER
+#undef NEXT
+#undef JUMP
+#undef RESULT
+#define RESULT() context.result
+}
+#pragma GCC diagnostic pop
+#endif
+
+#undef IMMEDIATE
+#undef CONSTANT
+#undef LOCAL
+#undef TARGET
+#undef FUNCTION
+#undef CALL_TARGET
+#undef RETURN_ADDRESS
+#undef RETURN_TARGET
+
+bool threadedDispatchAvailable() {
+#ifdef HAVE_THREADED_DISPATCH
+  return true;
+#else
+  return false;
+#endif
+}
+
+RunOptions defaultRunOptions() {
+  RunOptions options;
+  options.dispatch =
+      threadedDispatchAvailable() ? Dispatch::THREADED : Dispatch::SWITCH;
+  options.predecode = true;
+  options.tiered = true;
+  options.fuse = true;
+  options.cacheTop = false;
+  options.jit = false;
+  options.metered = false;
+  return options;
+}
+
+const char *statusMessage(Status status) {
+  switch (status) {
+  case Status::FINISHED:
+    return "Finished";
+  case Status::DIVIDE_BY_ZERO:
+    return "Divide by zero";
+  case Status::END_OF_PROGRAM:
+    return "Ran off the end of the program";
+  case Status::UNKNOWN_INSTRUCTION:
+    return "Unknown instruction";
+  case Status::STACK_OVERFLOW:
+    return "Calls nested too deeply";
+  case Status::HEAP_OUT_OF_BOUNDS:
+    return "Heap access out of bounds";
+  case Status::OUT_OF_FUEL:
+    return "Ran out of fuel";
+  }
+  return "Unknown status";
+}
+
+// A program prepared to run with one set of options.
+struct ModuleData {
+  RunOptions options;
+  // The program the bytecode engines run. A tiered module leaves fusion to
+  // the tier switch, so its bytecode is the program as stored.
+  Program program;
+  // The program the records are decoded from: program, or for a tiered
+  // module that fuses, program after fusion, made at the tier switch.
+  Program decodedProgram;
+  bool fusesWhenDecoding = false;
+  // The instruction stream after fusion, if options.fuse is set. program or
+  // decodedProgram refers to it.
+  vector<uint8_t> fusedInstructions;
+  // Filled in if options.predecode is set, by load(), or for a tiered
+  // module by the first Vm to warm up. With threaded dispatch, the records
+  // are linked to the engine instantiation that options select.
+  DecodedProgram decoded;
+  // For a tiered module, whether decoded has been filled in, and the
+  // branches taken, calls and returns a run makes in the bytecode first.
+  std::atomic<bool> hasDecoded{false};
+  std::once_flag decodeOnce;
+  uint64_t warmupJumps = 0;
+  // Fills in decoded for a tiered module, if it is not already, and returns
+  // whether it is. Null for other modules.
+  bool (*decodeRecords)(ModuleData &module) = nullptr;
+  // The function table after fusion, if options.fuse is set. program or
+  // decodedProgram refers to it.
+  vector<Function> fusedFunctions;
+  vector<FunctionInfo> functions;
+  // The room every Vm of the module has for its stacks.
+  StackLimits limits;
+  JitCode jitCode;
+  bool hasJitCode = false;
+  // Runs the program on context with the engine options select.
+  Status (*engine)(VmContext &context, ModuleData &module);
+
+  ~ModuleData() {
+    if (hasJitCode) {
+      jitRelease(jitCode);
+    }
+  }
+};
+
+// Collects what the engines need to call each function in program.
+static void describeFunctions(const Program &program, const ProgramInfo &info,
+                              vector<FunctionInfo> &functions) {
+  functions.resize(program.functionCount);
+  for (size_t i = 0; i < program.functionCount; i++) {
+    const Function &function = program.functions[i];
+    functions[i].entry = function.start;
+    functions[i].argumentCount = function.argumentCount;
+    functions[i].localCount = function.localCount;
+    functions[i].stackDepth = info.functionStackDepth[i];
+  }
+}
+
+// Runs the bytecode as it is stored, with the dispatch options select.
+template <bool CacheTop, bool Metered>
+static Status runBytecode(VmContext &context, ModuleData &module) {
+#ifdef HAVE_THREADED_DISPATCH
+  if (module.options.dispatch == Dispatch::THREADED) {
+    return runThreaded<CacheTop, Metered>(context, module.program.constants);
+  }
+#endif
+  return runSwitch<CacheTop, Metered>(context, module.program.constants);
+}
+
+// Runs the pre-decoded records, with the dispatch options select.
+template <bool CacheTop, bool Metered>
+static Status runRecords(VmContext &context, ModuleData &module) {
+#ifdef HAVE_THREADED_DISPATCH
+  if (module.options.dispatch == Dispatch::THREADED) {
+    return runDecodedThreaded<CacheTop, Metered>(&context, module.decoded);
+  }
+#endif
+  return runDecodedSwitch<CacheTop, Metered>(context, module.decoded);
+}
+
+template <bool CacheTop, bool Metered>
+static Status runInterpreter(VmContext &context, ModuleData &module) {
+  if (module.options.predecode) {
+    return runRecords<CacheTop, Metered>(context, module);
+  }
+  return runBytecode<CacheTop, Metered>(context, module);
+}
+
+// Fuses and pre-decodes the program of a tiered module for the engine that
+// will run the records, the first time any Vm asks, and returns whether they
+// can be run.
+template <bool CacheTop, bool Metered>
+static bool decodeForTiering(ModuleData &module) {
+  std::call_once(module.decodeOnce, [&module] {
+    // Cannot fail for a verified program, but if it does the program just
+    // stays in the bytecode.
+    vector<size_t> origins;
+    if (module.fusesWhenDecoding &&
+        !fuseSuperinstructions(module.decodedProgram, module.fusedInstructions,
+                               module.fusedFunctions, &origins)) {
+      return;
+    }
+    if (!predecode(module.decodedProgram, module.decoded)) {
+      return;
+    }
+    // A superinstruction is only ever entered at its first instruction,
+    // which is where the bytecode stops, so each record takes the offset
+    // of that instruction in the bytecode.
+    if (module.fusesWhenDecoding) {
+      module.decoded.offsets = std::move(origins);
+    }
+#ifdef HAVE_THREADED_DISPATCH
+    if (module.options.dispatch == Dispatch::THREADED) {
+      runDecodedThreaded<CacheTop, Metered>(nullptr, module.decoded);
+    }
+#endif
+    module.hasDecoded.store(true, std::memory_order_release);
+  });
+  return module.hasDecoded.load(std::memory_order_acquire);
+}
+
+// The index of the record of the instruction at offset in the bytecode.
+static size_t recordAt(const DecodedProgram &decoded, size_t offset) {
+  return std::lower_bound(decoded.offsets.begin(), decoded.offsets.end(),
+                          offset) -
+         decoded.offsets.begin();
+}
+
+// Carries a program stopped in the bytecode over to the records, where it
+// continues. The stacks and locals are laid out alike for both, so only ip
+// and the return addresses change.
+static void enterRecords(VmContext &context, DecodedProgram &decoded) {
+  DecodedInstruction *records = decoded.instructions.data();
+  context.ip = recordAt(decoded, context.ip);
+  for (size_t i = 0; i < context.callDepth; i++) {
+    Frame &frame = context.frames[i];
+    frame.returnAddress =
+        (uintptr_t)(records + recordAt(decoded, frame.returnAddress));
+  }
+  context.decoded = true;
+}
+
+// A tiered module translates its program once a run has spent about as long
+// running the bytecode as translating would have taken, which is the most it
+// can lose by waiting. Translating costs about 9ns a byte, and the records
+// save about 1ns each time the program jumps, most of it in dispatch.
+#define WARMUP_JUMPS_PER_BYTE 8
+
+// Runs a tiered module: the bytecode, metered, until the warmup is used up,
+// then the records from where the bytecode stopped. With Metered, the
+// program's own fuel is charged for the warmup as well.
+template <bool CacheTop, bool Metered>
+static Status runTiered(VmContext &context, ModuleData &module) {
+  if (!context.decoded) {
+    uint64_t fuel = Metered ? context.fuel : UINT64_MAX;
+    uint64_t budget = std::min(fuel, context.warmup);
+    if (budget > 0) {
+      context.fuel = budget;
+      Status status = runBytecode<CacheTop, true>(context, module);
+      if (status != Status::OUT_OF_FUEL) {
+        return status;
       }
-      break;
-    }
-    case Opcode::CGOTO_LT: {
-      uint16_t offset = readInstruction<uint16_t>(context);
-      Constant right = pop(context);
-      Constant left = pop(context);
-      if (left < right) {
-        context.ip = offset;
+      fuel -= budget;
+      context.warmup -= budget;
+      if (context.warmup > 0) {
+        return Status::OUT_OF_FUEL;
       }
-      break;
     }
-    case Opcode::EXIT: {
-      Constant result = pop(context);
-      cout << "Finished with " << result << endl;
-      return;
+    context.fuel = fuel;
+    if (!decodeForTiering<CacheTop, Metered>(module)) {
+      return runBytecode<CacheTop, Metered>(context, module);
     }
-    default:
-      cerr << "Unknown instruction " << (int)opcode << endl;
+    enterRecords(context, module.decoded);
+    if (Metered && fuel == 0) {
+      return Status::OUT_OF_FUEL;
+    }
+  }
+  return runRecords<CacheTop, Metered>(context, module);
+}
+
+static Status runJit(VmContext &context, ModuleData &module) {
+  JitState state;
+  state.stackTop = context.stack + 1 + context.stackPointer;
+  state.locals = context.locals;
+  JitStatus status = module.jitCode.entry(&state);
+  context.stackPointer = state.stackTop - (context.stack + 1);
+  switch (status) {
+  case JitStatus::EXIT:
+    context.result = state.result;
+    return Status::FINISHED;
+  case JitStatus::DIVIDE_BY_ZERO:
+    return Status::DIVIDE_BY_ZERO;
+  case JitStatus::END_OF_PROGRAM:
+    break;
+  }
+  return Status::END_OF_PROGRAM;
+}
+
+Module::Module() {}
+Module::~Module() {}
+
+bool Module::load(const void *bytes, size_t size, const RunOptions &options) {
+  data.reset();
+  std::unique_ptr<ModuleData> module(new ModuleData());
+  module->options = options;
+  Program &program = module->program;
+  if (!loadProgram(bytes, size, program)) {
+    return false;
+  }
+  ProgramInfo info;
+  if (!verifyProgram(program, info)) {
+    return false;
+  }
+  // A tiered module fuses at the tier switch, unless the compiler is to
+  // have the fused program first.
+  bool compiles = options.jit && !options.metered;
+  module->fusesWhenDecoding =
+      options.fuse && options.predecode && options.tiered && !compiles;
+  if (options.fuse && !module->fusesWhenDecoding &&
+      !fuseSuperinstructions(program, module->fusedInstructions,
+                             module->fusedFunctions)) {
+    return false;
+  }
+  module->decodedProgram = program;
+  describeFunctions(program, info, module->functions);
+  module->limits = stackLimits(program, info);
+  if (options.jit && options.metered) {
+    cerr << "Compiled code cannot be metered, so the program is interpreted"
+         << endl;
+  } else if (options.jit) {
+    if (jitCompile(program, module->jitCode)) {
+      module->hasJitCode = true;
+      module->engine = runJit;
+    } else {
+      cerr << "Interpreting the program instead" << endl;
+    }
+  }
+  if (!module->hasJitCode && options.predecode && options.tiered) {
+    module->warmupJumps =
+        (uint64_t)program.instructionsSize * WARMUP_JUMPS_PER_BYTE;
+    module->engine = options.cacheTop
+                         ? (options.metered ? runTiered<true, true>
+                                            : runTiered<true, false>)
+                         : (options.metered ? runTiered<false, true>
+                                            : runTiered<false, false>);
+    module->decodeRecords =
+        options.cacheTop ? (options.metered ? decodeForTiering<true, true>
+                                            : decodeForTiering<true, false>)
+                         : (options.metered ? decodeForTiering<false, true>
+                                            : decodeForTiering<false, false>);
+  } else if (!module->hasJitCode) {
+    if (options.predecode && !predecode(program, module->decoded)) {
+      return false;
+    }
+#ifdef HAVE_THREADED_DISPATCH
+    if (options.predecode && options.dispatch == Dispatch::THREADED) {
+      auto link = options.cacheTop
+                      ? (options.metered ? runDecodedThreaded<true, true>
+                                         : runDecodedThreaded<true, false>)
+                      : (options.metered ? runDecodedThreaded<false, true>
+                                         : runDecodedThreaded<false, false>);
+      link(nullptr, module->decoded);
+    }
+#endif
+    module->engine = options.cacheTop
+                         ? (options.metered ? runInterpreter<true, true>
+                                            : runInterpreter<true, false>)
+                         : (options.metered ? runInterpreter<false, true>
+                                            : runInterpreter<false, false>);
+  }
+  data = std::move(module);
+  return true;
+}
+
+bool Module::loaded() const { return data != nullptr; }
+
+bool Module::compiled() const { return data->hasJitCode; }
+
+// Whether the engine module selects starts a run in the pre-decoded
+// records.
+static bool startsDecoded(const ModuleData &module) {
+  if (module.hasJitCode || !module.options.predecode) {
+    return false;
+  }
+  return !module.options.tiered ||
+         module.hasDecoded.load(std::memory_order_acquire);
+}
+
+// Points the context at the start of the program, with nothing on the
+// operand stack and no calls active.
+static void rewind(VmContext &context, const ModuleData &module) {
+  context.ip = 0;
+  context.decoded = startsDecoded(module);
+  context.warmup = module.warmupJumps;
+  context.stack[0] = 0;
+  context.stackPointer = 0;
+  context.callDepth = 0;
+  context.runningLocals = 0;
+  context.frameLocalsEnd = 0;
+}
+
+Vm::Vm(const Module &module)
+    : module(module),
+      context(new VmContext(module.data->limits,
+                            module.data->program.header->heapSize)) {
+  context->fuel = UINT64_MAX;
+  reset();
+}
+
+Vm::~Vm() {}
+
+Status Vm::run() {
+  rewind(*context, *module.data);
+  return resume();
+}
+
+// A turn of a Vm, run inside the guards of its arena.
+struct Turn {
+  VmContext &context;
+  ModuleData &data;
+  Status status;
+};
+
+static void takeTurn(void *argument) {
+  Turn &turn = *(Turn *)argument;
+  turn.status = turn.data.engine(turn.context, turn.data);
+}
+
+Status Vm::resume() {
+  ModuleData &data = *module.data;
+  context->instructions = data.program.instructions;
+  context->functions = data.functions.data();
+  if (data.options.metered && context->fuel == 0) {
+    return Status::OUT_OF_FUEL;
+  }
+  Turn turn = {*context, data, Status::FINISHED};
+  if (!context->arena.guarded(takeTurn, &turn)) {
+    return Status::STACK_OVERFLOW;
+  }
+  return turn.status;
+}
+
+void Vm::setFuel(uint64_t fuel) { context->fuel = fuel; }
+
+int64_t Vm::result() const { return context->result; }
+
+int64_t *Vm::locals() { return context->locals; }
+
+size_t Vm::localCount() const { return MAX_LOCALS; }
+
+int64_t *Vm::heap() { return context->heap.data(); }
+
+size_t Vm::heapSize() const { return context->heap.size(); }
+
+void Vm::reset() {
+  rewind(*context, *module.data);
+  // Functions zero their own locals as they are called.
+  memset(context->locals, 0, MAX_LOCALS * sizeof(Constant));
+  context->arena.clear(context->heap.data(),
+                       context->heap.size() * sizeof(Constant));
+  context->result = 0;
+}
+
+// A snapshot image is this header, then stackPointer operand stack values,
+// the locals up to MAX_LOCALS + frameLocalsEnd, callDepth SnapshotFrames and
+// heapWords words of heap, all in host byte order.
+#define SNAPSHOT_MAGIC 0x5A7E0C4B
+#define CURRENT_SNAPSHOT_VERSION 1
+struct SnapshotHeader {
+  uint32_t magic;
+  uint16_t version;
+  // Whether ip and the return addresses count records of the pre-decoded
+  // program rather than bytes of the instruction stream.
+  uint16_t decoded;
+  // Identifies the program the engines run, so that an image is only
+  // restored into the program it was taken from.
+  uint64_t fingerprint;
+  uint64_t ip;
+  uint64_t stackPointer;
+  uint64_t callDepth;
+  uint64_t runningLocals;
+  uint64_t frameLocalsEnd;
+  uint64_t heapSize;
+  // The heap is saved up to its last nonzero word.
+  uint64_t heapWords;
+};
+struct SnapshotFrame {
+  uint64_t returnAddress;
+  // Where the caller's locals start in the locals.
+  uint64_t locals;
+};
+
+// Whether an image with ip and return addresses in records (or in bytes)
+// can be restored into module, which for a tiered module means having the
+// records to restore it into.
+static bool canRestore(ModuleData &module, bool decoded) {
+  if (module.decodeRecords != nullptr) {
+    return !decoded || module.decodeRecords(module);
+  }
+  return decoded == (!module.hasJitCode && module.options.predecode);
+}
+
+// FNV-1a over the constants, functions and instructions of the program that
+// ip and the return addresses of an image count into: the one the records
+// are decoded from, if decoded, otherwise the bytecode. Fusion changes them
+// along with the offsets.
+static uint64_t fingerprint(const ModuleData &module, bool decoded) {
+  const Program &program = decoded ? module.decodedProgram : module.program;
+  uint64_t hash = 14695981039346656037ull;
+  auto mix = [&hash](const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+  };
+  mix(program.constants, program.header->constantCount * sizeof(Constant));
+  mix(program.functions, program.functionCount * sizeof(Function));
+  mix(program.instructions, program.instructionsSize);
+  return hash;
+}
+
+static void append(vector<uint8_t> &image, const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  image.insert(image.end(), bytes, bytes + size);
+}
+
+void Vm::snapshot(vector<uint8_t> &image) const {
+  const ModuleData &data = *module.data;
+  const VmContext &state = *context;
+  bool decoded = state.decoded;
+  const DecodedInstruction *records = data.decoded.instructions.data();
+  SnapshotHeader header;
+  header.magic = SNAPSHOT_MAGIC;
+  header.version = CURRENT_SNAPSHOT_VERSION;
+  header.decoded = decoded;
+  header.fingerprint = fingerprint(data, decoded);
+  header.ip = state.ip;
+  header.stackPointer = state.stackPointer;
+  header.callDepth = state.callDepth;
+  header.runningLocals = state.runningLocals;
+  header.frameLocalsEnd = state.frameLocalsEnd;
+  header.heapSize = state.heap.size();
+  header.heapWords = state.heap.size();
+  while (header.heapWords > 0 && state.heap[header.heapWords - 1] == 0) {
+    header.heapWords--;
+  }
+  image.clear();
+  append(image, &header, sizeof(header));
+  append(image, state.stack + 1, state.stackPointer * sizeof(Constant));
+  append(image, state.locals,
+         (MAX_LOCALS + state.frameLocalsEnd) * sizeof(Constant));
+  for (size_t i = 0; i < state.callDepth; i++) {
+    const Frame &frame = state.frames[i];
+    SnapshotFrame saved;
+    saved.returnAddress =
+        decoded ? (const DecodedInstruction *)frame.returnAddress - records
+                : frame.returnAddress;
+    saved.locals = frame.locals - state.locals;
+    append(image, &saved, sizeof(saved));
+  }
+  append(image, state.heap.data(), header.heapWords * sizeof(Constant));
+}
+
+bool Vm::restore(const void *image, size_t size) {
+  const ModuleData &data = *module.data;
+  VmContext &state = *context;
+  const uint8_t *bytes = (const uint8_t *)image;
+  SnapshotHeader header;
+  if (size < sizeof(header)) {
+    cerr << "Not a snapshot" << endl;
+    return false;
+  }
+  memcpy(&header, bytes, sizeof(header));
+  if (header.magic != SNAPSHOT_MAGIC) {
+    cerr << "Not a snapshot" << endl;
+    return false;
+  }
+  if (header.version != CURRENT_SNAPSHOT_VERSION) {
+    cerr << "Unsupported snapshot version " << header.version << endl;
+    return false;
+  }
+  bool decoded = header.decoded != 0;
+  // A tiered module only has the program the records are decoded from once
+  // canRestore has made them.
+  if (!canRestore(*module.data, decoded) ||
+      header.fingerprint != fingerprint(data, decoded)) {
+    cerr << "The snapshot is of another program, or of this one loaded with "
+            "other options"
+         << endl;
+    return false;
+  }
+  if (data.hasJitCode && (header.ip != 0 || header.callDepth != 0)) {
+    cerr << "Compiled code always starts at the beginning, so it cannot "
+            "resume this snapshot"
+         << endl;
+    return false;
+  }
+  // ip and the return addresses may point just past the last instruction,
+  // at the end of the program.
+  size_t ipLimit = decoded ? data.decoded.instructions.size() - 1
+                           : data.program.instructionsSize;
+  if (header.ip > ipLimit || header.stackPointer > state.limits.stackSize ||
+      header.callDepth > state.limits.callDepth ||
+      header.frameLocalsEnd > state.limits.frameLocals ||
+      header.runningLocals > MAX_LOCALS + header.frameLocalsEnd ||
+      header.heapSize != state.heap.size() ||
+      header.heapWords > header.heapSize) {
+    cerr << "Corrupt snapshot" << endl;
+    return false;
+  }
+  size_t localCount = MAX_LOCALS + header.frameLocalsEnd;
+  size_t expectedSize =
+      sizeof(header) +
+      (header.stackPointer + localCount + header.heapWords) * sizeof(Constant) +
+      header.callDepth * sizeof(SnapshotFrame);
+  if (size != expectedSize) {
+    cerr << "Truncated snapshot" << endl;
+    return false;
+  }
+  const uint8_t *frames = bytes + sizeof(header) +
+                          (header.stackPointer + localCount) * sizeof(Constant);
+  for (size_t i = 0; i < header.callDepth; i++) {
+    SnapshotFrame saved;
+    memcpy(&saved, frames + i * sizeof(saved), sizeof(saved));
+    if (saved.returnAddress > ipLimit || saved.locals > localCount) {
+      cerr << "Corrupt snapshot" << endl;
+      return false;
+    }
+  }
+  // The image is sound, so the state can now be overwritten.
+  const DecodedInstruction *records = data.decoded.instructions.data();
+  const uint8_t *read = bytes + sizeof(header);
+  state.ip = header.ip;
+  state.decoded = decoded;
+  state.warmup = data.warmupJumps;
+  state.stack[0] = 0;
+  state.stackPointer = header.stackPointer;
+  memcpy(state.stack + 1, read, header.stackPointer * sizeof(Constant));
+  read += header.stackPointer * sizeof(Constant);
+  memcpy(state.locals, read, localCount * sizeof(Constant));
+  read += localCount * sizeof(Constant);
+  for (size_t i = 0; i < header.callDepth; i++) {
+    SnapshotFrame saved;
+    memcpy(&saved, read, sizeof(saved));
+    read += sizeof(saved);
+    Frame &frame = state.frames[i];
+    frame.returnAddress =
+        decoded ? (uintptr_t)(records + saved.returnAddress)
+                : (uintptr_t)saved.returnAddress;
+    frame.locals = state.locals + saved.locals;
+  }
+  state.callDepth = header.callDepth;
+  state.runningLocals = header.runningLocals;
+  state.frameLocalsEnd = header.frameLocalsEnd;
+  memcpy(state.heap.data(), read, header.heapWords * sizeof(Constant));
+  state.arena.clear(state.heap.data() + header.heapWords,
+                    (header.heapSize - header.heapWords) * sizeof(Constant));
+  return true;
+}
+
+void run(const void *data, size_t size, const RunOptions &options,
+         uint64_t fuel, const std::string &saveTo,
+         const std::string &resumeFrom) {
+  Module module;
+  if (!module.load(data, size, options)) {
+    return;
+  }
+  Vm vm(module);
+  vm.setFuel(fuel);
+  Status status;
+  if (resumeFrom.empty()) {
+    status = vm.run();
+  } else {
+    MappedFile image;
+    if (!image.open(resumeFrom) || !vm.restore(image.data(), image.size())) {
       return;
     }
+    status = vm.resume();
+  }
+  if (status == Status::FINISHED) {
+    cout << "Finished with " << vm.result() << endl;
+  } else {
+    cerr << statusMessage(status) << endl;
+  }
+  if (status == Status::OUT_OF_FUEL && !saveTo.empty()) {
+    vector<uint8_t> image;
+    vm.snapshot(image);
+    std::ofstream output(saveTo, std::ios::binary);
+    output.write((const char *)image.data(), image.size());
+    cout << "Saved the state to " << saveTo << endl;
+  }
+}
+
+bool countInstructions(const void *data, size_t size, uint64_t &count) {
+  Program program;
+  ProgramInfo info;
+  if (!loadProgram(data, size, program) || !verifyProgram(program, info)) {
+    return false;
+  }
+  vector<FunctionInfo> functions;
+  describeFunctions(program, info, functions);
+  std::unique_ptr<VmContext> context(
+      new VmContext(stackLimits(program, info), program.header->heapSize));
+  context->instructions = program.instructions;
+  context->functions = functions.data();
+  Status status = Status::STACK_OVERFLOW;
+  struct Counting {
+    VmContext &context;
+    const Constant *constants;
+    Status &status;
+  } counting = {*context, program.constants, status};
+  context->arena.guarded(
+      [](void *argument) {
+        Counting &counting = *(Counting *)argument;
+        counting.status = runSwitch<false, false, true>(counting.context,
+                                                        counting.constants);
+      },
+      &counting);
+  if (status != Status::FINISHED) {
+    cerr << statusMessage(status) << endl;
+    return false;
+  }
+  count = context->executed;
+  return true;
+}
+
+#ifdef PROFILE
+bool runProfiled(const void *data, size_t size, const std::string &sourcePath,
+                 std::ostream &report) {
+  Program program;
+  ProgramInfo info;
+  if (!loadProgram(data, size, program) || !verifyProgram(program, info)) {
+    return false;
+  }
+  vector<FunctionInfo> functions;
+  describeFunctions(program, info, functions);
+  std::unique_ptr<VmContext> context(
+      new VmContext(stackLimits(program, info), program.header->heapSize));
+  context->instructions = program.instructions;
+  context->functions = functions.data();
+  std::unique_ptr<Profile> profile(new Profile());
+  profile->reset(program.instructionsSize);
+  Status status = Status::STACK_OVERFLOW;
+  struct Profiling {
+    VmContext &context;
+    const Constant *constants;
+    Profile &profile;
+    Status &status;
+  } profiling = {*context, program.constants, *profile, status};
+  context->arena.guarded(
+      [](void *argument) {
+        Profiling &profiling = *(Profiling *)argument;
+        profiling.status = runProfiled(profiling.context, profiling.constants,
+                                       profiling.profile);
+      },
+      &profiling);
+  if (status == Status::FINISHED) {
+    cout << "Finished with " << context->result << endl;
+  } else {
+    cerr << statusMessage(status) << endl;
   }
+  ProgramSource source;
+  bool haveSource = !sourcePath.empty() &&
+                    loadSource(sourcePath, data, size, source);
+  writeProfileReport(program, *profile, haveSource ? &source : nullptr,
+                     report);
+  return true;
 }
+#endif
 } // namespace bytecode
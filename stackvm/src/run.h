@@ -1,10 +1,30 @@
 #ifndef _RUN_H
 #define _RUN_H
 
+#include "stackvm.h"
 #include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
 
 namespace bytecode {
-void run(void *program, size_t programSize);
+// Loads and runs a bytecode file, printing the result or the error. With
+// metered options, the program stops once it has used up fuel, and if saveTo
+// is not empty its state is then saved there as a snapshot. With resumeFrom,
+// the program continues from the snapshot saved there instead of starting.
+void run(const void *program, size_t programSize, const RunOptions &options,
+         uint64_t fuel = UINT64_MAX, const std::string &saveTo = "",
+         const std::string &resumeFrom = "");
+
+#ifdef PROFILE
+// Runs a bytecode file on the profiling engine, which ignores the run
+// options, printing the result or the error as run() does. Then writes a
+// report of where the time went to report, with source lines if sourcePath
+// names the .vasm file the program was assembled from. Returns false if the
+// program cannot be run.
+bool runProfiled(const void *program, size_t programSize,
+                 const std::string &sourcePath, std::ostream &report);
+#endif
 }
 
-#endif
\ No newline at end of file
+#endif
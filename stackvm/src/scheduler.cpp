@@ -0,0 +1,113 @@
+#include "stackvm.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using std::deque;
+using std::function;
+using std::mutex;
+using std::unique_lock;
+using std::vector;
+
+namespace bytecode {
+// A submitted Vm, between its turns.
+struct Task {
+  Vm *vm;
+  // Fuel left for its remaining turns.
+  uint64_t fuel;
+  // Whether it has had a turn, so the next one resumes it.
+  bool started;
+  function<void(Status)> done;
+};
+
+// The Vms waiting for a turn are queued in the order they will get one.
+// A turn takes far longer than taking the lock, so one queue for every
+// thread is enough.
+struct SchedulerData {
+  uint64_t sliceFuel;
+  mutex lock;
+  deque<Task> queue;
+  // Signalled when a task is queued, and when the threads are to stop.
+  std::condition_variable queued;
+  // Signalled when the last submitted task stops.
+  std::condition_variable idle;
+  // Tasks submitted that have not yet stopped, queued or running.
+  size_t pending = 0;
+  bool stopping = false;
+  vector<std::thread> threads;
+};
+
+// Gives tasks their turns until the scheduler stops.
+static void serve(SchedulerData &data) {
+  unique_lock<mutex> guard(data.lock);
+  while (true) {
+    data.queued.wait(guard,
+                     [&] { return data.stopping || !data.queue.empty(); });
+    if (data.queue.empty()) {
+      return;
+    }
+    Task task = std::move(data.queue.front());
+    data.queue.pop_front();
+    guard.unlock();
+    uint64_t slice = std::min(data.sliceFuel, task.fuel);
+    task.vm->setFuel(slice);
+    Status status = task.started ? task.vm->resume() : task.vm->run();
+    task.started = true;
+    // A task that ran out of fuel used all of the slice.
+    if (status == Status::OUT_OF_FUEL && task.fuel > slice) {
+      task.fuel -= slice;
+      guard.lock();
+      data.queue.push_back(std::move(task));
+      data.queued.notify_one();
+      continue;
+    }
+    task.done(status);
+    guard.lock();
+    if (--data.pending == 0) {
+      data.idle.notify_all();
+    }
+  }
+}
+
+Scheduler::Scheduler(unsigned threadCount, uint64_t sliceFuel)
+    : data(new SchedulerData()) {
+  if (threadCount == 0) {
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+  data->sliceFuel = std::max<uint64_t>(sliceFuel, 1);
+  for (unsigned i = 0; i < threadCount; i++) {
+    data->threads.emplace_back(serve, std::ref(*data));
+  }
+}
+
+Scheduler::~Scheduler() {
+  wait();
+  {
+    unique_lock<mutex> guard(data->lock);
+    data->stopping = true;
+  }
+  data->queued.notify_all();
+  for (std::thread &thread : data->threads) {
+    thread.join();
+  }
+}
+
+void Scheduler::submit(Vm &vm, uint64_t fuel, function<void(Status)> done) {
+  unique_lock<mutex> guard(data->lock);
+  data->queue.push_back({&vm, fuel, false, std::move(done)});
+  data->pending++;
+  data->queued.notify_one();
+}
+
+void Scheduler::wait() {
+  unique_lock<mutex> guard(data->lock);
+  data->idle.wait(guard, [&] { return data->pending == 0; });
+}
+} // namespace bytecode
@@ -0,0 +1,652 @@
+#include "translate.h"
+#include "bytecode.h"
+#include "program.h"
+#include "verify.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::map;
+using std::ostream;
+using std::pair;
+using std::string;
+using std::to_string;
+using std::vector;
+
+// The register VM has eight registers and a 12 bit immediate field.
+#define REGISTER_COUNT 8
+#define MIN_REGISTER_IMMEDIATE (-2048)
+#define MAX_REGISTER_IMMEDIATE 2047
+// Holds the address of a local that lives in memory while it is accessed.
+#define ADDRESS_REGISTER (REGISTER_COUNT - 1)
+
+namespace bytecode {
+// Where a value on the operand stack is. Constants and loaded locals are only
+// copied into their stack slot's register when something needs them there.
+struct Value {
+  enum Kind { REGISTER, LOCAL, IMMEDIATE } kind;
+  // The register, the index of the local or the value itself.
+  int64_t value;
+  bool operator==(const Value &other) const {
+    return kind == other.kind && value == other.value;
+  }
+};
+
+// A line of register VM assembly: a label if label is set, otherwise an
+// instruction.
+struct AssemblyLine {
+  string label;
+  string mnemonic;
+  vector<string> operands;
+};
+
+static string registerName(int64_t number) { return "r" + to_string(number); }
+static string labelName(size_t offset) { return "L" + to_string(offset); }
+
+static bool fitsImmediate(const Value &value) {
+  return value.kind == Value::IMMEDIATE &&
+         value.value >= MIN_REGISTER_IMMEDIATE &&
+         value.value <= MAX_REGISTER_IMMEDIATE;
+}
+
+struct Translator {
+  // How many registers, from r0, hold the operand stack.
+  size_t stackRegisters = 0;
+  // Register of each local, or -1 for locals kept in memory.
+  vector<int> localRegister;
+  // Registers loaded once at the start with constants too large for an
+  // immediate, so loops do not reload them.
+  map<int64_t, int> constantRegister;
+  // The operand stack. The value at position i belongs in register i.
+  vector<Value> stack;
+  vector<AssemblyLine> lines;
+  // The last line, if it is an instruction that wrote the value now in
+  // stack slot producerSlot and nothing has read it yet, so a store can
+  // retarget it. Otherwise -1.
+  int64_t producer = -1;
+  size_t producerSlot = 0;
+
+  void emit(const string &mnemonic, const vector<string> &operands) {
+    lines.push_back({"", mnemonic, operands});
+    producer = -1;
+  }
+  void emitProducer(const string &mnemonic, const vector<string> &operands,
+                    size_t slot) {
+    emit(mnemonic, operands);
+    producer = lines.size() - 1;
+    producerSlot = slot;
+  }
+  void emitLabel(size_t offset) {
+    lines.push_back({labelName(offset), "", {}});
+    producer = -1;
+  }
+
+  // The operand for a value that is in a register or fits in an immediate.
+  string operand(const Value &value) {
+    switch (value.kind) {
+    case Value::REGISTER:
+      return registerName(value.value);
+    case Value::LOCAL:
+      return registerName(localRegister[value.value]);
+    case Value::IMMEDIATE:
+      break;
+    }
+    return to_string(value.value);
+  }
+  // Copies the value at position into its stack slot, unless it is there.
+  void materialize(size_t position) {
+    Value &value = stack[position];
+    Value slot = {Value::REGISTER, (int64_t)position};
+    if (!(value == slot)) {
+      emit("mov", {operand(value), registerName(position)});
+      value = slot;
+    }
+  }
+  void flush(size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      materialize(i);
+    }
+  }
+  // The value at position as a register operand.
+  string registerOperand(size_t position) {
+    const Value &value = stack[position];
+    if (value.kind == Value::IMMEDIATE) {
+      auto constant = constantRegister.find(value.value);
+      if (constant != constantRegister.end()) {
+        return registerName(constant->second);
+      }
+      materialize(position);
+    }
+    return operand(stack[position]);
+  }
+  // The value at position as a first source operand, which may be an
+  // immediate.
+  string sourceOperand(size_t position) {
+    if (fitsImmediate(stack[position])) {
+      return operand(stack[position]);
+    }
+    return registerOperand(position);
+  }
+
+  void push(Value value) { stack.push_back(value); }
+  void load(size_t local) {
+    if (localRegister[local] >= 0) {
+      push({Value::LOCAL, (int64_t)local});
+      return;
+    }
+    size_t slot = stack.size();
+    emit("mov", {to_string(local), registerName(ADDRESS_REGISTER)});
+    emitProducer("mov",
+                 {"*" + registerName(ADDRESS_REGISTER), registerName(slot)},
+                 slot);
+    push({Value::REGISTER, (int64_t)slot});
+  }
+  void store(size_t local) {
+    Value value = stack.back();
+    size_t top = stack.size() - 1;
+    stack.pop_back();
+    if (value == Value{Value::LOCAL, (int64_t)local}) {
+      return;
+    }
+    // Values still waiting to be loaded from the local need copying first.
+    for (size_t i = 0; i < stack.size(); i++) {
+      if (stack[i] == Value{Value::LOCAL, (int64_t)local}) {
+        materialize(i);
+      }
+    }
+    if (localRegister[local] < 0) {
+      emit("mov", {to_string(local), registerName(ADDRESS_REGISTER)});
+      emit("mov", {operand(value), "*" + registerName(ADDRESS_REGISTER)});
+      return;
+    }
+    string destination = registerName(localRegister[local]);
+    if (value == Value{Value::REGISTER, (int64_t)top} && producer >= 0 &&
+        producerSlot == top) {
+      lines[producer].operands.back() = destination;
+      producer = -1;
+      return;
+    }
+    emit("mov", {operand(value), destination});
+  }
+
+  // Replaces the top two values with left op right, where right is on top.
+  void binary(Opcode opcode) {
+    size_t right = stack.size() - 1;
+    size_t left = right - 1;
+    Value leftValue = stack[left];
+    Value rightValue = stack[right];
+    string mnemonic;
+    bool commutative = false;
+    switch (opcode) {
+    case Opcode::ADD:
+      mnemonic = "add";
+      commutative = true;
+      break;
+    case Opcode::SUB:
+      mnemonic = "sub";
+      break;
+    case Opcode::MUL:
+      mnemonic = "mul";
+      commutative = true;
+      break;
+    case Opcode::DIV:
+      mnemonic = "div";
+      break;
+    case Opcode::LSHIFT:
+      mnemonic = "shl";
+      break;
+    case Opcode::RSHIFT:
+      mnemonic = "shr";
+      break;
+    case Opcode::AND:
+      mnemonic = "and";
+      commutative = true;
+      break;
+    case Opcode::OR:
+      mnemonic = "or";
+      commutative = true;
+      break;
+    case Opcode::XOR:
+      mnemonic = "xor";
+      commutative = true;
+      break;
+    default:
+      break;
+    }
+    // Fold operations on two constants, apart from those that can fail or
+    // depend on the shift amount.
+    if (leftValue.kind == Value::IMMEDIATE &&
+        rightValue.kind == Value::IMMEDIATE && opcode != Opcode::DIV &&
+        opcode != Opcode::LSHIFT && opcode != Opcode::RSHIFT) {
+      uint64_t a = leftValue.value;
+      uint64_t b = rightValue.value;
+      uint64_t result = opcode == Opcode::ADD   ? a + b
+                        : opcode == Opcode::SUB ? a - b
+                        : opcode == Opcode::MUL ? a * b
+                        : opcode == Opcode::AND ? a & b
+                        : opcode == Opcode::OR  ? a | b
+                                                : a ^ b;
+      stack.pop_back();
+      stack[left] = {Value::IMMEDIATE, (int64_t)result};
+      return;
+    }
+    // The register VM computes dst = src2 op src1, and only src1 can be an
+    // immediate.
+    string src1;
+    string src2;
+    if (commutative && fitsImmediate(leftValue) &&
+        rightValue.kind != Value::IMMEDIATE) {
+      src1 = operand(leftValue);
+      src2 = registerOperand(right);
+    } else {
+      src1 = sourceOperand(right);
+      src2 = registerOperand(left);
+    }
+    stack.pop_back();
+    stack[left] = {Value::REGISTER, (int64_t)left};
+    emitProducer(mnemonic, {src1, src2, registerName(left)}, left);
+  }
+  void binaryImmediate(Opcode opcode, int64_t immediate) {
+    push({Value::IMMEDIATE, immediate});
+    binary(opcode);
+  }
+
+  // The stack must be in its slots at every jump, since the target may be
+  // reached from elsewhere.
+  void jump(size_t target) {
+    flush(stack.size());
+    emit("goto", {"&" + labelName(target)});
+  }
+  // Pops two values and jumps if left compares to right, where right is on
+  // top.
+  void branch(Opcode comparison, size_t target) {
+    size_t right = stack.size() - 1;
+    size_t left = right - 1;
+    flush(left);
+    Value leftValue = stack[left];
+    Value rightValue = stack[right];
+    if (leftValue.kind == Value::IMMEDIATE &&
+        rightValue.kind == Value::IMMEDIATE) {
+      bool taken = comparison == Opcode::CGOTO_EQ
+                       ? leftValue.value == rightValue.value
+                   : comparison == Opcode::CGOTO_NEQ
+                       ? leftValue.value != rightValue.value
+                   : comparison == Opcode::CGOTO_GT
+                       ? leftValue.value > rightValue.value
+                       : leftValue.value < rightValue.value;
+      stack.resize(left);
+      if (taken) {
+        emit("goto", {"&" + labelName(target)});
+      }
+      return;
+    }
+    // Branches compare src2 with src1, and only src1 can be an immediate.
+    string src1;
+    string src2;
+    if (leftValue.kind == Value::IMMEDIATE) {
+      src1 = sourceOperand(left);
+      src2 = registerOperand(right);
+      if (comparison == Opcode::CGOTO_GT) {
+        comparison = Opcode::CGOTO_LT;
+      } else if (comparison == Opcode::CGOTO_LT) {
+        comparison = Opcode::CGOTO_GT;
+      }
+    } else {
+      src1 = sourceOperand(right);
+      src2 = registerOperand(left);
+    }
+    string mnemonic = comparison == Opcode::CGOTO_EQ    ? "beq"
+                      : comparison == Opcode::CGOTO_NEQ ? "bne"
+                      : comparison == Opcode::CGOTO_GT  ? "bgt"
+                                                        : "blt";
+    stack.resize(left);
+    emit(mnemonic, {src1, src2, "&" + labelName(target)});
+  }
+  void exit() {
+    string result = sourceOperand(stack.size() - 1);
+    stack.pop_back();
+    emit("halt", {result});
+  }
+};
+
+// How many values an instruction briefly holds above the stack depth it
+// starts at, as the translator pushes its immediate or the steps of a
+// superinstruction. The verifier does not count them, but any may need its
+// slot's register.
+static size_t extraSlots(Opcode opcode) {
+  switch (opcode) {
+  case Opcode::IADD:
+  case Opcode::ISUB:
+  case Opcode::IMUL:
+  case Opcode::IDIV:
+  case Opcode::ILSHIFT:
+  case Opcode::IRSHIFT:
+  case Opcode::IAND:
+  case Opcode::IOR:
+  case Opcode::IXOR:
+  case Opcode::CGOTO_EQ_IMM:
+  case Opcode::CGOTO_NEQ_IMM:
+  case Opcode::CGOTO_GT_IMM:
+  case Opcode::CGOTO_LT_IMM:
+    return 1;
+  case Opcode::LINC:
+  case Opcode::LADD:
+  case Opcode::LCGOTO_EQ_IMM:
+  case Opcode::LCGOTO_NEQ_IMM:
+  case Opcode::LCGOTO_GT_IMM:
+  case Opcode::LCGOTO_LT_IMM:
+  case Opcode::LCGOTO_EQ_CONST:
+  case Opcode::LCGOTO_NEQ_CONST:
+  case Opcode::LCGOTO_GT_CONST:
+  case Opcode::LCGOTO_LT_CONST:
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+// Gives the registers left over from the operand stack to the most used
+// locals, and any still free to the most used large constants. Returns false
+// if the stack alone needs too many registers.
+static bool assignRegisters(const Program &program,
+                            const vector<Instruction> &instructions,
+                            const ProgramInfo &info, Translator &translator) {
+  vector<int> &localRegister = translator.localRegister;
+  size_t stackRegisters = info.maxStackDepth;
+  for (const Instruction &instruction : instructions) {
+    int64_t depth = info.stackDepth[instruction.offset];
+    if (depth >= 0) {
+      stackRegisters = std::max(stackRegisters,
+                                (size_t)depth + extraSlots(instruction.opcode));
+    }
+  }
+  translator.stackRegisters = stackRegisters;
+  localRegister.assign(info.localCount, -1);
+  size_t freeRegisters = REGISTER_COUNT - std::min(stackRegisters,
+                                                   (size_t)REGISTER_COUNT);
+  if (info.localCount > freeRegisters) {
+    // One register is needed to address the locals kept in memory.
+    freeRegisters = freeRegisters > 0 ? freeRegisters - 1 : 0;
+    if (stackRegisters > ADDRESS_REGISTER) {
+      cerr << "The operand stack needs " << stackRegisters
+           << " registers, but only " << ADDRESS_REGISTER
+           << " are left after addressing locals in memory" << endl;
+      return false;
+    }
+  } else if (stackRegisters > REGISTER_COUNT) {
+    cerr << "The operand stack needs " << stackRegisters
+         << " registers, but there are only " << REGISTER_COUNT << endl;
+    return false;
+  }
+  vector<size_t> uses(info.localCount, 0);
+  map<int64_t, size_t> constantUses;
+  for (const Instruction &instruction : instructions) {
+    const OpcodeInfo &opcode = opcodeInfo(instruction.opcode);
+    for (size_t i = 0; i < MAX_OPERANDS; i++) {
+      int64_t operand = instruction.operands[i];
+      Value constant = {Value::IMMEDIATE, operand};
+      switch (opcode.operands[i]) {
+      case OperandKind::LOCAL:
+        uses[operand]++;
+        break;
+      case OperandKind::CONSTANT:
+        constant.value = program.constants[operand];
+        // fall through
+      case OperandKind::IMMEDIATE:
+        if (!fitsImmediate(constant)) {
+          constantUses[constant.value]++;
+        }
+        break;
+      default:
+        break;
+      }
+    }
+  }
+  vector<size_t> locals(info.localCount);
+  for (size_t i = 0; i < locals.size(); i++) {
+    locals[i] = i;
+  }
+  std::stable_sort(locals.begin(), locals.end(),
+                   [&](size_t a, size_t b) { return uses[a] > uses[b]; });
+  size_t next = stackRegisters;
+  for (size_t i = 0; i < locals.size() && i < freeRegisters; i++) {
+    localRegister[locals[i]] = next++;
+  }
+  if (info.localCount <= freeRegisters) {
+    vector<pair<size_t, int64_t>> constants;
+    for (auto &constant : constantUses) {
+      constants.push_back({constant.second, constant.first});
+    }
+    std::stable_sort(constants.begin(), constants.end(),
+                     [](const pair<size_t, int64_t> &a,
+                        const pair<size_t, int64_t> &b) {
+                       return a.first > b.first;
+                     });
+    for (size_t i = 0;
+         i < constants.size() && next < stackRegisters + freeRegisters; i++) {
+      translator.constantRegister[constants[i].second] = next++;
+    }
+  }
+  return true;
+}
+
+bool translateToRegisterVm(const Program &program, ostream &output) {
+  ProgramInfo info;
+  if (!verifyProgram(program, info)) {
+    return false;
+  }
+  if (program.functionCount > 0) {
+    // The register VM has no calls to translate them to.
+    cerr << "Cannot translate a program with functions" << endl;
+    return false;
+  }
+  vector<Instruction> instructions;
+  vector<bool> isTarget(program.instructionsSize + 1, false);
+  for (size_t offset = 0; offset < program.instructionsSize;) {
+    Instruction instruction;
+    decodeInstruction(program, offset, instruction);
+    const OpcodeInfo &opcode = opcodeInfo(instruction.opcode);
+    if (info.stackDepth[offset] >= 0) {
+      for (size_t i = 0; i < MAX_OPERANDS; i++) {
+        if (opcode.operands[i] == OperandKind::TARGET) {
+          isTarget[instruction.operands[i]] = true;
+        }
+      }
+    }
+    instructions.push_back(instruction);
+    offset += instruction.length;
+  }
+
+  Translator translator;
+  if (!assignRegisters(program, instructions, info, translator)) {
+    return false;
+  }
+  for (auto &constant : translator.constantRegister) {
+    translator.emit("mov", {to_string(constant.first),
+                            registerName(constant.second)});
+  }
+  bool fallsThrough = false;
+  for (const Instruction &instruction : instructions) {
+    if (info.stackDepth[instruction.offset] < 0) {
+      continue;
+    }
+    size_t depth = info.stackDepth[instruction.offset];
+    if (isTarget[instruction.offset]) {
+      if (fallsThrough) {
+        translator.flush(translator.stack.size());
+      }
+      translator.emitLabel(instruction.offset);
+    }
+    if (isTarget[instruction.offset] || !fallsThrough) {
+      translator.stack.clear();
+      for (size_t i = 0; i < depth; i++) {
+        translator.push({Value::REGISTER, (int64_t)i});
+      }
+    }
+    fallsThrough = true;
+    const int64_t *operands = instruction.operands;
+    switch (instruction.opcode) {
+    case Opcode::IPUSH_CONST:
+      translator.push(
+          {Value::IMMEDIATE, program.constants[operands[0]]});
+      break;
+    case Opcode::IPUSH_IMM:
+      translator.push({Value::IMMEDIATE, operands[0]});
+      break;
+    case Opcode::DUP:
+      translator.push(translator.stack.back());
+      break;
+    case Opcode::DROP:
+      translator.stack.pop_back();
+      break;
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::DIV:
+    case Opcode::LSHIFT:
+    case Opcode::RSHIFT:
+    case Opcode::AND:
+    case Opcode::OR:
+    case Opcode::XOR:
+      translator.binary(instruction.opcode);
+      break;
+    case Opcode::IADD:
+    case Opcode::ISUB:
+    case Opcode::IMUL:
+    case Opcode::IDIV:
+    case Opcode::ILSHIFT:
+    case Opcode::IRSHIFT:
+    case Opcode::IAND:
+    case Opcode::IOR:
+    case Opcode::IXOR:
+      // Each immediate form directly follows its stack form.
+      translator.binaryImmediate((Opcode)((int)instruction.opcode - 1),
+                                 operands[0]);
+      break;
+    case Opcode::LLOAD:
+      translator.load(operands[0]);
+      break;
+    case Opcode::LSTORE:
+      translator.store(operands[0]);
+      break;
+    case Opcode::GOTO:
+      translator.jump(operands[0]);
+      fallsThrough = false;
+      break;
+    case Opcode::CGOTO_EQ:
+    case Opcode::CGOTO_NEQ:
+    case Opcode::CGOTO_GT:
+    case Opcode::CGOTO_LT:
+      translator.branch(instruction.opcode, operands[0]);
+      break;
+    case Opcode::EXIT:
+      translator.exit();
+      fallsThrough = false;
+      break;
+    case Opcode::CALL:
+    case Opcode::RET:
+      // Refused above.
+      break;
+    case Opcode::HLOAD:
+    case Opcode::HSTORE:
+    case Opcode::VADD:
+    case Opcode::VMUL:
+    case Opcode::VAND:
+    case Opcode::VXOR:
+    case Opcode::VSUM:
+    case Opcode::VMIN:
+    case Opcode::VMAX:
+    case Opcode::VFILL:
+    case Opcode::VCOPY:
+    case Opcode::VCOUNT_EQ:
+      // The register VM has no heap either.
+      cerr << "Cannot translate the heap instruction at offset "
+           << instruction.offset << endl;
+      return false;
+    // Superinstructions are translated as the sequences they replace.
+    case Opcode::LINC:
+      translator.load(operands[0]);
+      translator.binaryImmediate(Opcode::ADD, operands[1]);
+      translator.store(operands[0]);
+      break;
+    case Opcode::LADD:
+      translator.load(operands[0]);
+      translator.load(operands[1]);
+      translator.binary(Opcode::ADD);
+      translator.store(operands[2]);
+      break;
+    case Opcode::CGOTO_EQ_IMM:
+    case Opcode::CGOTO_NEQ_IMM:
+    case Opcode::CGOTO_GT_IMM:
+    case Opcode::CGOTO_LT_IMM:
+      translator.push({Value::IMMEDIATE, operands[0]});
+      translator.branch(
+          (Opcode)((int)Opcode::CGOTO_EQ + (int)instruction.opcode -
+                   (int)Opcode::CGOTO_EQ_IMM),
+          operands[1]);
+      break;
+    case Opcode::LCGOTO_EQ_IMM:
+    case Opcode::LCGOTO_NEQ_IMM:
+    case Opcode::LCGOTO_GT_IMM:
+    case Opcode::LCGOTO_LT_IMM:
+      translator.load(operands[0]);
+      translator.push({Value::IMMEDIATE, operands[1]});
+      translator.branch(
+          (Opcode)((int)Opcode::CGOTO_EQ + (int)instruction.opcode -
+                   (int)Opcode::LCGOTO_EQ_IMM),
+          operands[2]);
+      break;
+    case Opcode::LCGOTO_EQ_CONST:
+    case Opcode::LCGOTO_NEQ_CONST:
+    case Opcode::LCGOTO_GT_CONST:
+    case Opcode::LCGOTO_LT_CONST:
+      translator.load(operands[0]);
+      translator.push({Value::IMMEDIATE, program.constants[operands[1]]});
+      translator.branch(
+          (Opcode)((int)Opcode::CGOTO_EQ + (int)instruction.opcode -
+                   (int)Opcode::LCGOTO_EQ_CONST),
+          operands[2]);
+      break;
+    case Opcode::WIDE:
+      // Decoding leaves the prefix out.
+      break;
+    }
+  }
+
+  output << "# Translated from stack VM bytecode" << endl;
+  if (translator.stackRegisters > 0) {
+    output << "# r0-r" << translator.stackRegisters - 1 << ": operand stack"
+           << endl;
+  }
+  for (size_t i = 0; i < info.localCount; i++) {
+    int reg = translator.localRegister[i];
+    if (reg >= 0) {
+      output << "# r" << reg << ": local " << i << endl;
+    } else {
+      output << "# *" << i << ": local " << i << endl;
+    }
+  }
+  for (auto &constant : translator.constantRegister) {
+    output << "# r" << constant.second << ": " << constant.first << endl;
+  }
+  for (const AssemblyLine &line : translator.lines) {
+    if (!line.label.empty()) {
+      output << line.label << ":" << endl;
+      continue;
+    }
+    output << line.mnemonic;
+    for (size_t i = 0; i < line.operands.size(); i++) {
+      output << (i == 0 ? " " : ", ") << line.operands[i];
+    }
+    output << endl;
+  }
+  return true;
+}
+} // namespace bytecode
@@ -0,0 +1,18 @@
+#ifndef _TRANSLATE_H
+#define _TRANSLATE_H
+
+#include "program.h"
+#include <ostream>
+
+namespace bytecode {
+// Translates program into assembly source for the register VM in
+// ../registervm, which assembles it with "vm asm". Stack slots and locals are
+// assigned to registers, so loads, stores, DUP and DROP mostly disappear.
+// Locals that do not fit in the eight registers live in the register VM's
+// memory, at their own index. Reports the problem on cerr and returns false
+// if the program does not verify, has functions, or its operand stack needs
+// more than eight registers.
+bool translateToRegisterVm(const Program &program, std::ostream &output);
+} // namespace bytecode
+
+#endif
@@ -0,0 +1,204 @@
+#include "verify.h"
+#include "bytecode.h"
+#include "program.h"
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::vector;
+
+namespace bytecode {
+// The owner of code outside every function.
+#define MAIN_PROGRAM -1
+
+
+bool verifyProgram(const Program &program, ProgramInfo &info) {
+  // Find the function every byte belongs to.
+  vector<int32_t> owner(program.instructionsSize + 1, MAIN_PROGRAM);
+  for (size_t i = 0; i < program.functionCount; i++) {
+    const Function &function = program.functions[i];
+    if (function.size == 0 ||
+        (uint64_t)function.start + function.size > program.instructionsSize) {
+      cerr << "Function " << i << " is empty or outside the program" << endl;
+      return false;
+    }
+    if (function.argumentCount > function.localCount ||
+        function.localCount > MAX_LOCALS) {
+      cerr << "Function " << i << " has too many arguments or locals" << endl;
+      return false;
+    }
+    for (size_t offset = function.start;
+         offset < function.start + function.size; offset++) {
+      if (owner[offset] != MAIN_PROGRAM) {
+        cerr << "Function " << i << " overlaps function " << owner[offset]
+             << endl;
+        return false;
+      }
+      owner[offset] = i;
+    }
+  }
+  auto localLimit = [&](int32_t function) -> size_t {
+    return function == MAIN_PROGRAM ? MAX_LOCALS
+                                    : program.functions[function].localCount;
+  };
+
+  // Decode everything first, so branch targets can be checked against
+  // instruction boundaries.
+  vector<bool> instructionStart(program.instructionsSize + 1, false);
+  info.localCount = 0;
+  size_t offset = 0;
+  while (offset < program.instructionsSize) {
+    Instruction instruction;
+    if (!decodeInstruction(program, offset, instruction)) {
+      cerr << "Invalid instruction at offset " << offset << endl;
+      return false;
+    }
+    instructionStart[offset] = true;
+    if (owner[offset + instruction.length - 1] != owner[offset]) {
+      cerr << "Instruction at offset " << offset
+           << " crosses the edge of a function" << endl;
+      return false;
+    }
+    const OpcodeInfo &opcode = opcodeInfo(instruction.opcode);
+    for (size_t i = 0; i < MAX_OPERANDS; i++) {
+      int64_t operand = instruction.operands[i];
+      switch (opcode.operands[i]) {
+      case OperandKind::NONE:
+      case OperandKind::IMMEDIATE:
+        break;
+      case OperandKind::CONSTANT:
+        if (operand >= program.header->constantCount) {
+          cerr << "Constant index out of range at offset " << offset << endl;
+          return false;
+        }
+        break;
+      case OperandKind::LOCAL:
+        if ((size_t)operand >= localLimit(owner[offset])) {
+          cerr << "Local index out of range at offset " << offset << endl;
+          return false;
+        }
+        if (owner[offset] == MAIN_PROGRAM &&
+            (size_t)operand >= info.localCount) {
+          info.localCount = operand + 1;
+        }
+        break;
+      case OperandKind::TARGET:
+        break;
+      case OperandKind::FUNCTION:
+        if ((size_t)operand >= program.functionCount) {
+          cerr << "Function index out of range at offset " << offset << endl;
+          return false;
+        }
+        break;
+      }
+    }
+    offset += instruction.length;
+  }
+
+  // Then follow every path from the entry points of the main program and
+  // of every function, tracking the stack depth.
+  info.stackDepth.assign(program.instructionsSize, -1);
+  info.maxStackDepth = 0;
+  info.functionStackDepth.assign(program.functionCount, 0);
+  vector<size_t> worklist;
+  auto reach = [&](size_t from, size_t to, int32_t depth) {
+    if (to == program.instructionsSize) {
+      cerr << "Execution can run off the end of the program after offset "
+           << from << endl;
+      return false;
+    }
+    if (to > program.instructionsSize || !instructionStart[to]) {
+      cerr << "Invalid branch target at offset " << from << endl;
+      return false;
+    }
+    if (owner[to] != owner[from]) {
+      cerr << "Execution can cross into another function after offset "
+           << from << endl;
+      return false;
+    }
+    if (info.stackDepth[to] < 0) {
+      info.stackDepth[to] = depth;
+      worklist.push_back(to);
+    } else if (info.stackDepth[to] != depth) {
+      cerr << "Stack depth " << depth << " at offset " << from
+           << " does not match depth " << info.stackDepth[to]
+           << " already recorded at offset " << to << endl;
+      return false;
+    }
+    return true;
+  };
+  if (program.instructionsSize == 0 || owner[0] != MAIN_PROGRAM) {
+    cerr << "The program is empty" << endl;
+    return false;
+  }
+  info.stackDepth[0] = 0;
+  worklist.push_back(0);
+  for (size_t i = 0; i < program.functionCount; i++) {
+    size_t start = program.functions[i].start;
+    if (!instructionStart[start]) {
+      cerr << "Function " << i << " does not start on an instruction" << endl;
+      return false;
+    }
+    info.stackDepth[start] = 0;
+    worklist.push_back(start);
+  }
+  while (!worklist.empty()) {
+    size_t offset = worklist.back();
+    worklist.pop_back();
+    Instruction instruction;
+    decodeInstruction(program, offset, instruction);
+    const OpcodeInfo &opcode = opcodeInfo(instruction.opcode);
+    int32_t depth = info.stackDepth[offset];
+    int32_t pops = opcode.pops;
+    if (instruction.opcode == Opcode::CALL) {
+      pops += program.functions[instruction.operands[0]].argumentCount;
+    }
+    if (depth < pops) {
+      cerr << "Stack underflow at offset " << offset << endl;
+      return false;
+    }
+    int32_t after = depth - pops + opcode.pushes;
+    if (after > STACK_SIZE) {
+      cerr << "Stack overflow at offset " << offset << endl;
+      return false;
+    }
+    if ((size_t)after > info.maxStackDepth) {
+      info.maxStackDepth = after;
+    }
+    int32_t function = owner[offset];
+    if (function != MAIN_PROGRAM &&
+        (size_t)after > info.functionStackDepth[function]) {
+      info.functionStackDepth[function] = after;
+    }
+    if (instruction.opcode == Opcode::EXIT) {
+      continue;
+    }
+    if (instruction.opcode == Opcode::RET) {
+      if (function == MAIN_PROGRAM) {
+        cerr << "Return outside a function at offset " << offset << endl;
+        return false;
+      }
+      if (depth != 1) {
+        cerr << "Return with " << depth << " values on the stack at offset "
+             << offset << endl;
+        return false;
+      }
+      continue;
+    }
+    for (size_t i = 0; i < MAX_OPERANDS; i++) {
+      if (opcode.operands[i] == OperandKind::TARGET &&
+          !reach(offset, instruction.operands[i], after)) {
+        return false;
+      }
+    }
+    if (instruction.opcode != Opcode::GOTO &&
+        !reach(offset, offset + instruction.length, after)) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace bytecode
@@ -0,0 +1,39 @@
+#ifndef _VERIFY_H
+#define _VERIFY_H
+
+#include "program.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace bytecode {
+// What the verifier learned about a program.
+struct ProgramInfo {
+  // Operand stack depth on entry to the instruction at each byte offset,
+  // counted from the start of the function it is in, or -1 if no instruction
+  // that can be reached starts there.
+  std::vector<int32_t> stackDepth;
+  // The deepest the operand stack gets in the main program or any function
+  // on its own.
+  size_t maxStackDepth;
+  // The deepest the operand stack of each function gets, counted from the
+  // start of the function.
+  std::vector<size_t> functionStackDepth;
+  // One more than the highest local the main program uses.
+  size_t localCount;
+};
+
+// Checks that program is safe to run with no checks in the engines other
+// than on the depth of calls: every instruction decodes, constant, local and
+// function indices are in range, every function lies on instruction
+// boundaries without overlapping another, every branch lands on an
+// instruction in the same function (or in the main program), and on every
+// path the operand stack has a single depth at each instruction, never
+// underflows and never exceeds STACK_SIZE. The main program must end at an
+// EXIT, and functions at an EXIT or at a RET with exactly one value on their
+// operand stack, rather than running off their end.
+// Reports the first problem on cerr and returns false if any check fails.
+bool verifyProgram(const Program &program, ProgramInfo &info);
+} // namespace bytecode
+
+#endif